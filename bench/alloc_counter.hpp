@@ -0,0 +1,85 @@
+#ifndef _ALLOC_COUNTER_HPP_
+#define _ALLOC_COUNTER_HPP_
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+/// Counts heap allocations of all threads, for benchmarks that measure them
+/// With glibc it replaces malloc, calloc and realloc, so the allocations of libzmq and operator new are counted,
+/// elsewhere it replaces the global operator new and delete and counts only those
+/// Include it in one translation unit of an executable only
+namespace AllocCounter {
+static std::atomic<long long> allocations(0);
+
+/// Get the number of allocations since the program started
+inline long long get() {
+	return allocations.load(std::memory_order_relaxed);
+}
+
+inline void count() {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+}
+}
+
+#ifdef __GLIBC__
+
+extern "C" void * __libc_malloc(size_t size);
+extern "C" void * __libc_calloc(size_t count, size_t size);
+extern "C" void * __libc_realloc(void * memory, size_t size);
+
+extern "C" void * malloc(size_t size) {
+	AllocCounter::count();
+	return __libc_malloc(size);
+}
+
+extern "C" void * calloc(size_t count, size_t size) {
+	AllocCounter::count();
+	return __libc_calloc(count, size);
+}
+
+extern "C" void * realloc(void * memory, size_t size) {
+	AllocCounter::count();
+	return __libc_realloc(memory, size);
+}
+
+#else
+
+namespace AllocCounter {
+inline void * allocate(size_t size) {
+	count();
+	void * memory = malloc(size ? size : 1);
+	if (!memory) {
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+}
+
+void * operator new(size_t size) {
+	return AllocCounter::allocate(size);
+}
+
+void * operator new[](size_t size) {
+	return AllocCounter::allocate(size);
+}
+
+void operator delete(void * memory) noexcept {
+	free(memory);
+}
+
+void operator delete[](void * memory) noexcept {
+	free(memory);
+}
+
+void operator delete(void * memory, size_t) noexcept {
+	free(memory);
+}
+
+void operator delete[](void * memory, size_t) noexcept {
+	free(memory);
+}
+
+#endif // __GLIBC__
+
+#endif // _ALLOC_COUNTER_HPP_
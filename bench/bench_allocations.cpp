@@ -0,0 +1,89 @@
+// Allocations made when parsing a message with nested AttrListValues and taking its value out
+// Each inner list holds strings, plugins, ints and a string list, the shape that used to be deep copied
+
+#include "alloc_counter.hpp"
+#include "bench_common.hpp"
+
+using namespace VRayBaseTypes;
+
+/// Make a property update with an AttrListValue of @lists AttrListValues, 31 items each
+static MessageParts makeNestedMessage(int lists) {
+	AttrListValue outer;
+	char name[64];
+	for (int c = 0; c < lists; ++c) {
+		AttrListValue inner;
+		for (int i = 0; i < 10; ++i) {
+			snprintf(name, sizeof(name), "string value %d.%d", c, i);
+			inner.append(AttrValue(std::string(name)));
+			snprintf(name, sizeof(name), "OBNode@Cube.%03d.%d", c, i);
+			inner.append(AttrValue(AttrPlugin(name)));
+			inner.append(AttrValue(c * 10 + i));
+		}
+		AttrListString strings(5);
+		for (int i = 0; i < 5; ++i) {
+			snprintf(name, sizeof(name), "channel name %d", i);
+			(*strings)[i] = name;
+		}
+		inner.append(AttrValue(std::move(strings)));
+		outer.append(AttrValue(std::move(inner)));
+	}
+	return VRayMessage::msgPluginSetProperty("OBNode@Nested", "user_attributes", outer);
+}
+
+int main(int argc, char ** argv) {
+	const bool quick = isQuickRun(argc, argv);
+	const int lists = 100;
+	const int rounds = quick ? 10 : 2000;
+
+	MessageParts message = makeNestedMessage(lists);
+	long long parseAllocations = 0;
+	long long takeAllocations = 0;
+	long long copyAllocations = 0;
+	bool parsed = true;
+	BenchTimer timer;
+	for (int round = 0; round < rounds; ++round) {
+		// parsing takes the payload, each round parses a copy sharing its data
+		zmq::message_t payload;
+		payload.copy(&message.payload);
+		const long long before = AllocCounter::get();
+		VRayMessage decoded(VRayMessage::fromZmqMessage(payload));
+		const AttrListValue * list = decoded.getValue<AttrListValue>();
+		const long long afterParse = AllocCounter::get();
+		parsed = parsed && list && list->getCount() == lists;
+		AttrValue value = decoded.takeAttrValue();
+		const long long afterTake = AllocCounter::get();
+		AttrValue copy(value);
+		const long long afterCopy = AllocCounter::get();
+
+		parseAllocations += afterParse - before;
+		takeAllocations += afterTake - afterParse;
+		copyAllocations += afterCopy - afterTake;
+		parsed = parsed && value.type == ValueTypeListValue && copy.type == ValueTypeListValue;
+	}
+	const double seconds = timer.seconds();
+
+	printf("AttrListValue of %d AttrListValues with 31 items each, %d rounds\n", lists, rounds);
+	printf("allocations per parse:        %lld\n", parseAllocations / rounds);
+	printf("allocations per takeAttrValue: %lld\n", takeAllocations / rounds);
+	printf("allocations per value copy:    %lld (lists are shared)\n", copyAllocations / rounds);
+	printf("us per round:                  %.1f\n", seconds * 1e6 / rounds);
+
+	if (!parsed) {
+		puts("FAILED: the message did not parse");
+		return 1;
+	}
+	// each inner list allocates its 10 long strings, its 10 plugins, and its storage and the string list's,
+	// the 5 channel names and the ints fit in place
+	const long long pluginAllocations = 1 + AttrValueStorage<AttrPlugin>::outOfLine;
+	const long long listAllocations = 2;
+	const long long expected = lists * (10 + 10 * pluginAllocations + 2 * listAllocations) + listAllocations;
+	if (parseAllocations != expected * rounds) {
+		printf("FAILED: expected %lld allocations per parse\n", expected);
+		return 1;
+	}
+	if (takeAllocations) {
+		puts("FAILED: takeAttrValue allocated");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,93 @@
+// Throughput of a synthetic scene of small property updates sent through ZmqClient to a local server,
+// with each message sent alone and with setBatching packing them in DATA_BATCH_MSG frames
+// Prints the time from the first send until the server received the last message and checks every batch size
+// delivered the same messages in the same order as sending them alone
+
+#include "bench_common.hpp"
+#include "bench_server.hpp"
+
+struct BatchingResult {
+	double seconds;
+	long long frames;
+	long long bytes;
+	uint64_t digest;
+	bool received;
+};
+
+/// Send @properties int, float and color updates spread over plugins of 10 properties each
+static BatchingResult measure(const char * addr, int batchBytes, int properties) {
+	using namespace VRayBaseTypes;
+	BenchServer server(addr);
+	ZmqClient client;
+	if (batchBytes) {
+		client.setBatching(batchBytes);
+	}
+	client.connect(addr);
+	while (!client.connected() && client.good()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	const char * names[10] = {"visible", "objectID", "diffuse", "reflect", "glossiness",
+	                          "primary_visibility", "subdivs", "color", "weight", "ior"};
+	char plugin[64];
+	BenchTimer timer;
+	for (int c = 0; c < properties; ++c) {
+		snprintf(plugin, sizeof(plugin), "OBNode@Cube.%06d", c / 10);
+		const char * property = names[c % 10];
+		switch (c % 3) {
+		case 0:
+			client.send(VRayMessage::msgPluginSetProperty(plugin, property, AttrValue(c)));
+			break;
+		case 1:
+			client.send(VRayMessage::msgPluginSetProperty(plugin, property, AttrValue(c * 0.5f)));
+			break;
+		default:
+			client.send(VRayMessage::msgPluginSetProperty(plugin, property, AttrColor(0.1f, 0.2f, 0.3f)));
+			break;
+		}
+	}
+	const bool received = server.waitForMessages(properties, 60000);
+	const BatchingResult result = {timer.seconds(), server.getFrames(), server.getBytes(), server.getDigest(), received};
+	return result;
+}
+
+int main(int argc, char ** argv) {
+	const bool quick = isQuickRun(argc, argv);
+	const int properties = quick ? 20000 : 1000000;
+
+	printf("%d property updates\n", properties);
+	printf("batch bytes    frames       bytes      ms   Mmsg/s\n");
+	const int batchSizes[] = {0, 4 * 1024, DEFAULT_BATCH_MAX_BYTES, 256 * 1024};
+	bool received = true;
+	bool same = true;
+	bool packed = true;
+	uint64_t digest = 0;
+	for (int batchBytes : batchSizes) {
+		const BatchingResult result = measure("tcp://127.0.0.1:5611", batchBytes, properties);
+		printf("%11d %9lld %11lld %7.0f %8.2f\n", batchBytes, result.frames, result.bytes,
+		       result.seconds * 1000, properties / result.seconds / 1e6);
+		received = received && result.received;
+		if (!batchBytes) {
+			digest = result.digest;
+			packed = packed && result.frames == properties;
+		} else {
+			same = same && result.digest == digest;
+			// the updates are about 50 bytes, so even the smallest batch holds dozens of them
+			packed = packed && result.frames * 10 < properties;
+		}
+	}
+
+	if (!received) {
+		puts("FAILED: the server did not receive all messages");
+		return 1;
+	}
+	if (!same) {
+		puts("FAILED: batches did not unpack to the messages sent alone");
+		return 1;
+	}
+	if (!packed) {
+		puts("FAILED: messages were not sent alone without batching or not packed with it");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef _BENCH_COMMON_HPP_
+#define _BENCH_COMMON_HPP_
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "zmq_message.hpp"
+
+/// Check for --quick in the arguments, benchmarks do a short run with it so ctest can use them as smoke tests
+inline bool isQuickRun(int argc, char ** argv) {
+	for (int c = 1; c < argc; ++c) {
+		if (!strcmp(argv[c], "--quick")) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/// Measures wall time from construction
+class BenchTimer {
+public:
+	BenchTimer()
+	    : start(std::chrono::steady_clock::now())
+	{}
+
+	/// Get the seconds since construction
+	double seconds() const {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+private:
+	std::chrono::steady_clock::time_point start;
+};
+
+/// Keeps built messages in order, committing the names they define as ZmqClient does when queueing them
+class BenchMessages {
+public:
+	explicit BenchMessages(const MessageFormat & format)
+	    : format(format)
+	{}
+
+	void push_back(MessageParts && message) {
+		if (format.strings) {
+			format.strings->commit(message.definitions);
+		}
+		messages.push_back(std::move(message));
+	}
+
+	std::vector<MessageParts> take() {
+		return std::move(messages);
+	}
+
+private:
+	const MessageFormat & format;
+	std::vector<MessageParts> messages;
+};
+
+/// Make the messages of a synthetic scene export: @objects nodes sharing a quarter as many small meshes and
+/// 40 materials, with the renderer setup before and start after them
+inline std::vector<MessageParts> makeBenchScene(int objects, const MessageFormat & format) {
+	using namespace VRayBaseTypes;
+	BenchMessages out(format);
+	out.push_back(VRayMessage::msgRendererActionInit(VRayMessage::RendererType::RT, VRayMessage::DRFlags::None, format));
+	out.push_back(VRayMessage::msgRendererResize(1920, 1080, format));
+	out.push_back(VRayMessage::msgRendererAction(VRayMessage::RendererAction::SetCurrentFrame, 1.f, format));
+
+	const int meshes = std::max(objects / 4, 1);
+	char node[64], geom[64], mtl[64];
+	for (int o = 0; o < objects; ++o) {
+		snprintf(node, sizeof(node), "OBNode@Cube.%03d", o);
+		snprintf(geom, sizeof(geom), "OBGeometry@Cube.%03d|MeshData", o % meshes);
+		snprintf(mtl, sizeof(mtl), "MAMaterial@Mat.%03d", o % 40);
+
+		AttrTransform tm = AttrTransform::identity();
+		tm.offs = AttrVector(static_cast<float>(o), static_cast<float>(o * 2), 0.f);
+		out.push_back(VRayMessage::msgPluginCreate(node, "Node", format));
+		out.push_back(VRayMessage::msgPluginSetProperty(node, "transform", tm, GeometryEncoding::None, format));
+		out.push_back(VRayMessage::msgPluginSetProperty(node, "geometry", AttrPlugin(geom), GeometryEncoding::None, format));
+		out.push_back(VRayMessage::msgPluginSetProperty(node, "material", AttrPlugin(mtl), GeometryEncoding::None, format));
+		out.push_back(VRayMessage::msgPluginSetProperty(node, "visible", AttrValue(1), GeometryEncoding::None, format));
+		out.push_back(VRayMessage::msgPluginSetProperty(node, "objectID", AttrValue(o), GeometryEncoding::None, format));
+
+		if (o < meshes) {
+			const int vertices = 8 + (o % 7) * 30;
+			AttrListVector vertexList(vertices);
+			AttrListInt faceList(vertices * 2);
+			for (int c = 0; c < vertices; ++c) {
+				(*vertexList)[c] = AttrVector(static_cast<float>(c), static_cast<float>(c), static_cast<float>(c));
+			}
+			for (int c = 0; c < vertices * 2; ++c) {
+				(*faceList)[c] = c / 2;
+			}
+			out.push_back(VRayMessage::msgPluginCreate(geom, "GeomStaticMesh", format));
+			out.push_back(VRayMessage::msgPluginSetProperty(geom, "vertices", vertexList, GeometryEncoding::None, format));
+			out.push_back(VRayMessage::msgPluginSetProperty(geom, "faces", faceList, GeometryEncoding::None, format));
+			out.push_back(VRayMessage::msgPluginSetProperty(geom, "dynamic_geometry", AttrValue(0), GeometryEncoding::None, format));
+		}
+		if (o < 40) {
+			out.push_back(VRayMessage::msgPluginCreate(mtl, "MtlSingleBRDF", format));
+			out.push_back(VRayMessage::msgPluginSetProperty(mtl, "diffuse", AttrColor(0.5f, 0.5f, 0.5f), GeometryEncoding::None, format));
+			out.push_back(VRayMessage::msgPluginSetProperty(mtl, "reflect_glossiness", AttrValue(0.8f), GeometryEncoding::None, format));
+			out.push_back(VRayMessage::msgPluginSetPropertyString(mtl, "name", "material name", format));
+		}
+	}
+	out.push_back(VRayMessage::msgRendererAction(VRayMessage::RendererAction::Start, format));
+	return out.take();
+}
+
+#endif // _BENCH_COMMON_HPP_
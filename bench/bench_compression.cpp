@@ -0,0 +1,141 @@
+// Ratio and speed of each compiled in codec on mesh messages, with lists sent as they are and Mesh encoded
+// Prints the raw and compressed bytes and the compress / decompress throughput in MB of raw data per second
+
+#include <cmath>
+
+#include "bench_common.hpp"
+#include "zmq_compression.hpp"
+
+struct CompressionResult {
+	size_t rawBytes;
+	size_t compressedBytes;
+	double compressSeconds;
+	double decompressSeconds;
+	bool restored;
+};
+
+/// Make the property messages of a wavy grid mesh with @side * @side vertices
+static std::vector<MessageParts> makeMesh(int side, GeometryEncoding encoding, const MessageFormat & format) {
+	using namespace VRayBaseTypes;
+	AttrListVector vertices(side * side);
+	AttrListVector normals(side * side);
+	AttrListInt faces((side - 1) * (side - 1) * 6);
+	for (int y = 0; y < side; ++y) {
+		for (int x = 0; x < side; ++x) {
+			const float height = sinf(x * 0.1f) * cosf(y * 0.1f);
+			(*vertices)[y * side + x] = AttrVector(static_cast<float>(x), static_cast<float>(y), height);
+			(*normals)[y * side + x] = AttrVector(-cosf(x * 0.1f) * 0.1f, sinf(y * 0.1f) * 0.1f, 1.f);
+		}
+	}
+	int face = 0;
+	for (int y = 0; y < side - 1; ++y) {
+		for (int x = 0; x < side - 1; ++x) {
+			const int corner = y * side + x;
+			const int quad[6] = {corner, corner + 1, corner + side, corner + 1, corner + side + 1, corner + side};
+			for (int c = 0; c < 6; ++c) {
+				(*faces)[face++] = quad[c];
+			}
+		}
+	}
+
+	std::vector<MessageParts> messages;
+	messages.push_back(VRayMessage::msgPluginSetProperty("OBGeometry@Grid|MeshData", "vertices", vertices, encoding, format));
+	messages.push_back(VRayMessage::msgPluginSetProperty("OBGeometry@Grid|MeshData", "normals", normals, encoding, format));
+	messages.push_back(VRayMessage::msgPluginSetProperty("OBGeometry@Grid|MeshData", "faces", faces, encoding, format));
+	return messages;
+}
+
+static size_t totalSize(const MessageParts & message) {
+	size_t size = message.payload.size();
+	for (const auto & frame : message.external) {
+		size += frame.size();
+	}
+	return size;
+}
+
+static CompressionResult measure(CompressionCodec codec, int level, GeometryEncoding encoding, int side, int rounds) {
+	MessageFormat format;
+	format.wireFormat = WireFormat::V2;
+	format.compressed = true;
+	CompressionResult result = {0, 0, 0, 0, true};
+	for (int round = 0; round < rounds; ++round) {
+		std::vector<MessageParts> messages = makeMesh(side, encoding, format);
+		std::vector<size_t> rawSizes;
+		result.rawBytes = 0;
+		for (const auto & message : messages) {
+			rawSizes.push_back(totalSize(message));
+			result.rawBytes += rawSizes.back();
+		}
+
+		std::vector<zmq::message_t> headers(messages.size());
+		std::vector<bool> compressed(messages.size());
+		BenchTimer compressTimer;
+		for (size_t c = 0; c < messages.size(); ++c) {
+			compressed[c] = PayloadCompression::compress(codec, level, messages[c], headers[c]);
+		}
+		result.compressSeconds += compressTimer.seconds();
+
+		result.compressedBytes = 0;
+		for (size_t c = 0; c < messages.size(); ++c) {
+			result.compressedBytes += totalSize(messages[c]) + headers[c].size();
+		}
+
+		BenchTimer decompressTimer;
+		for (size_t c = 0; c < messages.size(); ++c) {
+			if (compressed[c]) {
+				result.restored = PayloadCompression::decompress(headers[c], messages[c]) && result.restored;
+			}
+		}
+		result.decompressSeconds += decompressTimer.seconds();
+
+		for (size_t c = 0; c < messages.size(); ++c) {
+			result.restored = result.restored && totalSize(messages[c]) == rawSizes[c]
+				&& VRayMessage::fromZmqMessage(messages[c]).getType() == VRayMessage::Type::ChangePlugin;
+		}
+	}
+	return result;
+}
+
+int main(int argc, char ** argv) {
+	const bool quick = isQuickRun(argc, argv);
+	const int side = quick ? 200 : 1000;
+	const int rounds = quick ? 1 : 10;
+
+	struct {
+		CompressionCodec codec;
+		int level;
+		const char * name;
+	} codecs[] = {
+		{CompressionCodec::LZ4, 0, "LZ4"},
+		{CompressionCodec::Zstd, 1, "Zstd 1"},
+		{CompressionCodec::Zstd, 3, "Zstd 3"},
+	};
+
+	printf("mesh: %d vertices, %d rounds\n", side * side, rounds);
+	printf("codec    encoding       raw bytes   compressed  ratio  compress MB/s  decompress MB/s\n");
+	bool restored = true;
+	int measured = 0;
+	for (const auto & codec : codecs) {
+		if (!(PayloadCompression::supportedCodecs() & static_cast<int>(codec.codec))) {
+			continue;
+		}
+		for (GeometryEncoding encoding : {GeometryEncoding::None, GeometryEncoding::Mesh}) {
+			const CompressionResult result = measure(codec.codec, codec.level, encoding, side, rounds);
+			const double megabytes = static_cast<double>(result.rawBytes) * rounds / (1024 * 1024);
+			printf("%-8s %-8s %15zu %12zu %6.3f %14.1f %16.1f\n", codec.name, encoding == GeometryEncoding::Mesh ? "Mesh" : "None",
+			       result.rawBytes, result.compressedBytes, static_cast<double>(result.compressedBytes) / result.rawBytes,
+			       megabytes / result.compressSeconds, megabytes / result.decompressSeconds);
+			restored = restored && result.restored;
+			++measured;
+		}
+	}
+
+	if (!measured) {
+		puts("no codec compiled in, build with VRAY_ZMQ_USE_LZ4 or VRAY_ZMQ_USE_ZSTD");
+	}
+	if (!restored) {
+		puts("FAILED: some messages were not restored");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,121 @@
+// Scaling of ParallelExporter with the number of threads building messages, against building and sending
+// them on the calling thread. Prints the time until all messages are queued in the client and checks the
+// server received the same sequence of messages for every thread count
+// The scene has 1M properties: node transforms and ints, material colors and small mesh lists
+
+#include <thread>
+
+#include "bench_common.hpp"
+#include "bench_server.hpp"
+#include "parallel_exporter.hpp"
+
+using namespace VRayBaseTypes;
+
+/// Make the name of plugin @p of the batch, a quarter of them are meshes
+static std::string makePluginName(int p) {
+	char plugin[64];
+	snprintf(plugin, sizeof(plugin), p % 4 == 0 ? "OBGeometry@Cube.%06d|MeshData" : "OBNode@Cube.%06d", p);
+	return plugin;
+}
+
+/// Make a batch creating @plugins plugins and then setting 10 properties of each, meshes get 3 lists
+/// Creates come first as the exporter sends them, so no ordering of the exporter changes the sequence
+static ParallelExporter::Batch makeBatch(int plugins) {
+	ParallelExporter::Batch batch;
+	batch.reserve(plugins * 11);
+	for (int p = 0; p < plugins; ++p) {
+		batch.push_back(ParallelExporter::Item::create(makePluginName(p), p % 4 == 0 ? "GeomStaticMesh" : "Node"));
+	}
+	for (int p = 0; p < plugins; ++p) {
+		const bool mesh = p % 4 == 0;
+		const std::string plugin = makePluginName(p);
+		for (int c = 0; c < 10; ++c) {
+			char property[32];
+			snprintf(property, sizeof(property), "property_%d", c);
+			AttrValue value;
+			if (mesh && c < 3) {
+				AttrListVector vertices(64);
+				for (int v = 0; v < 64; ++v) {
+					(*vertices)[v] = AttrVector(static_cast<float>(v), static_cast<float>(p), static_cast<float>(c));
+				}
+				value = AttrValue(std::move(vertices));
+			} else if (c == 3) {
+				AttrTransform tm = AttrTransform::identity();
+				tm.offs = AttrVector(static_cast<float>(p), 0.f, 0.f);
+				value = AttrValue(tm);
+			} else if (c % 2) {
+				value = AttrValue(AttrColor(0.5f, static_cast<float>(c) / 10, 0.5f));
+			} else {
+				value = AttrValue(p * 10 + c);
+			}
+			batch.push_back(ParallelExporter::Item::update(plugin, property, std::move(value)));
+		}
+	}
+	return batch;
+}
+
+struct ExportResult {
+	double seconds;
+	uint64_t digest;
+	bool received;
+};
+
+/// Queue @batch with @threads exporter threads, or on the calling thread with msg* and send if @threads is 0
+static ExportResult measure(const char * addr, int threads, int plugins) {
+	BenchServer server(addr);
+	ZmqClient client;
+	client.connect(addr);
+	while (!client.connected() && client.good()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	ParallelExporter::Batch batch = makeBatch(plugins);
+	const long long expected = static_cast<long long>(batch.size());
+
+	BenchTimer timer;
+	if (threads) {
+		ParallelExporter exporter(client, threads);
+		exporter.exportBatch(std::move(batch));
+	} else {
+		for (const auto & item : batch) {
+			if (item.action == VRayMessage::PluginAction::Create) {
+				client.send(VRayMessage::msgPluginCreate(item.plugin, item.name));
+			} else {
+				client.send(VRayMessage::msgPluginSetProperty(item.plugin, item.name, item.value));
+			}
+		}
+	}
+	const double seconds = timer.seconds();
+	const bool received = server.waitForMessages(expected, 60000);
+	const ExportResult result = {seconds, server.getDigest(), received};
+	return result;
+}
+
+int main(int argc, char ** argv) {
+	const bool quick = isQuickRun(argc, argv);
+	const int plugins = quick ? 2000 : 100000;
+	const int cores = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+	const int maxThreads = quick ? 2 : std::max(cores, 4);
+
+	printf("%d plugins, %d properties, %d hardware threads\n", plugins, plugins * 10, cores);
+	const ExportResult serial = measure("tcp://127.0.0.1:5612", 0, plugins);
+	printf("threads        ms   speedup\n");
+	printf("serial %10.0f %9.2f\n", serial.seconds * 1000, 1.0);
+	bool received = serial.received;
+	bool same = true;
+	for (int threads = 1; threads <= maxThreads; threads *= 2) {
+		const ExportResult result = measure("tcp://127.0.0.1:5612", threads, plugins);
+		printf("%6d %10.0f %9.2f\n", threads, result.seconds * 1000, serial.seconds / result.seconds);
+		received = received && result.received;
+		same = same && result.digest == serial.digest;
+	}
+
+	if (!received) {
+		puts("FAILED: the server did not receive all messages");
+		return 1;
+	}
+	if (!same) {
+		puts("FAILED: the exporter sent a different sequence than sending on the calling thread");
+		return 1;
+	}
+	return 0;
+}
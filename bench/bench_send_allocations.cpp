@@ -0,0 +1,88 @@
+// Heap allocations of making small property updates with VRayMessage::msg* and sending them through ZmqClient
+// in steady state, counted in all threads of the process, the local server included
+// The sends are paced so the worker keeps up as in an interactive session, the queue nodes and payload
+// blocks it frees are then reused by the next messages
+// Checks that batched sends make no allocations - the payload is copied into the batch and its block returned
+// to the pool - and that unbatched sends make one, the reference counted frame zmq sends the block with
+
+#include "alloc_counter.hpp"
+#include "bench_common.hpp"
+#include "bench_server.hpp"
+
+struct SendResult {
+	double allocationsPerSend;
+	double seconds;
+	bool received;
+};
+
+/// Make and send @sends float updates with the format of the client, waiting for the worker every @pace sends
+static SendResult measure(const char * addr, int batchBytes, int sends, int pace) {
+	using namespace VRayBaseTypes;
+	BenchServer server(addr);
+	ZmqClient client;
+	if (batchBytes) {
+		client.setBatching(batchBytes);
+	}
+	client.connect(addr);
+	while (!client.connected() && client.good()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	const MessageFormat format = client.getMessageFormat();
+
+	// names fit std::string's inline buffer, so only the message and its sending allocate
+	char plugin[16];
+	auto sendUpdates = [&client, &format, &plugin, pace](int from, int to) {
+		for (int c = from; c < to; ++c) {
+			snprintf(plugin, sizeof(plugin), "OBNode@%06d", c % 1000);
+			client.send(VRayMessage::msgPluginSetProperty(plugin, "weight", AttrSimpleType<float>(c * 0.5f), GeometryEncoding::None, format));
+			if (c % pace == pace - 1) {
+				client.waitForMessages(1000);
+			}
+		}
+		client.waitForMessages(1000);
+	};
+
+	// the first round fills the pools
+	sendUpdates(0, sends);
+	const long long before = AllocCounter::get();
+	BenchTimer timer;
+	sendUpdates(sends, 2 * sends);
+	const double seconds = timer.seconds();
+	const long long allocations = AllocCounter::get() - before;
+	const bool received = server.waitForMessages(2 * sends, 10000);
+	const SendResult result = {static_cast<double>(allocations) / sends, seconds, received};
+	return result;
+}
+
+int main(int argc, char ** argv) {
+	const bool quick = isQuickRun(argc, argv);
+	const int sends = quick ? 20000 : 200000;
+	const int pace = 200;
+
+	printf("%d property updates, waiting for the worker every %d\n", sends, pace);
+	printf("batch bytes   allocations per send   us per send\n");
+	bool received = true;
+	double batchedAllocations = 0;
+	double unbatchedAllocations = 0;
+	const int batchSizes[] = {0, DEFAULT_BATCH_MAX_BYTES};
+	for (int batchBytes : batchSizes) {
+		const SendResult result = measure("tcp://127.0.0.1:5613", batchBytes, sends, pace);
+		printf("%11d %22.3f %13.2f\n", batchBytes, result.allocationsPerSend, result.seconds * 1e6 / sends);
+		received = received && result.received;
+		(batchBytes ? batchedAllocations : unbatchedAllocations) = result.allocationsPerSend;
+	}
+
+	if (!received) {
+		puts("FAILED: the server did not receive all messages");
+		return 1;
+	}
+	if (batchedAllocations > 0.05) {
+		puts("FAILED: batched sends allocate");
+		return 1;
+	}
+	if (unbatchedAllocations > 1.05) {
+		puts("FAILED: unbatched sends allocate more than zmq's frame");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,108 @@
+// Enqueue throughput of the send queue from 1..N producer threads with the worker popping concurrently
+// Compares MPSCQueue with the mutex guarded std::deque ZmqClient used before it
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "bench_common.hpp"
+#include "mpsc_queue.hpp"
+
+/// The queue ZmqClient used before MPSCQueue - every push and pop takes the mutex
+class LockedQueue {
+public:
+	void push(zmq::message_t && value) {
+		std::lock_guard<std::mutex> lock(mutex);
+		items.push_back(std::move(value));
+	}
+
+	bool pop(zmq::message_t & value) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (items.empty()) {
+			return false;
+		}
+		value = std::move(items.front());
+		items.pop_front();
+		return true;
+	}
+
+private:
+	std::mutex mutex;
+	std::deque<zmq::message_t> items;
+};
+
+struct QueueResult {
+	double seconds;
+	bool ordered;
+};
+
+/// Push @total messages split between @producers threads while one consumer pops them
+/// Each message carries its producer and sequence number, the consumer checks every producer's messages
+/// arrive complete and in the order they were pushed
+template <typename Queue>
+static QueueResult measure(int producers, int total) {
+	Queue queue;
+	const int perThread = total / producers;
+	const int expected = perThread * producers;
+	bool ordered = true;
+	BenchTimer timer;
+
+	std::thread consumer([&queue, &ordered, expected, producers] {
+		std::vector<int> next(producers, 0);
+		zmq::message_t item;
+		for (int popped = 0; popped < expected; ) {
+			if (!queue.pop(item)) {
+				std::this_thread::yield();
+				continue;
+			}
+			int tag[3];
+			memcpy(tag, item.data(), sizeof(tag));
+			ordered = ordered && tag[0] >= 0 && tag[0] < producers && tag[1] == next[tag[0]];
+			if (tag[0] >= 0 && tag[0] < producers) {
+				next[tag[0]] = tag[1] + 1;
+			}
+			++popped;
+		}
+	});
+
+	std::vector<std::thread> threads;
+	for (int c = 0; c < producers; ++c) {
+		threads.emplace_back([&queue, perThread, c] {
+			for (int i = 0; i < perThread; ++i) {
+				// ControlFrame sized, zmq keeps it inline so only the queue is measured
+				const int tag[3] = {c, i, 0};
+				queue.push(zmq::message_t(tag, sizeof(tag)));
+			}
+		});
+	}
+	for (auto & thread : threads) {
+		thread.join();
+	}
+	consumer.join();
+	const QueueResult result = {timer.seconds(), ordered};
+	return result;
+}
+
+int main(int argc, char ** argv) {
+	const bool quick = isQuickRun(argc, argv);
+	const int total = quick ? 100000 : 4000000;
+	const int maxProducers = quick ? 4 : std::max(8, static_cast<int>(std::thread::hardware_concurrency()));
+
+	printf("%d messages, %u hardware threads\n", total, std::thread::hardware_concurrency());
+	printf("producers   mutex Mmsg/s   MPSC Mmsg/s   speedup\n");
+	bool ordered = true;
+	for (int producers = 1; producers <= maxProducers; producers *= 2) {
+		const QueueResult locked = measure<LockedQueue>(producers, total);
+		const QueueResult lockFree = measure<MPSCQueue<zmq::message_t>>(producers, total);
+		printf("%9d %14.2f %13.2f %9.2f\n", producers, total / locked.seconds / 1e6, total / lockFree.seconds / 1e6,
+		       locked.seconds / lockFree.seconds);
+		ordered = ordered && locked.ordered && lockFree.ordered;
+	}
+
+	if (!ordered) {
+		puts("FAILED: messages of a producer were lost or reordered");
+		return 1;
+	}
+	return 0;
+}
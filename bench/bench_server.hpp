@@ -0,0 +1,164 @@
+#ifndef _BENCH_SERVER_HPP_
+#define _BENCH_SERVER_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+#include "zmq_wrapper.hpp"
+
+/// Server end of the exporter protocol for benchmarks running a ZmqClient against a local address
+/// Answers the handshake with no extensions, heartbeats and pings, and counts the data messages it receives -
+/// each message of a DATA_BATCH_MSG counts on its own. A digest of all message data in arrival order lets
+/// benchmarks check that different ways of sending delivered the same sequence
+class BenchServer {
+public:
+	explicit BenchServer(const char * addr)
+	    : context(1)
+	    , socket(context, ZMQ_ROUTER)
+	    , running(true)
+	    , messages(0)
+	    , frames(0)
+	    , bytes(0)
+	    , digest(FNV_OFFSET)
+	{
+		const int linger = 0;
+		const int wait = 50;
+		this->socket.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+		this->socket.setsockopt(ZMQ_RCVTIMEO, &wait, sizeof(wait));
+		this->socket.bind(addr);
+		this->thread = std::thread(&BenchServer::loop, this);
+	}
+
+	~BenchServer() {
+		this->running = false;
+		this->thread.join();
+	}
+
+	BenchServer(const BenchServer &) = delete;
+	BenchServer & operator=(const BenchServer &) = delete;
+
+	/// Get the number of data messages received
+	long long getMessages() const {
+		return this->messages;
+	}
+
+	/// Get the number of data frames received, a batch is one frame
+	long long getFrames() const {
+		return this->frames;
+	}
+
+	/// Get the size of all received data frames
+	long long getBytes() const {
+		return this->bytes;
+	}
+
+	/// Get the digest of the data of all messages received so far, valid after waitForMessages
+	uint64_t getDigest() const {
+		return this->digest;
+	}
+
+	/// Block until at least @count data messages arrived
+	/// @return - false if they did not arrive in @timeout milliseconds
+	bool waitForMessages(long long count, int timeout) {
+		const auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+		while (this->messages < count) {
+			if (std::chrono::steady_clock::now() > end) {
+				return false;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}
+		return true;
+	}
+
+private:
+	static const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+
+	/// Add @size bytes at @data to the digest, FNV-1a
+	void addDigest(const void * data, size_t size) {
+		const unsigned char * bytes = static_cast<const unsigned char *>(data);
+		uint64_t hash = this->digest;
+		for (size_t c = 0; c < size; ++c) {
+			hash = (hash ^ bytes[c]) * 1099511628211ULL;
+		}
+		this->digest = hash;
+	}
+
+	void reply(zmq::message_t & identity, ClientType type, ControlMessage control, zmq::message_t && payload) {
+		zmq::message_t id;
+		id.copy(&identity);
+		zmq::message_t frame = ControlFrame::make(type, control);
+		this->socket.send(id, ZMQ_SNDMORE);
+		this->socket.send(frame, ZMQ_SNDMORE);
+		this->socket.send(payload);
+	}
+
+	void loop() {
+		while (this->running) {
+			zmq::message_t identity, control, payload;
+			if (!this->socket.recv(&identity)) {
+				continue;
+			}
+			this->socket.recv(&control);
+			this->socket.recv(&payload);
+			std::vector<zmq::message_t> external;
+			int more = 0;
+			size_t moreSize = sizeof(more);
+			this->socket.getsockopt(ZMQ_RCVMORE, &more, &moreSize);
+			while (more) {
+				external.emplace_back();
+				this->socket.recv(&external.back());
+				this->socket.getsockopt(ZMQ_RCVMORE, &more, &moreSize);
+			}
+
+			ControlFrame frame(control);
+			switch (frame.control) {
+			case ControlMessage::EXPORTER_CONNECT_MSG:
+				// clients take an empty answer as a server that knows no extensions
+				reply(identity, frame.type, ControlMessage::RENDERER_CREATE_MSG, zmq::message_t());
+				break;
+			case ControlMessage::HEARTBEAT_CONNECT_MSG:
+				reply(identity, frame.type, ControlMessage::HEARTBEAT_CREATE_MSG, zmq::message_t());
+				break;
+			case ControlMessage::PING_MSG:
+				reply(identity, frame.type, ControlMessage::PONG_MSG, zmq::message_t());
+				break;
+			case ControlMessage::DATA_BATCH_MSG: {
+				int count = 0;
+				MessageBatch::forEach(payload, [this, &count](const char * data, int size) {
+					addDigest(data, size);
+					++count;
+				});
+				// counted after the digest, so a waiter that sees the count sees the digest too
+				this->messages += count;
+				++this->frames;
+				this->bytes += payload.size();
+				break;
+			}
+			case ControlMessage::STOP_MSG:
+				break;
+			default:
+				addDigest(payload.data(), payload.size());
+				++this->frames;
+				this->bytes += payload.size();
+				for (const auto & part : external) {
+					addDigest(part.data(), part.size());
+					this->bytes += part.size();
+				}
+				this->messages += 1;
+				break;
+			}
+		}
+	}
+
+	zmq::context_t context;
+	zmq::socket_t socket;
+	std::thread thread;
+	std::atomic<bool> running;
+	std::atomic<long long> messages;
+	std::atomic<long long> frames;
+	std::atomic<long long> bytes;
+	std::atomic<uint64_t> digest; ///< Written only by the server thread
+};
+
+#endif // _BENCH_SERVER_HPP_
@@ -0,0 +1,110 @@
+// Per-value cost of the AttrValue operations dispatched on ValueType: encode, decode and copy
+// The measured code only uses the public stream operators, so it can be built against older trees to compare
+
+#include "bench_common.hpp"
+
+using namespace VRayBaseTypes;
+
+struct DispatchResult {
+	double encodeNs;
+	double decodeNs;
+	double copyNs;
+	bool decoded;
+};
+
+/// Make @count values of one kind, or of all kinds mixed if @kind is negative
+static std::vector<AttrValue> makeValues(int kind, int count) {
+	std::vector<AttrValue> values;
+	values.reserve(count);
+	for (int c = 0; c < count; ++c) {
+		switch (kind < 0 ? c % 7 : kind) {
+		case 0:
+			values.push_back(AttrValue(c));
+			break;
+		case 1:
+			values.push_back(AttrValue(c * 0.25f));
+			break;
+		case 2:
+			values.push_back(AttrValue(AttrVector(1.f, 2.f, static_cast<float>(c))));
+			break;
+		case 3:
+			values.push_back(AttrValue(AttrColor(0.5f, 0.5f, static_cast<float>(c) / count)));
+			break;
+		case 4: {
+			AttrTransform tm = AttrTransform::identity();
+			tm.offs = AttrVector(static_cast<float>(c), 0.f, 0.f);
+			values.push_back(AttrValue(tm));
+			break;
+		}
+		case 5:
+			values.push_back(AttrValue(std::string("MAMaterial@Mat.001")));
+			break;
+		default:
+			values.push_back(AttrValue(AttrPlugin("OBGeometry@Cube|MeshData")));
+			break;
+		}
+	}
+	return values;
+}
+
+static DispatchResult measure(int kind, int count, int rounds) {
+	const std::vector<AttrValue> values = makeValues(kind, count);
+	DispatchResult result = {0, 0, 0, true};
+
+	SerializerStream stream;
+	BenchTimer encodeTimer;
+	for (int round = 0; round < rounds; ++round) {
+		stream.clear();
+		for (const auto & value : values) {
+			stream << value;
+		}
+	}
+	result.encodeNs = encodeTimer.seconds() * 1e9 / (static_cast<double>(count) * rounds);
+
+	std::vector<AttrValue> decoded(count);
+	BenchTimer decodeTimer;
+	for (int round = 0; round < rounds; ++round) {
+		DeserializerStream input(stream.getData(), stream.getSize());
+		for (auto & value : decoded) {
+			input >> value;
+		}
+	}
+	result.decodeNs = decodeTimer.seconds() * 1e9 / (static_cast<double>(count) * rounds);
+	// the decoded values must encode to the same bytes
+	SerializerStream again;
+	for (const auto & value : decoded) {
+		again << value;
+	}
+	result.decoded = again.getSize() == stream.getSize() && !memcmp(again.getData(), stream.getData(), stream.getSize());
+
+	BenchTimer copyTimer;
+	for (int round = 0; round < rounds; ++round) {
+		for (int c = 0; c < count; ++c) {
+			decoded[c] = values[c];
+		}
+	}
+	result.copyNs = copyTimer.seconds() * 1e9 / (static_cast<double>(count) * rounds);
+	return result;
+}
+
+int main(int argc, char ** argv) {
+	const bool quick = isQuickRun(argc, argv);
+	const int count = 1000;
+	const int rounds = quick ? 20 : 2000;
+
+	printf("%d values, %d rounds\n", count, rounds);
+	printf("type         encode ns  decode ns  copy ns\n");
+	const char * names[] = {"int", "float", "vector", "color", "transform", "string", "plugin"};
+	bool decoded = true;
+	for (int kind = -1; kind < 7; ++kind) {
+		const DispatchResult result = measure(kind, count, rounds);
+		printf("%-12s %9.2f %10.2f %8.2f\n", kind < 0 ? "mixed" : names[kind], result.encodeNs, result.decodeNs, result.copyNs);
+		decoded = decoded && result.decoded;
+	}
+
+	if (!decoded) {
+		puts("FAILED: some values did not decode to what was encoded");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,75 @@
+// Size and speed of a synthetic scene export in each WireFormat, with and without string interning
+// Prints the bytes sent, the time to build and to parse all messages and the sizes relative to V1
+
+#include "bench_common.hpp"
+
+struct WireFormatResult {
+	size_t messages;
+	size_t bytes;
+	double buildSeconds;
+	double parseSeconds;
+	bool parsed;
+};
+
+static WireFormatResult measure(WireFormat wireFormat, bool interning, int objects, int rounds) {
+	MessageFormat format;
+	format.wireFormat = wireFormat;
+	WireFormatResult result = {0, 0, 0, 0, true};
+	for (int round = 0; round < rounds; ++round) {
+		// a new session each round
+		SessionStringTable table;
+		if (interning) {
+			format.strings.reset(new SessionStringEncoder());
+		}
+		BenchTimer buildTimer;
+		std::vector<MessageParts> scene = makeBenchScene(objects, format);
+		result.buildSeconds += buildTimer.seconds();
+
+		result.messages = scene.size();
+		result.bytes = 0;
+		for (const auto & message : scene) {
+			result.bytes += message.size();
+		}
+
+		BenchTimer parseTimer;
+		for (auto & message : scene) {
+			VRayMessage parsed = VRayMessage::fromZmqMessage(message, VRayMessage::ParseDefault, interning ? &table : nullptr);
+			result.parsed = result.parsed && parsed.getType() != VRayMessage::Type::None;
+		}
+		result.parseSeconds += parseTimer.seconds();
+	}
+	return result;
+}
+
+int main(int argc, char ** argv) {
+	const bool quick = isQuickRun(argc, argv);
+	const int objects = quick ? 200 : 20000;
+	const int rounds = quick ? 1 : 5;
+
+	const WireFormatResult v1 = measure(WireFormat::V1, false, objects, rounds);
+	const WireFormatResult v2 = measure(WireFormat::V2, false, objects, rounds);
+	const WireFormatResult v1Interned = measure(WireFormat::V1, true, objects, rounds);
+	const WireFormatResult v2Interned = measure(WireFormat::V2, true, objects, rounds);
+
+	printf("scene: %d objects, %zu messages, %d rounds\n", objects, v1.messages, rounds);
+	printf("format           bytes  / V1   build ms   parse ms\n");
+	const WireFormatResult * results[] = {&v1, &v2, &v1Interned, &v2Interned};
+	const char * names[] = {"V1", "V2", "V1 interned", "V2 interned"};
+	bool parsed = true;
+	for (int c = 0; c < 4; ++c) {
+		const WireFormatResult & result = *results[c];
+		printf("%-12s %10zu %6.3f %10.2f %10.2f\n", names[c], result.bytes, static_cast<double>(result.bytes) / v1.bytes,
+		       result.buildSeconds * 1000 / rounds, result.parseSeconds * 1000 / rounds);
+		parsed = parsed && result.parsed;
+	}
+
+	if (!parsed) {
+		puts("FAILED: some messages did not parse");
+		return 1;
+	}
+	if (v2.bytes >= v1.bytes || v1Interned.bytes >= v1.bytes || v2Interned.bytes >= v2.bytes) {
+		puts("FAILED: V2 or interning does not make the messages smaller");
+		return 1;
+	}
+	return 0;
+}
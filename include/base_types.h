@@ -26,6 +26,10 @@
 #include <unordered_map>
 #include <memory>
 #include <cassert>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
 
 #include <initializer_list>
 
@@ -170,6 +174,8 @@ enum ValueType {
 
 	ValueTypeInstancer,
 	ValueTypeMapChannels,
+
+	ValueTypeCount, ///< Number of value types, must stay last
 };
 
 /// Empty value type used to block export of a attribute
@@ -288,11 +294,18 @@ struct AttrImage {
 	}
 
 	void set(const void * data, size_t size) {
-		this->data.reset(new char[size]);
+		this->data.reset(new char[size], std::default_delete<char[]>());
 		this->size = size;
 		::memcpy(this->data.get(), data, size);
 	}
 
+	/// Refer to existing bytes instead of copying them
+	/// @data - pointer to the bytes, sharing ownership of whatever keeps them alive (see aliasing shared_ptr ctor)
+	void setView(std::shared_ptr<char> data, size_t size) {
+		this->data = std::move(data);
+		this->size = size;
+	}
+
 	std::shared_ptr<char> data; ///< Image bytes data
 	size_t size; ///< Size in bytes
 	int width; ///< Width in pixels
@@ -542,73 +555,159 @@ struct AttrList {
 	ValueType getType() const ;
 
 	AttrList(DataType && data)
-	    : m_Ptr(new DataType(std::move(data)))
+	    : m_Ptr(std::make_shared<DataType>(std::move(data)))
+	    , m_ViewCount(0)
 	{}
 
-	AttrList(std::initializer_list<T> items) {
-		m_Ptr = DataArrayPtr(new DataType(items));
+	AttrList(std::initializer_list<T> items)
+	    : m_ViewCount(0)
+	{
+		m_Ptr = std::make_shared<DataType>(items);
 	}
 
-	AttrList() {
+	AttrList()
+	    : m_ViewCount(0)
+	{
 		init();
 	}
 
-	explicit AttrList(const int &size) {
+	explicit AttrList(const int &size)
+	    : m_ViewCount(0)
+	{
 		init();
 		resize(size);
 	}
 
+	/// Create list that refers to existing items without copying them
+	/// The items are copied only when mutable access is requested (non const operator*, getData, append, etc.),
+	/// const access never changes the list, so a view can be read from many threads
+	/// @items - pointer to the items, sharing ownership of whatever keeps them alive (see aliasing shared_ptr ctor)
+	/// @count - number of items
+	static AttrList view(std::shared_ptr<const T> items, size_t count) {
+		AttrList list((ViewTag()));
+		list.m_View = std::move(items);
+		list.m_ViewCount = count;
+		return list;
+	}
+
+	/// Make the list empty with new storage, copies of the list keep the old items
 	void init() {
-		m_Ptr = DataArrayPtr(new DataType);
+		m_Ptr = std::make_shared<DataType>();
+		m_View.reset();
+		m_ViewCount = 0;
+	}
+
+	/// Make the list empty, reusing the storage if no other list shares it (else same as init)
+	void clear() {
+		if (!m_View && m_Ptr && m_Ptr.use_count() == 1) {
+			m_Ptr.get()->clear();
+		} else {
+			init();
+		}
 	}
 
-	void resize(const int &cnt) {
+	void resize(size_t cnt) {
+		detach();
 		m_Ptr.get()->resize(cnt);
 	}
 
 	void append(const T &value) {
+		detach();
 		m_Ptr.get()->push_back(value);
 	}
 
+	void append(T &&value) {
+		detach();
+		m_Ptr.get()->push_back(std::move(value));
+	}
+
 	void prepend(const T &value) {
+		detach();
 		m_Ptr.get()->insert(0, value);
 	}
 
-	int getCount() const {
-		return static_cast<int>(m_Ptr.get()->size());
+	size_t getCount() const {
+		return m_View ? m_ViewCount : m_Ptr ? m_Ptr.get()->size() : 0;
 	}
 
 	// NOTE: Won't work for AttrList<std::string>
-	int getBytesCount() const {
+	size_t getBytesCount() const {
 		return getCount() * sizeof(T);
 	}
 
 	T* operator * () {
+		detach();
 		return &m_Ptr.get()->at(0);
 	}
 
 	const T* operator * () const {
+		if (m_View) {
+			return m_View.get();
+		}
+		if (!m_Ptr) {
+			throw std::out_of_range("AttrList::operator* on a moved from list");
+		}
 		return &m_Ptr.get()->at(0);
 	}
 
 	operator bool () const {
-		return m_Ptr && m_Ptr.get()->size();
+		return m_View ? m_ViewCount != 0 : m_Ptr && m_Ptr.get()->size();
 	}
 
 	bool empty() const {
-		return !m_Ptr || (m_Ptr.get()->size() == 0);
+		return m_View ? m_ViewCount == 0 : !m_Ptr || (m_Ptr.get()->size() == 0);
+	}
+
+	/// Check if the list refers to items it does not own
+	bool isView() const {
+		return !!m_View;
+	}
+
+	/// Get pointer to the first item without copying a view, nullptr if empty
+	const T * getItems() const {
+		return m_View ? m_View.get() : m_Ptr ? m_Ptr.get()->data() : nullptr;
 	}
 
+	/// Get pointer that keeps getItems() valid
+	std::shared_ptr<const T> getItemsOwner() const {
+		return m_View ? m_View : std::shared_ptr<const T>(m_Ptr, getItems());
+	}
+
+	/// For a view this is a copy of the items and the list stays a view, getItems reads them without copying
 	const DataArrayPtr getData() const {
-		return m_Ptr;
+		if (m_View) {
+			return std::make_shared<DataType>(m_View.get(), m_View.get() + m_ViewCount);
+		}
+		return m_Ptr ? m_Ptr : std::make_shared<DataType>();
 	}
 
 	DataArrayPtr getData() {
+		detach();
 		return m_Ptr;
 	}
 
 private:
-	DataArrayPtr m_Ptr;
+	struct ViewTag {};
+
+	explicit AttrList(ViewTag)
+	    : m_ViewCount(0)
+	{}
+
+	/// Copy the items of a view in owned storage, or allocate it for a moved from list
+	void detach() {
+		if (m_View) {
+			const T * items = m_View.get();
+			m_Ptr = std::make_shared<DataType>(items, items + m_ViewCount);
+			m_View.reset();
+			m_ViewCount = 0;
+		} else if (!m_Ptr) {
+			m_Ptr = std::make_shared<DataType>();
+		}
+	}
+
+	DataArrayPtr m_Ptr; ///< Owned items, unused for views, null (same as empty) after the list is moved from
+	std::shared_ptr<const T> m_View; ///< Items of a view
+	size_t m_ViewCount; ///< Number of items in @m_View
 };
 
 typedef AttrList<int>           AttrListInt;
@@ -703,6 +802,8 @@ struct AttrInstancer {
 	Items data;
 };
 
+/// Size of AttrValue::data, values of the types in AttrValueStorage with outOfLine set are allocated
+/// and only a pointer to them is kept there, so every int or float value does not pay for the biggest type
 const int ATTR_DATA_SIZE = max_type_sizeof<
 AttrColor,
 AttrAColor,
@@ -712,18 +813,53 @@ AttrMatrix,
 AttrTransform,
 AttrPlugin,
 AttrList<int>, // all lists have same sizeof
-AttrMapChannels,
-AttrInstancer,
-AttrImage,
-AttrImageSet,
 AttrSimpleType<int>,
 AttrSimpleType<float>,
 AttrSimpleType<double>,
-AttrSimpleType<std::string>>::value;
+AttrSimpleType<std::string>,
+void *>::value;
+
+/// Where AttrValue stores a value of type T - in AttrValue::data, or allocated if outOfLine is set
+template <typename T>
+struct AttrValueStorage {
+	enum { outOfLine = false };
+};
+
+template <>
+struct AttrValueStorage<AttrMapChannels> {
+	enum { outOfLine = true };
+};
+
+template <>
+struct AttrValueStorage<AttrInstancer> {
+	enum { outOfLine = true };
+};
+
+template <>
+struct AttrValueStorage<AttrImageSet> {
+	enum { outOfLine = true };
+};
 
 struct AttrValue;
 typedef AttrList<AttrValue> AttrListValue;
 
+/// The type AttrValue stores values of T in, the AttrSimpleType for int, float, double, bool and std::string
+/// AttrSimpleType has only its value, so a pointer to one points to the raw value too
+template <typename T>
+struct AttrStoredType {
+	typedef T Type;
+};
+
+template <> struct AttrStoredType<int> { typedef AttrSimpleType<int> Type; };
+template <> struct AttrStoredType<bool> { typedef AttrSimpleType<int> Type; };
+template <> struct AttrStoredType<float> { typedef AttrSimpleType<float> Type; };
+template <> struct AttrStoredType<double> { typedef AttrSimpleType<double> Type; };
+template <> struct AttrStoredType<std::string> { typedef AttrSimpleType<std::string> Type; };
+
+/// The ValueType of the values AttrValue stores as T, defined after AttrValueTypes
+template <typename T>
+struct AttrTagOf;
+
 
 struct AttrValue {
 	AttrValue():
@@ -731,62 +867,82 @@ struct AttrValue {
 
 	template <typename T>
 	AttrValue(const T & attrValue) {
-		new(asPtr<T>())T(attrValue); // ctor on memmory
-		type = as<T>().getType();
+		type = construct<T>(attrValue)->getType();
+	}
+
+	/// Take a temporary value without copying it
+	template <typename T, typename = typename std::enable_if<std::is_class<T>::value && !std::is_const<T>::value
+	                                                     && !std::is_same<T, AttrValue>::value && !std::is_same<T, std::string>::value>::type>
+	AttrValue(T && attrValue) {
+		type = construct<T>(std::move(attrValue))->getType();
 	}
 
 	AttrValue(const std::string & attrValue) {
 		type = ValueTypeString;
-		new(asPtr<AttrSimpleType<std::string>>())AttrSimpleType<std::string>(attrValue);
+		construct<AttrSimpleType<std::string>>(attrValue);
+	}
+
+	AttrValue(std::string && attrValue) {
+		type = ValueTypeString;
+		construct<AttrSimpleType<std::string>>(std::move(attrValue));
 	}
 
 	AttrValue(const char * attrValue) {
 		type = ValueTypeString;
-		new(asPtr<AttrSimpleType<std::string>>())AttrSimpleType<std::string>(attrValue ? attrValue : "");
+		construct<AttrSimpleType<std::string>>(attrValue ? attrValue : "");
 	}
 
 	AttrValue(const int & attrValue) {
 		type = ValueTypeInt;
-		new(asPtr<AttrSimpleType<int>>())AttrSimpleType<int>(attrValue);
+		construct<AttrSimpleType<int>>(attrValue);
 	}
 
 	AttrValue(const bool & attrValue) {
 		type = ValueTypeInt;
-		new(asPtr<AttrSimpleType<int>>())AttrSimpleType<int>(attrValue);
+		construct<AttrSimpleType<int>>(attrValue);
 	}
 
 	AttrValue(const float & attrValue) {
 		type = ValueTypeFloat;
-		new(asPtr<AttrSimpleType<float>>())AttrSimpleType<float>(attrValue);
+		construct<AttrSimpleType<float>>(attrValue);
 	}
 
 	ValueType getType() const {
 		return type;
 	}
 
+	/// Get pointer to the value as T, nullptr if the value is of another type
+	/// T may be the raw type of an AttrSimpleType value (int, float, std::string...), the pointer is to its value
 	template <typename T>
 	T * asPtr() {
-		return reinterpret_cast<T*>(data);
+		typedef typename AttrStoredType<T>::Type Stored;
+		return type == AttrTagOf<T>::tag ? reinterpret_cast<T *>(getPtr<Stored>(std::integral_constant<bool, AttrValueStorage<Stored>::outOfLine>())) : nullptr;
 	}
 
 	template <typename T>
 	const T * asPtr() const {
-		return reinterpret_cast<const T*>(data);
+		return const_cast<AttrValue *>(this)->asPtr<T>();
 	}
 
 	template <typename T>
 	T & as() {
-		return *asPtr<T>();
+		T * ptr = asPtr<T>();
+		assert(ptr && "AttrValue is not of the requested type");
+		return *ptr;
 	}
 
 	template <typename T>
 	const T & as() const {
-		return *asPtr<T>();
+		const T * ptr = asPtr<T>();
+		assert(ptr && "AttrValue is not of the requested type");
+		return *ptr;
 	}
 
 	template <typename T>
 	T convertTo() const {
-		return *reinterpret_cast<T*>(data);
+		const T * ptr = asPtr<T>();
+		assert(ptr && "AttrValue is not of the requested type");
+		return *ptr;
 	}
 
 	AttrValue & operator=(const AttrValue & o) {
@@ -801,107 +957,39 @@ struct AttrValue {
 		copyInitData(o);
 	}
 
-	void defaultInitData() {
-		assert(type != ValueTypeUnknown && "Cannot default init unknown type!");
-		switch(type) {
-		case ValueTypeString:        new(asPtr<AttrSimpleType<std::string>>())AttrSimpleType<std::string>(); break;
-		case ValueTypePlugin:        new(asPtr<AttrPlugin>())AttrPlugin(); break;
-		case ValueTypeListInt:       new(asPtr<AttrListInt>())AttrListInt(); break;
-		case ValueTypeListFloat:     new(asPtr<AttrListFloat>())AttrListFloat(); break;
-		case ValueTypeListColor:     new(asPtr<AttrListColor>())AttrListColor(); break;
-		case ValueTypeListVector:    new(asPtr<AttrListVector>())AttrListVector(); break;
-		case ValueTypeListVector2:   new(asPtr<AttrListVector2>())AttrListVector2(); break;
-		case ValueTypeListMatrix:    new(asPtr<AttrListMatrix>())AttrListMatrix(); break;
-		case ValueTypeListTransform: new(asPtr<AttrListTransform>())AttrListTransform(); break;
-		case ValueTypeListString:    new(asPtr<AttrListString>())AttrListString(); break;
-		case ValueTypeListPlugin:    new(asPtr<AttrListPlugin>())AttrListPlugin(); break;
-		case ValueTypeListValue:     new(asPtr<AttrListValue>())AttrListValue(); break;
-		case ValueTypeInstancer:     new(asPtr<AttrInstancer>())AttrInstancer(); break;
-		case ValueTypeMapChannels:   new(asPtr<AttrMapChannels>())AttrMapChannels(); break;
-		case ValueTypeImageSet:      new(asPtr<AttrImageSet>())AttrImageSet(); break;
-		default: memset(data, 0, ATTR_DATA_SIZE); break;
+	AttrValue & operator=(AttrValue && o) noexcept {
+		if (this != & o) {
+			destroyData();
+			moveInitData(o);
 		}
+		return *this;
 	}
 
-	void copyInitData(const AttrValue & other) {
-		type = other.type;
-		switch(other.type) {
-		case ValueTypeString:        new(asPtr<AttrSimpleType<std::string>>())AttrSimpleType<std::string>(other.as<AttrSimpleType<std::string>>()); break;
-		case ValueTypePlugin:        new(asPtr<AttrPlugin>())AttrPlugin(other.as<AttrPlugin>()); break;
-		case ValueTypeListInt:       new(asPtr<AttrListInt>())AttrListInt(other.as<AttrListInt>()); break;
-		case ValueTypeListFloat:     new(asPtr<AttrListFloat>())AttrListFloat(other.as<AttrListFloat>()); break;
-		case ValueTypeListColor:     new(asPtr<AttrListColor>())AttrListColor(other.as<AttrListColor>()); break;
-		case ValueTypeListVector:    new(asPtr<AttrListVector>())AttrListVector(other.as<AttrListVector>()); break;
-		case ValueTypeListVector2:   new(asPtr<AttrListVector2>())AttrListVector2(other.as<AttrListVector2>()); break;
-		case ValueTypeListMatrix:    new(asPtr<AttrListMatrix>())AttrListMatrix(other.as<AttrListMatrix>()); break;
-		case ValueTypeListTransform: new(asPtr<AttrListTransform>())AttrListTransform(other.as<AttrListTransform>()); break;
-		case ValueTypeListString:    new(asPtr<AttrListString>())AttrListString(other.as<AttrListString>()); break;
-		case ValueTypeListPlugin:    new(asPtr<AttrListPlugin>())AttrListPlugin(other.as<AttrListPlugin>()); break;
-		case ValueTypeListValue:     new(asPtr<AttrListValue>())AttrListValue(other.as<AttrListValue>()); break;
-		case ValueTypeInstancer:     new(asPtr<AttrInstancer>())AttrInstancer(other.as<AttrInstancer>()); break;
-		case ValueTypeMapChannels:   new(asPtr<AttrMapChannels>())AttrMapChannels(other.as<AttrMapChannels>()); break;
-		case ValueTypeImageSet:      new(asPtr<AttrImageSet>())AttrImageSet(other.as<AttrImageSet>()); break;
-		default: memcpy(data, other.data, ATTR_DATA_SIZE); break; // others are POD so we can memcpy
-		}
+	/// Take the value of @o, leaving it ValueTypeUnknown
+	AttrValue(AttrValue && o) noexcept {
+		moveInitData(o);
 	}
 
-	void destroyData() {
-		// only ones that need dtor called, make sure to update here if other type needs
-		switch (type) {
-		case ValueTypeString:        as<AttrSimpleType<std::string>>().~AttrSimpleType<std::string>(); break;
-		case ValueTypePlugin:        as<AttrPlugin>().~AttrPlugin(); break;
-		case ValueTypeListInt:       as<AttrListInt>().~AttrListInt(); break;
-		case ValueTypeListFloat:     as<AttrListFloat>().~AttrListFloat(); break;
-		case ValueTypeListColor:     as<AttrListColor>().~AttrListColor(); break;
-		case ValueTypeListVector:    as<AttrListVector>().~AttrListVector(); break;
-		case ValueTypeListVector2:   as<AttrListVector2>().~AttrListVector2(); break;
-		case ValueTypeListMatrix:    as<AttrListMatrix>().~AttrListMatrix(); break;
-		case ValueTypeListTransform: as<AttrListTransform>().~AttrListTransform(); break;
-		case ValueTypeListString:    as<AttrListString>().~AttrListString(); break;
-		case ValueTypeListPlugin:    as<AttrListPlugin>().~AttrListPlugin(); break;
-		case ValueTypeListValue:     as<AttrListValue>().~AttrListValue(); break;
-		case ValueTypeInstancer:     as<AttrInstancer>().~AttrInstancer(); break;
-		case ValueTypeMapChannels:   as<AttrMapChannels>().~AttrMapChannels(); break;
-		case ValueTypeImageSet:      as<AttrImageSet>().~AttrImageSet(); break;
-		default: break; // nothing to do
-		}
-		memset(data, 0, ATTR_DATA_SIZE);
-		type = ValueTypeUnknown;
-	}
+	/// Construct a default value of the current type
+	void defaultInitData();
+
+	/// Construct a copy of @other, the current value must be destroyed
+	void copyInitData(const AttrValue & other);
+
+	/// Take the value of @other, leaving it ValueTypeUnknown, the current value must be destroyed
+	void moveInitData(AttrValue & other);
+
+	/// Destroy the value, leaving it ValueTypeUnknown
+	void destroyData();
 
 	~AttrValue() {
 		destroyData();
 	}
 
 	ValueType type;
-	uint8_t data[ATTR_DATA_SIZE];
-
-	const char *getTypeAsString() const {
-		switch (type) {
-		case ValueTypeInt:           return "Int";
-		case ValueTypeFloat:         return "Float";
-		case ValueTypeColor:         return "Color";
-		case ValueTypeAColor:        return "AColor";
-		case ValueTypeVector:        return "Vector";
-		case ValueTypeTransform:     return "Transform";
-		case ValueTypeString:        return "String";
-		case ValueTypePlugin:        return "Plugin";
-		case ValueTypeListInt:       return "ListInt";
-		case ValueTypeListFloat:     return "ListFloat";
-		case ValueTypeListColor:     return "ListColor";
-		case ValueTypeListVector:    return "ListVector";
-		case ValueTypeListMatrix:    return "ListMatrix";
-		case ValueTypeListTransform: return "ListTransform";
-		case ValueTypeListString:    return "ListString";
-		case ValueTypeListPlugin:    return "ListPlugin";
-		case ValueTypeListValue:     return "ListValue";
-		case ValueTypeInstancer:     return "Instancer2";
-		case ValueTypeMapChannels:   return "Map Channels";
-		default:
-			break;
-		}
-		return "Unknown";
-	}
+	alignas(8) uint8_t data[ATTR_DATA_SIZE]; ///< The value, or pointer to it, see AttrValueStorage
+
+	const char *getTypeAsString() const;
 
 	operator bool() const {
 		bool valid = true;
@@ -912,6 +1000,48 @@ struct AttrValue {
 		}
 		return valid;
 	}
+
+private:
+	template <typename T>
+	friend struct AttrValueOps;
+
+	template <typename T>
+	T * getPtr(std::false_type) {
+		static_assert(sizeof(T) <= ATTR_DATA_SIZE && alignof(T) <= 8, "Type does not fit in AttrValue::data, add it to AttrValueStorage");
+		return reinterpret_cast<T*>(data);
+	}
+
+	template <typename T>
+	T * getPtr(std::true_type) {
+		return *reinterpret_cast<T**>(data);
+	}
+
+	/// Construct a T from @args in data, or allocate it and keep the pointer in data
+	template <typename T, typename ... Args>
+	T * construct(Args && ... args) {
+		return construct<T>(std::integral_constant<bool, AttrValueStorage<T>::outOfLine>(), std::forward<Args>(args)...);
+	}
+
+	template <typename T, typename ... Args>
+	T * construct(std::false_type, Args && ... args) {
+		return new(getPtr<T>(std::false_type()))T(std::forward<Args>(args)...); // ctor on memmory
+	}
+
+	template <typename T, typename ... Args>
+	T * construct(std::true_type, Args && ... args) {
+		T * value = new T(std::forward<Args>(args)...);
+		new(data)T*(value);
+		return value;
+	}
+
+	template <typename T>
+	void destroy() {
+		if (AttrValueStorage<T>::outOfLine) {
+			delete asPtr<T>();
+		} else {
+			asPtr<T>()->~T();
+		}
+	}
 };
 
 
@@ -921,6 +1051,248 @@ inline ValueType AttrListValue::getType() const {
 }
 
 
+template <ValueType Tag, typename T>
+struct AttrTypeEntry {
+	static const ValueType tag = Tag;
+	typedef T Type;
+};
+
+template <typename ... Entries>
+struct AttrTypeList {};
+
+/// The type AttrValue stores for each ValueType, every type dispatch on AttrValue is generated from this list
+/// To add a value type register it here and give it operator<< and operator>> - forgetting either does not compile
+typedef AttrTypeList<
+	AttrTypeEntry<ValueTypeInt,           AttrSimpleType<int>>,
+	AttrTypeEntry<ValueTypeFloat,         AttrSimpleType<float>>,
+	AttrTypeEntry<ValueTypeDouble,        AttrSimpleType<double>>,
+	AttrTypeEntry<ValueTypeColor,         AttrColor>,
+	AttrTypeEntry<ValueTypeAColor,        AttrAColor>,
+	AttrTypeEntry<ValueTypeVector,        AttrVector>,
+	AttrTypeEntry<ValueTypeVector2,       AttrVector2>,
+	AttrTypeEntry<ValueTypeMatrix,        AttrMatrix>,
+	AttrTypeEntry<ValueTypeTransform,     AttrTransform>,
+	AttrTypeEntry<ValueTypeString,        AttrSimpleType<std::string>>,
+	AttrTypeEntry<ValueTypePlugin,        AttrPlugin>,
+	AttrTypeEntry<ValueTypeImageSet,      AttrImageSet>,
+	AttrTypeEntry<ValueTypeListInt,       AttrListInt>,
+	AttrTypeEntry<ValueTypeListFloat,     AttrListFloat>,
+	AttrTypeEntry<ValueTypeListColor,     AttrListColor>,
+	AttrTypeEntry<ValueTypeListVector,    AttrListVector>,
+	AttrTypeEntry<ValueTypeListVector2,   AttrListVector2>,
+	AttrTypeEntry<ValueTypeListMatrix,    AttrListMatrix>,
+	AttrTypeEntry<ValueTypeListTransform, AttrListTransform>,
+	AttrTypeEntry<ValueTypeListString,    AttrListString>,
+	AttrTypeEntry<ValueTypeListPlugin,    AttrListPlugin>,
+	AttrTypeEntry<ValueTypeListValue,     AttrListValue>,
+	AttrTypeEntry<ValueTypeInstancer,     AttrInstancer>,
+	AttrTypeEntry<ValueTypeMapChannels,   AttrMapChannels>
+> AttrValueTypes;
+
+/// Find the type registered for @Tag in @List, void if there is none
+template <ValueType Tag, typename List>
+struct FindAttrType;
+
+template <ValueType Tag>
+struct FindAttrType<Tag, AttrTypeList<>> {
+	typedef void Type;
+};
+
+template <ValueType Tag, typename Entry, typename ... Rest>
+struct FindAttrType<Tag, AttrTypeList<Entry, Rest...>> {
+	static_assert(Entry::tag != Tag || std::is_void<typename FindAttrType<Tag, AttrTypeList<Rest...>>::Type>::value,
+	              "ValueType registered twice in AttrValueTypes");
+	typedef typename std::conditional<Entry::tag == Tag, typename Entry::Type, typename FindAttrType<Tag, AttrTypeList<Rest...>>::Type>::type Type;
+};
+
+/// The type AttrValue stores for @Tag, void for the tags that have no value
+template <ValueType Tag>
+struct AttrTypeOf {
+	typedef typename FindAttrType<Tag, AttrValueTypes>::Type Type;
+	static_assert(std::is_void<Type>::value == (Tag == ValueTypeUnknown || Tag == ValueTypeList),
+	              "ValueType missing from AttrValueTypes");
+};
+
+/// Find the tag registered for @T in @List, ValueTypeUnknown if there is none
+template <typename T, typename List>
+struct FindAttrTag;
+
+template <typename T>
+struct FindAttrTag<T, AttrTypeList<>> {
+	static const ValueType tag = ValueTypeUnknown;
+};
+
+template <typename T, typename Entry, typename ... Rest>
+struct FindAttrTag<T, AttrTypeList<Entry, Rest...>> {
+	static const ValueType tag = std::is_same<T, typename Entry::Type>::value ? Entry::tag : FindAttrTag<T, AttrTypeList<Rest...>>::tag;
+};
+
+template <typename T>
+struct AttrTagOf {
+	static const ValueType tag = FindAttrTag<typename AttrStoredType<T>::Type, AttrValueTypes>::tag;
+	static_assert(tag != ValueTypeUnknown, "Type is not stored in AttrValue, see AttrValueTypes");
+};
+
+template <size_t ... I>
+struct AttrIndexSequence {};
+
+template <size_t N, size_t ... I>
+struct MakeAttrIndexSequence : MakeAttrIndexSequence<N - 1, N - 1, I...> {};
+
+template <size_t ... I>
+struct MakeAttrIndexSequence<0, I...> {
+	typedef AttrIndexSequence<I...> Type;
+};
+
+/// Jump table indexed by ValueType, holding Op<T>::make() for the type of each tag (Op<void> for tags without one)
+/// Dispatching on a value type is then one indirect call instead of a switch
+template <template <typename> class Op, typename Indices = typename MakeAttrIndexSequence<ValueTypeCount>::Type>
+struct AttrTypeTable;
+
+template <template <typename> class Op, size_t ... I>
+struct AttrTypeTable<Op, AttrIndexSequence<I...>> {
+	typedef decltype(Op<void>::make()) Entry;
+
+	/// Get the entry for @type, the Op<void> one for tags out of range
+	static const Entry & get(ValueType type) {
+		return static_cast<unsigned>(type) < ValueTypeCount ? entries[type] : entries[ValueTypeUnknown];
+	}
+
+	static constexpr Entry entries[ValueTypeCount] = {Op<typename AttrTypeOf<static_cast<ValueType>(I)>::Type>::make()...};
+};
+
+template <template <typename> class Op, size_t ... I>
+constexpr typename AttrTypeTable<Op, AttrIndexSequence<I...>>::Entry AttrTypeTable<Op, AttrIndexSequence<I...>>::entries[ValueTypeCount];
+
+/// Lifetime operations of AttrValue for each stored type
+struct AttrValueLifetime {
+	void (*defaultInit)(AttrValue & value);
+	void (*copyInit)(AttrValue & value, const AttrValue & other);
+	void (*moveInit)(AttrValue & value, AttrValue & other);
+	void (*destroy)(AttrValue & value);
+};
+
+template <typename T>
+struct AttrValueOps {
+	static constexpr AttrValueLifetime make() {
+		return AttrValueLifetime{&defaultInit, &copyInit, &moveInit, &destroy};
+	}
+
+	static void defaultInit(AttrValue & value) {
+		value.construct<T>();
+	}
+
+	static void copyInit(AttrValue & value, const AttrValue & other) {
+		value.construct<T>(other.as<T>());
+	}
+
+	static void moveInit(AttrValue & value, AttrValue & other) {
+		moveInit(value, other, std::integral_constant<bool, AttrValueStorage<T>::outOfLine>());
+	}
+
+	static void destroy(AttrValue & value) {
+		value.destroy<T>();
+	}
+
+private:
+	static void moveInit(AttrValue & value, AttrValue & other, std::false_type) {
+		value.construct<T>(std::move(other.as<T>()));
+		other.destroy<T>();
+	}
+
+	static void moveInit(AttrValue & value, AttrValue & other, std::true_type) {
+		// just take the pointer
+		memcpy(value.data, other.data, sizeof(T *));
+	}
+};
+
+/// Tags without a value - there is nothing to construct or destroy
+template <>
+struct AttrValueOps<void> {
+	static constexpr AttrValueLifetime make() {
+		return AttrValueLifetime{&defaultInit, &copyInit, &moveInit, &destroy};
+	}
+
+	static void defaultInit(AttrValue & value) {
+		memset(value.data, 0, ATTR_DATA_SIZE);
+	}
+
+	static void copyInit(AttrValue & value, const AttrValue & other) {
+		memcpy(value.data, other.data, ATTR_DATA_SIZE);
+	}
+
+	static void moveInit(AttrValue & value, AttrValue & other) {
+		copyInit(value, other);
+	}
+
+	static void destroy(AttrValue &) {}
+};
+
+inline void AttrValue::defaultInitData() {
+	assert(type != ValueTypeUnknown && "Cannot default init unknown type!");
+	AttrTypeTable<AttrValueOps>::get(type).defaultInit(*this);
+}
+
+inline void AttrValue::copyInitData(const AttrValue & other) {
+	type = other.type;
+	AttrTypeTable<AttrValueOps>::get(type).copyInit(*this, other);
+}
+
+inline void AttrValue::moveInitData(AttrValue & other) {
+	type = other.type;
+	AttrTypeTable<AttrValueOps>::get(type).moveInit(*this, other);
+	memset(other.data, 0, ATTR_DATA_SIZE);
+	other.type = ValueTypeUnknown;
+}
+
+inline void AttrValue::destroyData() {
+	AttrTypeTable<AttrValueOps>::get(type).destroy(*this);
+	memset(data, 0, ATTR_DATA_SIZE);
+	type = ValueTypeUnknown;
+}
+
+inline const char * AttrValue::getTypeAsString() const {
+	static const char * const names[] = {
+		"Unknown",
+		"Int",
+		"Float",
+		"Double",
+		"Color",
+		"AColor",
+		"Vector",
+		"Vector2",
+		"Matrix",
+		"Transform",
+		"String",
+		"Plugin",
+		"ImageSet",
+		"List",
+		"ListInt",
+		"ListFloat",
+		"ListColor",
+		"ListVector",
+		"ListVector2",
+		"ListMatrix",
+		"ListTransform",
+		"ListString",
+		"ListPlugin",
+		"ListValue",
+		"Instancer2",
+		"Map Channels",
+	};
+	static_assert(sizeof(names) / sizeof(names[0]) == ValueTypeCount, "Missing ValueType name");
+	return static_cast<unsigned>(type) < ValueTypeCount ? names[type] : names[ValueTypeUnknown];
+}
+
+// containers copy items they can not move without throwing, so lists of these would be deep copied on growth
+static_assert(std::is_nothrow_move_constructible<AttrValue>::value, "AttrValue must have a noexcept move");
+static_assert(std::is_nothrow_move_constructible<AttrListValue>::value, "AttrList must have a noexcept move");
+static_assert(std::is_nothrow_move_constructible<AttrPlugin>::value, "AttrPlugin must have a noexcept move");
+static_assert(std::is_nothrow_move_constructible<AttrImage>::value, "AttrImage must have a noexcept move");
+static_assert(std::is_nothrow_move_constructible<AttrMapChannels::AttrMapChannel>::value, "AttrMapChannel must have a noexcept move");
+static_assert(std::is_nothrow_move_constructible<AttrInstancer::Item>::value, "AttrInstancer::Item must have a noexcept move");
+
+
 
 inline AttrPlugin & AttrPlugin::operator=(const AttrValue & val) {
 	if (val.type == ValueTypePlugin) {
@@ -0,0 +1,355 @@
+#ifndef _FRAME_DEDUP_HPP_
+#define _FRAME_DEDUP_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "zmq_message.hpp"
+
+/// 128 bit content hash (MurmurHash3 x64 128) of a frame, fast but not cryptographic - for trusted links only
+struct ContentHash {
+	uint64_t low;
+	uint64_t high;
+
+	bool operator==(const ContentHash & other) const {
+		return low == other.low && high == other.high;
+	}
+
+	/// Hash @size bytes at @data
+	static ContentHash make(const void * data, size_t size, uint64_t seed = 0) {
+		const uint8_t * bytes = static_cast<const uint8_t *>(data);
+		const size_t blocks = size / 16;
+		uint64_t h1 = seed, h2 = seed;
+
+		for (size_t c = 0; c < blocks; ++c) {
+			uint64_t k1, k2;
+			memcpy(&k1, bytes + c * 16, 8);
+			memcpy(&k2, bytes + c * 16 + 8, 8);
+			h1 ^= mixK1(k1);
+			h1 = rotl(h1, 27) + h2;
+			h1 = h1 * 5 + 0x52dce729;
+			h2 ^= mixK2(k2);
+			h2 = rotl(h2, 31) + h1;
+			h2 = h2 * 5 + 0x38495ab5;
+		}
+
+		const uint8_t * tail = bytes + blocks * 16;
+		const int rest = static_cast<int>(size & 15);
+		uint64_t k1 = 0, k2 = 0;
+		for (int c = rest; c > 8; --c) {
+			k2 ^= static_cast<uint64_t>(tail[c - 1]) << ((c - 9) * 8);
+		}
+		if (rest > 8) {
+			h2 ^= mixK2(k2);
+		}
+		for (int c = rest < 8 ? rest : 8; c > 0; --c) {
+			k1 ^= static_cast<uint64_t>(tail[c - 1]) << ((c - 1) * 8);
+		}
+		if (rest) {
+			h1 ^= mixK1(k1);
+		}
+
+		h1 ^= size;
+		h2 ^= size;
+		h1 += h2;
+		h2 += h1;
+		h1 = finalize(h1);
+		h2 = finalize(h2);
+		h1 += h2;
+		h2 += h1;
+
+		ContentHash hash = {h1, h2};
+		return hash;
+	}
+
+private:
+	static uint64_t rotl(uint64_t x, int r) {
+		return (x << r) | (x >> (64 - r));
+	}
+
+	static uint64_t mixK1(uint64_t k) {
+		return rotl(k * 0x87c37b91114253d5ULL, 31) * 0x4cf5ad432745937fULL;
+	}
+
+	static uint64_t mixK2(uint64_t k) {
+		return rotl(k * 0x4cf5ad432745937fULL, 33) * 0x87c37b91114253d5ULL;
+	}
+
+	static uint64_t finalize(uint64_t k) {
+		k ^= k >> 33;
+		k *= 0xff51afd7ed558ccdULL;
+		k ^= k >> 33;
+		k *= 0xc4ceb9fe1a85ec53ULL;
+		k ^= k >> 33;
+		return k;
+	}
+};
+
+namespace std {
+template <>
+struct hash<ContentHash> {
+	size_t operator()(const ContentHash & hash) const {
+		return static_cast<size_t>(hash.low);
+	}
+};
+}
+
+/// Entry of the frame table of ControlMessage::DATA_HASHED_MSG and header of ControlMessage::FRAME_BODY_MSG
+struct FrameRef {
+	ContentHash hash; ///< Hash of the frame data
+	uint64_t size; ///< Size of the frame data
+	int inlined; ///< 1 if the data is sent with the message, 0 if the receiver takes it from its FrameStore
+	int reserved;
+};
+
+/// Frames by content hash, least recently used ones are dropped to stay in a byte budget
+/// Stored frames share their data with the messages they came from (zmq::message_t::copy), so inserted frames
+/// must own their data - received frames do, FrameDedup::prepareHashed makes sure sent ones do. Safe to use from
+/// any thread
+class FrameStore {
+public:
+	explicit FrameStore(size_t budget)
+	    : budget(budget)
+	    , bytes(0)
+	{}
+
+	FrameStore(const FrameStore &) = delete;
+	FrameStore & operator=(const FrameStore &) = delete;
+
+	/// Get a frame and mark it as recently used
+	/// @frame - set to a copy sharing the stored data
+	/// @return - false if there is no frame with this hash
+	bool find(const ContentHash & hash, zmq::message_t & frame) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iter = index.find(hash);
+		if (iter == index.end()) {
+			return false;
+		}
+		entries.splice(entries.begin(), entries, iter->second);
+		frame.copy(&iter->second->frame);
+		return true;
+	}
+
+	/// Check for a frame and mark it as recently used
+	bool touch(const ContentHash & hash) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iter = index.find(hash);
+		if (iter == index.end()) {
+			return false;
+		}
+		entries.splice(entries.begin(), entries, iter->second);
+		return true;
+	}
+
+	/// Add a frame if not already stored, evicting least recently used frames over the budget
+	/// Frames bigger than the whole budget are not stored
+	/// @frame - the frame, it is not changed, the store keeps a copy sharing its data
+	void insert(const ContentHash & hash, zmq::message_t & frame) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (frame.size() > budget || index.find(hash) != index.end()) {
+			return;
+		}
+		entries.emplace_front();
+		entries.front().hash = hash;
+		entries.front().frame.copy(&frame);
+		index.emplace(hash, entries.begin());
+		bytes += frame.size();
+		while (bytes > budget) {
+			bytes -= entries.back().frame.size();
+			index.erase(entries.back().hash);
+			entries.pop_back();
+		}
+	}
+
+	/// Drop all frames
+	void clear() {
+		std::lock_guard<std::mutex> lock(mutex);
+		index.clear();
+		entries.clear();
+		bytes = 0;
+	}
+
+	/// Get the size of all stored frames
+	size_t getBytes() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return bytes;
+	}
+
+private:
+	struct Entry {
+		ContentHash hash;
+		zmq::message_t frame;
+	};
+
+	mutable std::mutex mutex; ///< Protects all members
+	std::list<Entry> entries; ///< Most recently used first
+	std::unordered_map<ContentHash, std::list<Entry>::iterator> index; ///< Entries by hash
+	size_t budget; ///< Max sum of the frame sizes
+	size_t bytes; ///< Current sum of the frame sizes
+};
+
+/// Helpers for sending the external frames of data messages by content hash
+///
+/// The sender replaces each external frame with a FrameRef, sending the data only the first time it sees it:
+///   DATA_HASHED_MSG: [control][payload][FrameRef table][data of the inlined frames in table order]
+/// The receiver keeps the frames in a FrameStore, if a referenced frame is not there it asks for it:
+///   FRAME_REQUEST_MSG: [control][ContentHash array]
+/// and the sender answers each hash from its own store (inlined = 0 if it no longer has it either):
+///   FRAME_BODY_MSG: [control][FrameRef][data]
+struct FrameDedup {
+	/// Check if prepareHashed would change a message - it has external frames and all are at least @minBytes
+	static bool canHash(size_t minBytes, const MessageParts & message) {
+		if (message.external.empty()) {
+			return false;
+		}
+		for (const auto & frame : message.external) {
+			if (frame.size() < minBytes) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/// Hash the external frames of a message and make them own their data, used by the sender before the
+	/// message is queued. Which frames are inlined is decided by finishHashed when the message is sent
+	/// The message is changed only if canHash accepts it
+	/// @sent - frames sent so far, a frame found in it is replaced with the stored one, the others with copies,
+	///         so the frames can be added to @sent without copying and the caller may change its buffers
+	///         after the message is sent
+	/// @message - replaced with [payload][table][frames], every frame marked as inlined
+	/// @return - false if the message was not changed
+	static bool prepareHashed(FrameStore & sent, size_t minBytes, MessageParts & message) {
+		if (!canHash(minBytes, message)) {
+			return false;
+		}
+
+		std::vector<FrameRef> table(message.external.size());
+		std::vector<zmq::message_t> frames(message.external.size() + 1);
+		for (size_t c = 0; c < table.size(); ++c) {
+			const zmq::message_t & frame = message.external[c];
+			FrameRef & ref = table[c];
+			ref.hash = ContentHash::make(frame.data(), frame.size());
+			ref.size = frame.size();
+			ref.inlined = 1;
+			ref.reserved = 0;
+			if (!sent.find(ref.hash, frames[c + 1])) {
+				frames[c + 1].rebuild(frame.data(), frame.size());
+			}
+		}
+		frames[0].rebuild(table.data(), table.size() * sizeof(FrameRef));
+		message.external = std::move(frames);
+		return true;
+	}
+
+	/// Reference the frames of a prepared message that the receiver already has, used by the sender right
+	/// before sending, in the order messages are sent
+	/// @sent - frames sent so far, frames found in it are referenced, the others are inlined and added to it
+	/// @message - made by prepareHashed, becomes [payload][table][inlined frames]
+	static void finishHashed(FrameStore & sent, MessageParts & message) {
+		zmq::message_t & tableFrame = message.external[0];
+		std::vector<FrameRef> table(tableFrame.size() / sizeof(FrameRef));
+		memcpy(table.data(), tableFrame.data(), tableFrame.size());
+		size_t next = 1;
+		for (size_t c = 0; c < table.size(); ++c) {
+			zmq::message_t & frame = message.external[c + 1];
+			table[c].inlined = sent.touch(table[c].hash) ? 0 : 1;
+			if (table[c].inlined) {
+				sent.insert(table[c].hash, frame);
+				if (next != c + 1) {
+					message.external[next] = std::move(frame);
+				}
+				++next;
+			}
+		}
+		memcpy(tableFrame.data(), table.data(), tableFrame.size());
+		message.external.resize(next);
+	}
+
+	/// Restore the external frames of a received DATA_HASHED_MSG, used by the receiver
+	/// Inlined frames are added to @cache, referenced ones are taken from it
+	/// @message - [payload][table][inlined frames] as received, replaced with [payload][frames] on success,
+	///            not changed on failure
+	/// @missing - set to the hashes not found in @cache, the message must be kept and resolved again
+	///            after their FRAME_BODY_MSG arrive, see makeRequest and receiveBody
+	/// @return - false if frames are missing or the message is malformed (then @missing is empty)
+	static bool resolve(FrameStore & cache, MessageParts & message, std::vector<ContentHash> & missing) {
+		missing.clear();
+		if (message.external.empty() || message.external[0].size() % sizeof(FrameRef)) {
+			return false;
+		}
+		std::vector<FrameRef> table(message.external[0].size() / sizeof(FrameRef));
+		memcpy(table.data(), message.external[0].data(), message.external[0].size());
+
+		// adding to the cache is a no-op for frames already there, so resolving again is safe
+		size_t next = 1;
+		for (auto & ref : table) {
+			if (!ref.inlined) {
+				continue;
+			}
+			if (next >= message.external.size() || message.external[next].size() != ref.size) {
+				return false;
+			}
+			cache.insert(ref.hash, message.external[next]);
+			++next;
+		}
+		if (next != message.external.size()) {
+			return false;
+		}
+
+		std::vector<zmq::message_t> frames(table.size());
+		next = 1;
+		for (size_t c = 0; c < table.size(); ++c) {
+			if (table[c].inlined) {
+				// shares the data, the message stays as it is if anything is missing
+				frames[c].copy(&message.external[next++]);
+			} else if (!cache.find(table[c].hash, frames[c]) || frames[c].size() != table[c].size) {
+				missing.push_back(table[c].hash);
+			}
+		}
+		if (!missing.empty()) {
+			return false;
+		}
+
+		message.external = std::move(frames);
+		return true;
+	}
+
+	/// Make the payload of FRAME_REQUEST_MSG
+	static zmq::message_t makeRequest(const std::vector<ContentHash> & missing) {
+		return zmq::message_t(missing.data(), missing.size() * sizeof(ContentHash));
+	}
+
+	/// Make FRAME_BODY_MSG answering one hash of a request, used by the sender
+	static MessageParts makeBody(FrameStore & sent, const ContentHash & hash) {
+		FrameRef ref = {hash, 0, 0, 0};
+		zmq::message_t frame;
+		if (sent.find(hash, frame)) {
+			ref.size = frame.size();
+			ref.inlined = 1;
+		}
+		MessageParts body(zmq::message_t(&ref, sizeof(ref)));
+		body.external.push_back(std::move(frame));
+		return body;
+	}
+
+	/// Add the frame of a received FRAME_BODY_MSG to @cache, used by the receiver
+	/// @return - false if the sender no longer had the frame or the message is malformed
+	static bool receiveBody(FrameStore & cache, const zmq::message_t & header, zmq::message_t & data) {
+		FrameRef ref;
+		if (header.size() != sizeof(ref)) {
+			return false;
+		}
+		memcpy(&ref, header.data(), sizeof(ref));
+		if (!ref.inlined || data.size() != ref.size) {
+			return false;
+		}
+		cache.insert(ref.hash, data);
+		return true;
+	}
+};
+
+#endif // _FRAME_DEDUP_HPP_
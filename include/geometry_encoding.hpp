@@ -0,0 +1,183 @@
+#ifndef _GEOMETRY_ENCODING_HPP_
+#define _GEOMETRY_ENCODING_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "base_types.h"
+
+/// Encoding of POD lists chosen per property, see VRayMessage::msgPluginSetProperty
+enum class GeometryEncoding : char {
+	None, ///< Lists are sent as they are
+	Mesh, ///< Index lists are delta and varint packed, float lists of compressed messages are split in byte planes of their deltas
+};
+
+/// Encoding of a single list stored as ListStorage::Encoded
+enum class ListEncoding : char {
+	None,
+	DeltaVarint, ///< Zigzag deltas of int items, packed as 1-4 bytes each, lengths in a separate control stream
+	BytePlanes, ///< Deltas of the bits of each float component, each byte of them in its own plane
+};
+
+/// Which ListEncoding GeometryEncoding::Mesh uses for AttrList<T>, None if the list is sent as it is
+template <typename T>
+struct GeometryListTraits {
+	static const ListEncoding encoding = ListEncoding::None;
+};
+
+template <>
+struct GeometryListTraits<int> {
+	static const ListEncoding encoding = ListEncoding::DeltaVarint;
+};
+
+template <>
+struct GeometryListTraits<float> {
+	static const ListEncoding encoding = ListEncoding::BytePlanes;
+};
+
+template <>
+struct GeometryListTraits<VRayBaseTypes::AttrVector> {
+	static const ListEncoding encoding = ListEncoding::BytePlanes;
+};
+
+template <>
+struct GeometryListTraits<VRayBaseTypes::AttrVector2> {
+	static const ListEncoding encoding = ListEncoding::BytePlanes;
+};
+
+template <>
+struct GeometryListTraits<VRayBaseTypes::AttrColor> {
+	static const ListEncoding encoding = ListEncoding::BytePlanes;
+};
+
+/// Encoders and decoders for ListEncoding, only lists of at least EXTERNAL_LIST_MIN_BYTES are encoded
+/// Decoding is done in simple scalar passes over plain arrays with no bounds checks inside the loops
+struct GeometryCodec {
+	/// Encode @count int items with ListEncoding::DeltaVarint
+	/// Layout is [ceil(count / 4) control bytes][data bytes], each control byte has 2 bits (length - 1) for
+	/// 4 items, low bits first - the same layout as stream-vbyte, so it can be decoded with byte shuffles
+	static void encodeDeltaVarint(const int32_t * items, size_t count, std::vector<char> & out) {
+		const size_t controlBytes = (count + 3) / 4;
+		out.assign(controlBytes, 0);
+		out.reserve(controlBytes + count * 4);
+		uint32_t prev = 0;
+		for (size_t c = 0; c < count; ++c) {
+			const uint32_t item = static_cast<uint32_t>(items[c]);
+			const uint32_t delta = item - prev;
+			prev = item;
+			const uint32_t zigzag = (delta << 1) ^ static_cast<uint32_t>(static_cast<int32_t>(delta) >> 31);
+			const int length = zigzag < (1u << 8) ? 1 : zigzag < (1u << 16) ? 2 : zigzag < (1u << 24) ? 3 : 4;
+			out[c / 4] |= static_cast<char>((length - 1) << ((c % 4) * 2));
+			for (int b = 0; b < length; ++b) {
+				out.push_back(static_cast<char>(zigzag >> (b * 8)));
+			}
+		}
+	}
+
+	/// Decode ListEncoding::DeltaVarint data in @items
+	/// @return - false if @data does not hold exactly @count items
+	static bool decodeDeltaVarint(const char * data, size_t size, size_t count, int32_t * items) {
+		const size_t controlBytes = (count + 3) / 4;
+		if (size < controlBytes) {
+			return false;
+		}
+		const uint8_t * control = reinterpret_cast<const uint8_t *>(data);
+		const uint8_t * bytes = control + controlBytes;
+
+		// check the data size up front, so the decode loop does not need to
+		size_t dataBytes = 0;
+		for (size_t c = 0; c < count; ++c) {
+			dataBytes += ((control[c / 4] >> ((c % 4) * 2)) & 3) + 1;
+		}
+		if (dataBytes != size - controlBytes) {
+			return false;
+		}
+
+		uint32_t prev = 0;
+		for (size_t c = 0; c < count; ++c) {
+			const int length = ((control[c / 4] >> ((c % 4) * 2)) & 3) + 1;
+			uint32_t zigzag = 0;
+			for (int b = 0; b < length; ++b) {
+				zigzag |= static_cast<uint32_t>(bytes[b]) << (b * 8);
+			}
+			bytes += length;
+			prev += (zigzag >> 1) ^ (0u - (zigzag & 1));
+			items[c] = static_cast<int32_t>(prev);
+		}
+		return true;
+	}
+
+	/// Encode @count items of @components floats each with ListEncoding::BytePlanes
+	/// Each component is delta coded on its bits, then byte b of component k of all items goes in plane
+	/// (b * components + k). The size does not change, but the high byte planes of smooth data are mostly
+	/// the same byte, so they compress far better with ZmqClient::setCompression than the raw floats
+	static void encodeBytePlanes(const char * items, size_t count, int components, std::vector<char> & out) {
+		const size_t planeSize = count;
+		out.resize(count * components * 4);
+		for (int k = 0; k < components; ++k) {
+			uint32_t prev = 0;
+			for (size_t c = 0; c < count; ++c) {
+				uint32_t bits;
+				memcpy(&bits, items + (c * components + k) * 4, 4);
+				const uint32_t delta = bits - prev;
+				prev = bits;
+				for (int b = 0; b < 4; ++b) {
+					out[(b * components + k) * planeSize + c] = static_cast<char>(delta >> (b * 8));
+				}
+			}
+		}
+	}
+
+	/// Decode ListEncoding::BytePlanes data in @items
+	/// @return - false if @size does not match @count items
+	static bool decodeBytePlanes(const char * data, size_t size, size_t count, int components, char * items) {
+		if (size != count * components * 4) {
+			return false;
+		}
+		const uint8_t * planes = reinterpret_cast<const uint8_t *>(data);
+		std::vector<uint32_t> deltas(count);
+		for (int k = 0; k < components; ++k) {
+			// gather the planes
+			const uint8_t * p0 = planes + (0 * components + k) * count;
+			const uint8_t * p1 = planes + (1 * components + k) * count;
+			const uint8_t * p2 = planes + (2 * components + k) * count;
+			const uint8_t * p3 = planes + (3 * components + k) * count;
+			for (size_t c = 0; c < count; ++c) {
+				deltas[c] = p0[c] | (p1[c] << 8) | (p2[c] << 16) | (static_cast<uint32_t>(p3[c]) << 24);
+			}
+			// prefix sum and scatter to the component
+			uint32_t prev = 0;
+			for (size_t c = 0; c < count; ++c) {
+				prev += deltas[c];
+				memcpy(items + (c * components + k) * 4, &prev, 4);
+			}
+		}
+		return true;
+	}
+
+	/// Encode list items with @encoding, the item type must have GeometryListTraits<T>::encoding == @encoding
+	template <typename T>
+	static void encode(ListEncoding encoding, const T * items, size_t count, std::vector<char> & out) {
+		static_assert(sizeof(T) % 4 == 0, "Encoded list items must be made of 32 bit values");
+		if (encoding == ListEncoding::DeltaVarint) {
+			encodeDeltaVarint(reinterpret_cast<const int32_t *>(items), count, out);
+		} else {
+			encodeBytePlanes(reinterpret_cast<const char *>(items), count, sizeof(T) / 4, out);
+		}
+	}
+
+	/// Decode list items encoded with encode
+	/// @return - false if the data is malformed or @encoding does not fit the item type
+	template <typename T>
+	static bool decode(ListEncoding encoding, const char * data, size_t size, size_t count, T * items) {
+		if (encoding != GeometryListTraits<T>::encoding) {
+			return false;
+		}
+		if (encoding == ListEncoding::DeltaVarint) {
+			return decodeDeltaVarint(data, size, count, reinterpret_cast<int32_t *>(items));
+		}
+		return decodeBytePlanes(data, size, count, sizeof(T) / 4, reinterpret_cast<char *>(items));
+	}
+};
+
+#endif // _GEOMETRY_ENCODING_HPP_
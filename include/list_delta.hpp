@@ -0,0 +1,207 @@
+#ifndef _LIST_DELTA_HPP_
+#define _LIST_DELTA_HPP_
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "zmq_message.hpp"
+
+/// Sends list property updates with only the changed items
+/// Keeps a copy (shadow) of the last list sent for each plugin and property and diffs the new list against it,
+/// the result is either a full msgPluginSetProperty or a msgPluginPatchProperty with the changed ranges
+/// The shadow must match what the receiver has, so it changes only when a message is queued, and patches are
+/// sent only to receivers accepting them (MessageFormat::listPatches)
+/// Not thread safe, use one encoder per exporting thread
+class ListDeltaEncoder {
+public:
+	/// @maxPatchRatio - a patch is sent only if it is at most this part of the full list size
+	/// @mergeGap - changed ranges closer than this many bytes are merged, since each range costs 16 bytes
+	explicit ListDeltaEncoder(float maxPatchRatio = 0.5f, size_t mergeGap = 64)
+	    : maxPatchRatio(maxPatchRatio)
+	    , mergeGap(mergeGap)
+	    , shadowBytes(0)
+	{}
+
+	/// Send a list property update, a patch if there is a shadow of the same type and the change is small
+	/// enough, else a full update. Nothing is sent if the list did not change since the last update
+	/// @send - callable(MessageParts &&) queueing the message, like ZmqClient::trySend, the shadow is updated
+	///         to @list only if it returns true
+	/// @encoding - passed to the message, see GeometryEncoding
+	/// @format - passed to the message, see MessageFormat, without MessageFormat::listPatches every update is full
+	/// @return - false if @send failed
+	template <typename T, typename F>
+	bool update(const std::string & plugin, const std::string & property, const VRayBaseTypes::AttrList<T> & list, F send,
+	            GeometryEncoding encoding = GeometryEncoding::None, const MessageFormat & format = MessageFormat()) {
+		if (!format.listPatches) {
+			return send(VRayMessage::msgPluginSetProperty(plugin, property, list, encoding, format));
+		}
+
+		const VRayBaseTypes::ValueType type = list.getType();
+		const char * data = reinterpret_cast<const char *>(list.getItems());
+		const size_t bytes = list.getCount() * sizeof(T);
+		const std::string key = makeKey(plugin, property);
+
+		auto iter = shadows.find(key);
+		std::vector<ListRange> ranges;
+		if (iter != shadows.end() && iter->second.type == type && diff(iter->second.data, data, bytes, sizeof(T), ranges)) {
+			if (ranges.empty() && iter->second.data.size() == bytes) {
+				return true;
+			}
+			VRayBaseTypes::AttrList<T> items;
+			items.resize(countItems(ranges));
+			char * out = reinterpret_cast<char *>(items.getData()->data());
+			for (const auto & range : ranges) {
+				const size_t offset = static_cast<size_t>(range.offset) * sizeof(T);
+				const size_t size = static_cast<size_t>(range.count) * sizeof(T);
+				memcpy(out, data + offset, size);
+				out += size;
+			}
+			if (!send(VRayMessage::msgPluginPatchProperty(plugin, property, list.getCount(), ranges, items, encoding, format))) {
+				return false;
+			}
+			store(iter->second, type, data, bytes, sizeof(T), &ranges);
+			return true;
+		}
+
+		if (!send(VRayMessage::msgPluginSetProperty(plugin, property, list, encoding, format))) {
+			return false;
+		}
+		store(shadows[key], type, data, bytes, sizeof(T), nullptr);
+		return true;
+	}
+
+	/// Drop the shadow of a property, the next update of it is sent in full
+	void forget(const std::string & plugin, const std::string & property) {
+		auto iter = shadows.find(makeKey(plugin, property));
+		if (iter != shadows.end()) {
+			shadowBytes -= iter->second.data.size();
+			shadows.erase(iter);
+		}
+	}
+
+	/// Drop all shadows of a plugin, call when it is removed or replaced
+	void forget(const std::string & plugin) {
+		const std::string prefix = makeKey(plugin, "");
+		for (auto iter = shadows.begin(); iter != shadows.end(); ) {
+			if (iter->first.compare(0, prefix.size(), prefix) == 0) {
+				shadowBytes -= iter->second.data.size();
+				iter = shadows.erase(iter);
+			} else {
+				++iter;
+			}
+		}
+	}
+
+	/// Drop all shadows, call when connecting to a new server
+	void clear() {
+		shadows.clear();
+		shadowBytes = 0;
+	}
+
+	/// Get the memory used by the shadows
+	size_t getShadowBytes() const {
+		return shadowBytes;
+	}
+
+private:
+	struct Shadow {
+		Shadow(): type(VRayBaseTypes::ValueTypeUnknown) {}
+
+		VRayBaseTypes::ValueType type; ///< Type of the list, a patch is sent only for the same type
+		std::vector<char> data; ///< Copy of the items last sent
+	};
+
+	static std::string makeKey(const std::string & plugin, const std::string & property) {
+		std::string key = plugin;
+		key.push_back('\0');
+		key += property;
+		return key;
+	}
+
+	static size_t countItems(const std::vector<ListRange> & ranges) {
+		size_t count = 0;
+		for (const auto & range : ranges) {
+			count += static_cast<size_t>(range.count);
+		}
+		return count;
+	}
+
+	/// Find the changed items of @data compared to @previous, items past the end of @previous are changed
+	/// Blocks are first compared with memcmp, which every C runtime vectorizes, so the unchanged parts of
+	/// a big list cost about as much as reading them once; only differing blocks are compared item by item
+	/// @return - false if the patch would be too big to be worth it
+	bool diff(const std::vector<char> & previous, const char * data, size_t bytes, size_t itemSize, std::vector<ListRange> & ranges) const {
+		const size_t itemCount = bytes / itemSize;
+		const size_t common = std::min(previous.size(), bytes) / itemSize;
+		const size_t blockItems = std::max<size_t>(1, BLOCK_BYTES / itemSize);
+		const size_t gapItems = mergeGap / itemSize + 1;
+		const size_t maxPatchBytes = static_cast<size_t>(bytes * maxPatchRatio);
+		size_t patchBytes = 0;
+
+		auto addChanged = [&] (size_t first, size_t count) {
+			if (!ranges.empty()) {
+				ListRange & last = ranges.back();
+				const size_t lastEnd = static_cast<size_t>(last.offset + last.count);
+				if (first - lastEnd < gapItems) {
+					patchBytes += (first + count - lastEnd) * itemSize;
+					last.count = first + count - last.offset;
+					return;
+				}
+			}
+			ListRange range = {first, count};
+			ranges.push_back(range);
+			patchBytes += count * itemSize + sizeof(ListRange);
+		};
+
+		for (size_t block = 0; block < common && patchBytes <= maxPatchBytes; block += blockItems) {
+			const size_t blockEnd = std::min(block + blockItems, common);
+			if (!memcmp(previous.data() + block * itemSize, data + block * itemSize, (blockEnd - block) * itemSize)) {
+				continue;
+			}
+			for (size_t c = block; c < blockEnd; ) {
+				if (!memcmp(previous.data() + c * itemSize, data + c * itemSize, itemSize)) {
+					++c;
+					continue;
+				}
+				size_t end = c + 1;
+				while (end < blockEnd && memcmp(previous.data() + end * itemSize, data + end * itemSize, itemSize)) {
+					++end;
+				}
+				addChanged(c, end - c);
+				c = end;
+			}
+		}
+		if (itemCount > common) {
+			addChanged(common, itemCount - common);
+		}
+		return patchBytes <= maxPatchBytes;
+	}
+
+	/// Update @shadow to @data, copying only @ranges if given
+	void store(Shadow & shadow, VRayBaseTypes::ValueType type, const char * data, size_t bytes, size_t itemSize, const std::vector<ListRange> * ranges) {
+		shadowBytes -= shadow.data.size();
+		if (ranges && shadow.type == type) {
+			shadow.data.resize(bytes);
+			for (const auto & range : *ranges) {
+				const size_t offset = static_cast<size_t>(range.offset) * itemSize;
+				memcpy(shadow.data.data() + offset, data + offset, static_cast<size_t>(range.count) * itemSize);
+			}
+		} else {
+			shadow.type = type;
+			shadow.data.assign(data, data + bytes);
+		}
+		shadowBytes += shadow.data.size();
+	}
+
+	static const size_t BLOCK_BYTES = 4096; ///< Size of the blocks compared at once by diff
+
+	std::unordered_map<std::string, Shadow> shadows; ///< Last sent lists by plugin and property
+	float maxPatchRatio; ///< Max patch size relative to the full list
+	size_t mergeGap; ///< Max bytes between merged ranges
+	size_t shadowBytes; ///< Sum of the shadow sizes
+};
+
+#endif // _LIST_DELTA_HPP_
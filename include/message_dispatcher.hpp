@@ -0,0 +1,265 @@
+#ifndef _MESSAGE_DISPATCHER_HPP_
+#define _MESSAGE_DISPATCHER_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "zmq_message.hpp"
+
+/// Counters of a MessageDispatcher, all times are in microseconds
+struct DispatchStats {
+	DispatchStats()
+	    : queueDepth(0)
+	    , maxQueueDepth(0)
+	    , dispatched(0)
+	    , conflated(0)
+	    , totalWait(0)
+	    , maxWait(0)
+	    , totalCallback(0)
+	    , maxCallback(0)
+	{}
+
+	int queueDepth; ///< Messages waiting for a dispatcher thread
+	int maxQueueDepth; ///< Highest @queueDepth so far
+	uint64_t dispatched; ///< Number of messages passed to the handler
+	uint64_t conflated; ///< Number of RT images dropped because a newer one replaced them
+	uint64_t totalWait; ///< Sum of the times messages waited in the queue
+	uint64_t maxWait; ///< Longest time a message waited in the queue
+	uint64_t totalCallback; ///< Sum of the handler run times
+	uint64_t maxCallback; ///< Longest handler run time
+};
+
+/// Calls a handler for received messages on its own threads, so a slow handler does not block socket IO
+/// Each thread has its own queue, messages are assigned to a queue by plugin name, so messages for the same
+/// plugin (and all messages without plugin - images, logs, renderer changes) are handled in the order pushed
+class MessageDispatcher {
+public:
+	typedef std::function<void(const VRayMessage &)> Handler;
+
+	/// Start the dispatcher threads
+	/// @threadCount - number of threads, at least one is started
+	/// @handler - called for each pushed message on one of the threads, possibly concurrently for different plugins
+	MessageDispatcher(int threadCount, Handler handler);
+	~MessageDispatcher();
+
+	MessageDispatcher(const MessageDispatcher &) = delete;
+	MessageDispatcher & operator=(const MessageDispatcher &) = delete;
+
+	/// Add message to the queue of its plugin's thread, safe to call from any thread
+	void push(VRayMessage && message);
+
+	/// Enable dropping of queued RtImageUpdate images when a newer one with the same (or more) channels is pushed
+	/// Only the newest RT image reaches the handler, bucket and final images are always kept
+	void setConflateImages(bool flag);
+
+	/// Stop and join all threads, running handlers are waited for, queued messages are dropped
+	void stop();
+
+	/// Get number of messages waiting to be handled, safe to call from any thread
+	int getQueueDepth() const;
+
+	/// Get snapshot of the counters, safe to call from any thread
+	DispatchStats getStats() const;
+
+private:
+	typedef std::chrono::high_resolution_clock::time_point time_point;
+
+	struct Item {
+		VRayMessage message;
+		time_point queued; ///< Time of push, used for the wait stats
+		std::vector<VRayBaseTypes::RenderChannelType> rtChannels; ///< Channels of a RtImageUpdate if conflating
+	};
+
+	/// One thread and its queue
+	struct Lane {
+		std::mutex mutex; ///< Protects @items
+		std::condition_variable cond; ///< Signaled on push and stop
+		std::deque<Item> items;
+		std::thread thread;
+	};
+
+	/// Start function of the dispatcher threads
+	void laneThread(Lane & lane);
+	/// Drop items from @items that are RT images with channels all in @channels, lane mutex must be held
+	void conflate(std::deque<Item> & items, const std::vector<VRayBaseTypes::RenderChannelType> & channels);
+	/// Account a time sample
+	void addSample(std::atomic<uint64_t> & total, std::atomic<uint64_t> & max, uint64_t value);
+
+	Handler handler; ///< Called for each message
+	std::vector<std::unique_ptr<Lane>> lanes; ///< One per thread
+	std::atomic<bool> running; ///< Cleared by stop()
+	std::atomic<bool> conflateImages; ///< Drop older RT images
+
+	std::atomic<int> queueDepth; ///< Messages in all lanes
+	std::atomic<int> maxQueueDepth; ///< Highest @queueDepth
+	std::atomic<uint64_t> dispatched; ///< Messages handled
+	std::atomic<uint64_t> conflated; ///< RT images dropped
+	std::atomic<uint64_t> totalWait; ///< Sum of queue wait times
+	std::atomic<uint64_t> maxWait; ///< Max queue wait time
+	std::atomic<uint64_t> totalCallback; ///< Sum of handler times
+	std::atomic<uint64_t> maxCallback; ///< Max handler time
+};
+
+
+inline MessageDispatcher::MessageDispatcher(int threadCount, Handler handler)
+    : handler(std::move(handler))
+    , running(true)
+    , conflateImages(false)
+    , queueDepth(0)
+    , maxQueueDepth(0)
+    , dispatched(0)
+    , conflated(0)
+    , totalWait(0)
+    , maxWait(0)
+    , totalCallback(0)
+    , maxCallback(0)
+{
+	threadCount = std::max(threadCount, 1);
+	lanes.reserve(threadCount);
+	for (int c = 0; c < threadCount; ++c) {
+		lanes.push_back(std::unique_ptr<Lane>(new Lane));
+	}
+	// start after all lanes exist, so no thread sees the vector change
+	for (auto & lane : lanes) {
+		lane->thread = std::thread(&MessageDispatcher::laneThread, this, std::ref(*lane));
+	}
+}
+
+inline MessageDispatcher::~MessageDispatcher() {
+	stop();
+}
+
+inline void MessageDispatcher::push(VRayMessage && message) {
+	if (!running) {
+		return;
+	}
+	Lane & lane = *lanes[std::hash<std::string>()(message.getPlugin()) % lanes.size()];
+
+	std::vector<VRayBaseTypes::RenderChannelType> rtChannels;
+	if (conflateImages && message.getType() == VRayMessage::Type::Image) {
+		VRayBaseTypes::ImageSourceType source = VRayBaseTypes::ImageSourceInvalid;
+		// only peeks the channel list, so with VRayMessage::ParseLazyValue dropped images are never decoded
+		if (!message.getImageSetInfo(source, rtChannels) || source != VRayBaseTypes::RtImageUpdate) {
+			rtChannels.clear();
+		}
+	}
+
+	const int depth = ++queueDepth;
+	int prevMax = maxQueueDepth;
+	while (depth > prevMax && !maxQueueDepth.compare_exchange_weak(prevMax, depth)) {}
+
+	{
+		std::lock_guard<std::mutex> lock(lane.mutex);
+		if (!rtChannels.empty()) {
+			conflate(lane.items, rtChannels);
+		}
+		lane.items.push_back(Item{std::move(message), std::chrono::high_resolution_clock::now(), std::move(rtChannels)});
+	}
+	lane.cond.notify_one();
+}
+
+inline void MessageDispatcher::stop() {
+	if (!running.exchange(false)) {
+		return;
+	}
+	for (auto & lane : lanes) {
+		{
+			std::lock_guard<std::mutex> lock(lane->mutex);
+			queueDepth -= static_cast<int>(lane->items.size());
+			lane->items.clear();
+		}
+		lane->cond.notify_all();
+	}
+	for (auto & lane : lanes) {
+		if (lane->thread.joinable()) {
+			lane->thread.join();
+		}
+	}
+}
+
+inline void MessageDispatcher::setConflateImages(bool flag) {
+	conflateImages = flag;
+}
+
+inline void MessageDispatcher::conflate(std::deque<Item> & items, const std::vector<VRayBaseTypes::RenderChannelType> & channels) {
+	auto isCovered = [&channels] (const Item & item) {
+		for (auto channel : item.rtChannels) {
+			if (std::find(channels.begin(), channels.end(), channel) == channels.end()) {
+				return false;
+			}
+		}
+		return !item.rtChannels.empty();
+	};
+	if (std::none_of(items.begin(), items.end(), isCovered)) {
+		return;
+	}
+	// VRayMessage is not move assignable, so rebuild the queue instead of erasing in the middle
+	std::deque<Item> kept;
+	for (auto & item : items) {
+		if (isCovered(item)) {
+			--queueDepth;
+			++conflated;
+		} else {
+			kept.push_back(std::move(item));
+		}
+	}
+	items.swap(kept);
+}
+
+inline int MessageDispatcher::getQueueDepth() const {
+	return queueDepth;
+}
+
+inline DispatchStats MessageDispatcher::getStats() const {
+	DispatchStats stats;
+	stats.queueDepth = queueDepth;
+	stats.maxQueueDepth = maxQueueDepth;
+	stats.dispatched = dispatched;
+	stats.conflated = conflated;
+	stats.totalWait = totalWait;
+	stats.maxWait = maxWait;
+	stats.totalCallback = totalCallback;
+	stats.maxCallback = maxCallback;
+	return stats;
+}
+
+inline void MessageDispatcher::addSample(std::atomic<uint64_t> & total, std::atomic<uint64_t> & max, uint64_t value) {
+	total += value;
+	uint64_t prevMax = max;
+	while (value > prevMax && !max.compare_exchange_weak(prevMax, value)) {}
+}
+
+inline void MessageDispatcher::laneThread(Lane & lane) {
+	using namespace std::chrono;
+	while (true) {
+		std::unique_lock<std::mutex> lock(lane.mutex);
+		lane.cond.wait(lock, [this, &lane] { return !running || !lane.items.empty(); });
+		if (!running) {
+			return;
+		}
+		Item item(std::move(lane.items.front()));
+		lane.items.pop_front();
+		lock.unlock();
+
+		const auto begin = high_resolution_clock::now();
+		addSample(totalWait, maxWait, duration_cast<microseconds>(begin - item.queued).count());
+
+		handler(item.message);
+
+		addSample(totalCallback, maxCallback, duration_cast<microseconds>(high_resolution_clock::now() - begin).count());
+		++dispatched;
+		--queueDepth;
+	}
+}
+
+#endif // _MESSAGE_DISPATCHER_HPP_
@@ -0,0 +1,184 @@
+#ifndef _MPSC_QUEUE_HPP_
+#define _MPSC_QUEUE_HPP_
+
+#include <atomic>
+#include <utility>
+
+/// Unbounded multi producer single consumer queue (intrusive linked list, D. Vyukov's algorithm)
+/// push() is wait-free - one atomic exchange and one store, pop() must only be called from one thread
+/// The consumer can observe the queue as empty for a brief moment while a producer is between
+/// the exchange and the link store, it will see the item on next pop()
+/// Nodes of popped items are kept in a pool and reused by push(), so pushes to a queue in steady state do not allocate.
+/// This covers only the queue - the items themselves are allocated by whoever makes them, ZmqClient messages
+/// made with its MessageFormat have their payloads in PayloadPool blocks
+/// The pool is guarded by a spin flag that is only ever tried, never waited on - if it is busy push() allocates
+/// and the consumer keeps its nodes for the next try, so push() stays wait-free
+template <typename T>
+class MPSCQueue {
+public:
+	MPSCQueue()
+	    : head(new Node)
+	    , tail(head.load(std::memory_order_relaxed))
+	    , count(0)
+	    , pool(nullptr)
+	    , poolSize(0)
+	    , freed(nullptr)
+	    , freedTail(nullptr)
+	    , freedCount(0)
+	{}
+
+	~MPSCQueue() {
+		T item;
+		while (pop(item)) {}
+		delete tail;
+		deleteNodes(pool);
+		deleteNodes(freed);
+	}
+
+	MPSCQueue(const MPSCQueue &) = delete;
+	MPSCQueue & operator=(const MPSCQueue &) = delete;
+
+	/// Add item at the back of the queue, safe to call from any thread
+	void push(T && value) {
+		Node * node = takeNode();
+		if (node) {
+			node->value = std::move(value);
+			node->next.store(nullptr, std::memory_order_relaxed);
+		} else {
+			node = new Node(std::move(value));
+		}
+		// count before publishing so size() never goes negative for the consumer
+		count.fetch_add(1, std::memory_order_relaxed);
+		Node * prev = head.exchange(node, std::memory_order_acq_rel);
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	/// Take the front item, must only be called from the consumer thread
+	/// @value - will be assigned the popped item
+	/// @return - false if there was nothing to pop
+	bool pop(T & value) {
+		Node * next = tail->next.load(std::memory_order_acquire);
+		if (!next) {
+			return false;
+		}
+		value = std::move(next->value);
+		// next becomes the new stub node, its value is moved from
+		recycleNode(tail);
+		tail = next;
+		count.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	/// Get pointer to the front item without removing it, must only be called from the consumer thread
+	/// @return - nullptr if queue is empty, pointer is valid until the next pop()
+	T * front() {
+		Node * next = tail->next.load(std::memory_order_acquire);
+		return next ? &next->value : nullptr;
+	}
+
+	/// Remove the front item if any, must only be called from the consumer thread
+	void pop() {
+		Node * next = tail->next.load(std::memory_order_acquire);
+		if (next) {
+			next->value = T();
+			recycleNode(tail);
+			tail = next;
+			count.fetch_sub(1, std::memory_order_relaxed);
+		}
+	}
+
+	/// Check if the consumer will find anything in the queue, must only be called from the consumer thread
+	bool empty() const {
+		return tail->next.load(std::memory_order_acquire) == nullptr;
+	}
+
+	/// Get the number of items pushed and not yet popped, safe to call from any thread
+	int size() const {
+		return count.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Node {
+		Node(): next(nullptr), value() {}
+		explicit Node(T && value): next(nullptr), value(std::move(value)) {}
+
+		std::atomic<Node*> next;
+		T value;
+	};
+
+	/// Get a node from the pool, used by producers
+	/// @return - nullptr if the pool is empty or another thread is using it
+	Node * takeNode() {
+		if (poolLock.test_and_set(std::memory_order_acquire)) {
+			return nullptr;
+		}
+		Node * node = pool;
+		if (node) {
+			pool = node->next.load(std::memory_order_relaxed);
+			--poolSize;
+		}
+		poolLock.clear(std::memory_order_release);
+		return node;
+	}
+
+	/// Return the node of a popped item, used by the consumer
+	/// Nodes are moved to the pool in batches to take the flag less often
+	void recycleNode(Node * node) {
+		node->next.store(freed, std::memory_order_relaxed);
+		if (!freed) {
+			freedTail = node;
+		}
+		freed = node;
+		if (++freedCount < RECYCLE_BATCH) {
+			return;
+		}
+
+		if (poolLock.test_and_set(std::memory_order_acquire)) {
+			// producers are busy with the pool, try again on the next pop unless too many are waiting
+			if (freedCount >= MAX_POOL_SIZE) {
+				deleteNodes(freed);
+				freed = nullptr;
+				freedCount = 0;
+			}
+			return;
+		}
+		Node * extra = nullptr;
+		if (poolSize + freedCount <= MAX_POOL_SIZE) {
+			freedTail->next.store(pool, std::memory_order_relaxed);
+			pool = freed;
+			poolSize += freedCount;
+		} else {
+			extra = freed;
+		}
+		poolLock.clear(std::memory_order_release);
+		deleteNodes(extra);
+		freed = nullptr;
+		freedCount = 0;
+	}
+
+	static void deleteNodes(Node * node) {
+		while (node) {
+			Node * next = node->next.load(std::memory_order_relaxed);
+			delete node;
+			node = next;
+		}
+	}
+
+	enum {
+		RECYCLE_BATCH = 32, ///< Number of popped nodes the consumer collects before moving them to the pool
+		MAX_POOL_SIZE = 1024, ///< Max number of nodes in the pool, more are deleted
+	};
+
+	std::atomic<Node*> head; ///< Last pushed node, producers swap themselves here
+	Node * tail; ///< Stub node before the front item, owned by the consumer
+	std::atomic<int> count; ///< Number of items in the queue
+
+	std::atomic_flag poolLock = ATOMIC_FLAG_INIT; ///< Set while a thread takes from or adds to @pool
+	Node * pool; ///< Nodes for reuse linked by next, guarded by @poolLock
+	int poolSize; ///< Number of nodes in @pool, guarded by @poolLock
+	Node * freed; ///< Nodes of popped items not yet moved to @pool, owned by the consumer
+	Node * freedTail; ///< Last node in @freed
+	int freedCount; ///< Number of nodes in @freed
+};
+
+#endif // _MPSC_QUEUE_HPP_
@@ -0,0 +1,329 @@
+#ifndef _PARALLEL_EXPORTER_HPP_
+#define _PARALLEL_EXPORTER_HPP_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "zmq_wrapper.hpp"
+
+/// Builds the plugin messages of a scene export on a pool of threads and queues them in a ZmqClient in a fixed order
+/// Items of a batch are split in chunks, the threads serialize whole chunks while the calling thread sends the built
+/// chunks in order, so the client gets the same message sequence no matter how many threads there are.
+/// Items keep the order they were added in, except that a Create is sent before the updates of its plugin
+/// added ahead of it, see orderCreates
+/// Only a few chunks per thread are built ahead of the sending, so memory stays bounded for big batches
+/// exportBatch must be called from one thread at a time and the exporter must not outlive its client
+class ParallelExporter {
+public:
+	/// One plugin change in a batch
+	struct Item {
+		Item()
+		    : action(VRayMessage::PluginAction::None)
+		    , encoding(GeometryEncoding::None)
+		{}
+
+		/// Make item creating a plugin
+		static Item create(const std::string & plugin, const std::string & pluginType) {
+			Item item;
+			item.action = VRayMessage::PluginAction::Create;
+			item.plugin = plugin;
+			item.name = pluginType;
+			return item;
+		}
+
+		/// Make item setting a property, see VRayMessage::msgPluginSetProperty
+		/// Large lists in @value are referenced by the message without copying (MessageFormat::referenceLists),
+		/// so AttrLists sharing their data with @value must not be modified until the message is sent
+		static Item update(const std::string & plugin, const std::string & property, VRayBaseTypes::AttrValue && value,
+		                   GeometryEncoding encoding = GeometryEncoding::None) {
+			Item item;
+			item.action = VRayMessage::PluginAction::Update;
+			item.plugin = plugin;
+			item.name = property;
+			item.value = std::move(value);
+			item.encoding = encoding;
+			return item;
+		}
+
+		/// Make item removing a plugin
+		static Item remove(const std::string & plugin) {
+			Item item;
+			item.action = VRayMessage::PluginAction::Remove;
+			item.plugin = plugin;
+			return item;
+		}
+
+		VRayMessage::PluginAction action; ///< Create, Update or Remove
+		std::string plugin; ///< Plugin name
+		std::string name; ///< Plugin type for Create, property name for Update
+		VRayBaseTypes::AttrValue value; ///< New value for Update
+		GeometryEncoding encoding; ///< Encoding for Update
+	};
+
+	typedef std::vector<Item> Batch;
+
+	/// Start the threads
+	/// @threadCount - number of threads building messages, 0 for one per core
+	explicit ParallelExporter(ZmqClient & client, int threadCount = 0);
+	~ParallelExporter();
+
+	ParallelExporter(const ParallelExporter &) = delete;
+	ParallelExporter & operator=(const ParallelExporter &) = delete;
+
+	/// Build and queue all messages of @batch, returns after the last one is queued in the client
+	/// Messages are queued with ZmqClient::sendBlocking, so this waits for queue space if the client has limits set
+	/// @return - false if the client or the exporter stopped, some of the messages may not be queued
+	bool exportBatch(Batch && batch);
+
+	/// Stop and join the threads, exportBatch fails after this
+	void stop();
+
+private:
+	enum {
+		CHUNK_SIZE = 256, ///< Number of items built by a thread at once
+		CHUNKS_PER_THREAD = 4, ///< Number of chunks per thread that may be built before the calling thread sends them
+	};
+
+	/// Move each Create in @batch before the updates of its plugin that were added before it
+	/// A Create never moves past a Remove or another Create of its plugin, so removing and creating a plugin
+	/// again in one batch keeps that order, and the updates of the old plugin stay before the Remove
+	static void orderCreates(Batch & batch);
+	/// Start function of the threads
+	void workerThread();
+	/// Build the messages for items in chunk @chunk of the current batch
+	void buildChunk(size_t chunk, std::vector<MessageParts> & messages);
+	/// Build the message for a single item
+	static MessageParts buildMessage(const Item & item, const MessageFormat & format);
+
+	ZmqClient & client; ///< Client queueing the built messages
+	std::vector<std::thread> threads; ///< Threads building messages
+
+	std::mutex mutex; ///< Protects all members below
+	std::condition_variable workCond; ///< Signaled when a batch starts, a chunk is sent or the batch ends
+	std::condition_variable doneCond; ///< Signaled when a chunk is built or a thread leaves the batch
+	bool running; ///< Cleared by stop()
+	bool cancelled; ///< Set when the current batch ends, threads stop taking its chunks
+	uint64_t batchId; ///< Incremented for each batch, so each thread joins it once
+	int activeThreads; ///< Number of threads working on the current batch
+	const Batch * items; ///< Items of the current batch, nullptr if there is none
+	MessageFormat format; ///< Format of the messages of the current batch
+	size_t chunkCount; ///< Number of chunks in the current batch
+	size_t nextChunk; ///< Next chunk to be taken by a thread
+	size_t sentChunks; ///< Number of chunks queued in the client
+	std::vector<std::vector<MessageParts>> window; ///< Messages of chunk c are in window[c % window.size()]
+	std::vector<char> built; ///< Set for window slots with a built chunk that is not sent yet
+};
+
+
+inline ParallelExporter::ParallelExporter(ZmqClient & client, int threadCount)
+    : client(client)
+    , running(true)
+    , cancelled(true)
+    , batchId(0)
+    , activeThreads(0)
+    , items(nullptr)
+    , chunkCount(0)
+    , nextChunk(0)
+    , sentChunks(0)
+{
+	if (threadCount <= 0) {
+		threadCount = static_cast<int>(std::thread::hardware_concurrency());
+	}
+	threadCount = std::max(threadCount, 1);
+	window.resize(threadCount * CHUNKS_PER_THREAD);
+	built.resize(window.size(), false);
+
+	threads.reserve(threadCount);
+	for (int c = 0; c < threadCount; ++c) {
+		threads.push_back(std::thread(&ParallelExporter::workerThread, this));
+	}
+}
+
+inline ParallelExporter::~ParallelExporter() {
+	stop();
+}
+
+inline void ParallelExporter::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!running) {
+			return;
+		}
+		running = false;
+		cancelled = true;
+	}
+	workCond.notify_all();
+	doneCond.notify_all();
+	for (auto & thread : threads) {
+		if (thread.joinable()) {
+			thread.join();
+		}
+	}
+}
+
+inline bool ParallelExporter::exportBatch(Batch && batch) {
+	// updates of a plugin must not reach the server before the plugin exists
+	orderCreates(batch);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	if (!running) {
+		return false;
+	}
+	items = &batch;
+	// the items own their values and live until the batch is queued, the messages keep the list data alive after that
+	format = client.getMessageFormat();
+	format.referenceLists = true;
+	chunkCount = (batch.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	nextChunk = 0;
+	sentChunks = 0;
+	cancelled = false;
+	std::fill(built.begin(), built.end(), false);
+	++batchId;
+	workCond.notify_all();
+
+	bool ok = true;
+	std::vector<MessageParts> messages;
+	while (sentChunks < chunkCount) {
+		const size_t slot = sentChunks % window.size();
+		doneCond.wait(lock, [this, slot] { return built[slot] || !running; });
+		if (!running) {
+			ok = false;
+			break;
+		}
+		// the slot gets the empty vector, so its capacity is reused for a later chunk
+		messages.swap(window[slot]);
+		built[slot] = false;
+		++sentChunks;
+		workCond.notify_all();
+		lock.unlock();
+
+		for (auto & message : messages) {
+			if (!client.sendBlocking(std::move(message))) {
+				ok = false;
+				break;
+			}
+		}
+		messages.clear();
+		lock.lock();
+		if (!ok) {
+			break;
+		}
+	}
+
+	// wait for the threads to leave the batch, they reference it
+	cancelled = true;
+	workCond.notify_all();
+	doneCond.wait(lock, [this] { return activeThreads == 0; });
+	items = nullptr;
+	for (auto & slot : window) {
+		slot.clear();
+	}
+	return ok;
+}
+
+inline void ParallelExporter::orderCreates(Batch & batch) {
+	const size_t none = batch.size();
+	// index of the first update of each plugin since its last Create or Remove
+	std::unordered_map<std::string, size_t> firstUpdate;
+	// createAt[c] is the Create moved before item c, or none
+	std::vector<size_t> createAt;
+	for (size_t c = 0; c < batch.size(); ++c) {
+		const Item & item = batch[c];
+		if (item.action == VRayMessage::PluginAction::Update) {
+			firstUpdate.emplace(item.plugin, c);
+			continue;
+		}
+		auto iter = firstUpdate.find(item.plugin);
+		if (iter == firstUpdate.end()) {
+			continue;
+		}
+		if (item.action == VRayMessage::PluginAction::Create) {
+			if (createAt.empty()) {
+				createAt.resize(batch.size(), none);
+			}
+			createAt[iter->second] = c;
+		}
+		firstUpdate.erase(iter);
+	}
+	if (createAt.empty()) {
+		return;
+	}
+
+	Batch ordered;
+	ordered.reserve(batch.size());
+	std::vector<char> moved(batch.size(), false);
+	for (size_t c = 0; c < batch.size(); ++c) {
+		if (createAt[c] != none) {
+			moved[createAt[c]] = true;
+			ordered.push_back(std::move(batch[createAt[c]]));
+		}
+		if (!moved[c]) {
+			ordered.push_back(std::move(batch[c]));
+		}
+	}
+	batch.swap(ordered);
+}
+
+inline void ParallelExporter::workerThread() {
+	uint64_t joinedId = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		workCond.wait(lock, [this, joinedId] { return !running || (items && !cancelled && batchId != joinedId); });
+		if (!running) {
+			return;
+		}
+		joinedId = batchId;
+		++activeThreads;
+
+		while (true) {
+			// build ahead only as far as the window allows
+			workCond.wait(lock, [this] { return cancelled || nextChunk >= chunkCount || nextChunk < sentChunks + window.size(); });
+			if (cancelled || nextChunk >= chunkCount) {
+				break;
+			}
+			const size_t chunk = nextChunk++;
+			std::vector<MessageParts> & messages = window[chunk % window.size()];
+			lock.unlock();
+
+			buildChunk(chunk, messages);
+
+			lock.lock();
+			built[chunk % window.size()] = true;
+			doneCond.notify_all();
+		}
+
+		--activeThreads;
+		doneCond.notify_all();
+	}
+}
+
+inline void ParallelExporter::buildChunk(size_t chunk, std::vector<MessageParts> & messages) {
+	const size_t begin = chunk * CHUNK_SIZE;
+	const size_t end = std::min(begin + CHUNK_SIZE, items->size());
+	messages.reserve(end - begin);
+	for (size_t c = begin; c < end; ++c) {
+		messages.push_back(buildMessage((*items)[c], format));
+	}
+}
+
+inline MessageParts ParallelExporter::buildMessage(const Item & item, const MessageFormat & format) {
+	switch (item.action) {
+	case VRayMessage::PluginAction::Create:
+		return VRayMessage::msgPluginCreate(item.plugin, item.name, format);
+	case VRayMessage::PluginAction::Update:
+		return VRayMessage::msgPluginSetProperty(item.plugin, item.name, item.value, item.encoding, format);
+	case VRayMessage::PluginAction::Remove:
+		return VRayMessage::msgPluginAction(item.plugin, VRayMessage::PluginAction::Remove, format);
+	default:
+		assert(!"Wrong PluginAction in ParallelExporter::Item");
+		return MessageParts();
+	}
+}
+
+#endif // _PARALLEL_EXPORTER_HPP_
@@ -0,0 +1,180 @@
+#ifndef _PAYLOAD_POOL_HPP_
+#define _PAYLOAD_POOL_HPP_
+
+#include <cstdlib>
+#include <mutex>
+
+/// Size up to which zmq keeps message data inside zmq::message_t without allocating
+static const size_t ZMQ_INLINE_BYTES = 33;
+
+/// Buffer of a PayloadPool size class, the data follows the header
+struct PayloadBlock {
+	PayloadBlock * next; ///< Next block in a free list
+	int sizeClass; ///< Index of the size class of the block
+
+	char * data() {
+		return reinterpret_cast<char *>(this + 1);
+	}
+};
+
+/// Payload buffers in power of two size classes from MIN_BYTES to MAX_BYTES, VRayMessage::build makes payloads
+/// in them so messages made in steady state do not allocate
+/// Each thread takes blocks from and returns them to its own cache without locking. A cache over its limit moves
+/// half of a class to a shared list, where threads with an empty cache refill from - so blocks freed by the
+/// ZmqClient worker or by zmq's IO thread go back to the threads making messages. Blocks over the limit of the
+/// shared list are freed
+class PayloadPool {
+public:
+	enum {
+		MIN_BYTES = 64, ///< Size of the smallest class
+		MAX_BYTES = 64 * 1024, ///< Size of the biggest class, bigger payloads are not pooled
+		CLASS_COUNT = 11, ///< Number of classes from MIN_BYTES to MAX_BYTES
+		CACHE_BYTES = 64 * 1024, ///< Max size of the blocks of one class in a thread's cache, at least 2 blocks
+		SHARED_BYTES = 4 * 1024 * 1024, ///< Max size of the blocks of one class in the shared list
+	};
+
+	/// Get a block for @size bytes, safe to call from any thread
+	/// @return - nullptr if @size is over MAX_BYTES or the allocation failed
+	static PayloadBlock * acquire(size_t size) {
+		const int sizeClass = getClass(size);
+		if (sizeClass < 0) {
+			return nullptr;
+		}
+		Cache & cache = getCache();
+		if (!cache.blocks[sizeClass]) {
+			getShared().take(sizeClass, cache, getCacheLimit(sizeClass) / 2);
+		}
+		PayloadBlock * block = cache.blocks[sizeClass];
+		if (block) {
+			cache.blocks[sizeClass] = block->next;
+			--cache.counts[sizeClass];
+			return block;
+		}
+		block = static_cast<PayloadBlock *>(malloc(sizeof(PayloadBlock) + getClassBytes(sizeClass)));
+		if (block) {
+			block->next = nullptr;
+			block->sizeClass = sizeClass;
+		}
+		return block;
+	}
+
+	/// Return a block from acquire, safe to call from any thread
+	static void release(PayloadBlock * block) {
+		Cache & cache = getCache();
+		const int sizeClass = block->sizeClass;
+		block->next = cache.blocks[sizeClass];
+		cache.blocks[sizeClass] = block;
+		if (++cache.counts[sizeClass] > getCacheLimit(sizeClass)) {
+			getShared().put(sizeClass, cache, cache.counts[sizeClass] / 2);
+		}
+	}
+
+	/// zmq free function for frames over the data of a block, @hint is the PayloadBlock
+	static void releaseFrame(void *, void * hint) {
+		release(static_cast<PayloadBlock *>(hint));
+	}
+
+private:
+	/// Blocks of one thread by class
+	struct Cache {
+		Cache()
+		    : blocks()
+		    , counts()
+		{}
+
+		~Cache() {
+			// the thread is done making and freeing messages, other threads may still use its blocks
+			for (int c = 0; c < CLASS_COUNT; ++c) {
+				getShared().put(c, *this, counts[c]);
+			}
+		}
+
+		PayloadBlock * blocks[CLASS_COUNT]; ///< Free blocks linked by next
+		int counts[CLASS_COUNT]; ///< Number of blocks in @blocks
+	};
+
+	/// Blocks moved out of thread caches by class
+	struct Shared {
+		Shared()
+		    : blocks()
+		    , counts()
+		{}
+
+		/// Move up to @count blocks of @sizeClass to @cache
+		void take(int sizeClass, Cache & cache, int count) {
+			std::lock_guard<std::mutex> lock(mutex[sizeClass]);
+			for (; count > 0 && blocks[sizeClass]; --count) {
+				PayloadBlock * block = blocks[sizeClass];
+				blocks[sizeClass] = block->next;
+				--counts[sizeClass];
+				block->next = cache.blocks[sizeClass];
+				cache.blocks[sizeClass] = block;
+				++cache.counts[sizeClass];
+			}
+		}
+
+		/// Move @count blocks of @sizeClass from @cache, freeing the ones over SHARED_BYTES
+		void put(int sizeClass, Cache & cache, int count) {
+			const int limit = SHARED_BYTES / getClassBytes(sizeClass);
+			PayloadBlock * extra = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(mutex[sizeClass]);
+				for (; count > 0; --count) {
+					PayloadBlock * block = cache.blocks[sizeClass];
+					cache.blocks[sizeClass] = block->next;
+					--cache.counts[sizeClass];
+					if (counts[sizeClass] < limit) {
+						block->next = blocks[sizeClass];
+						blocks[sizeClass] = block;
+						++counts[sizeClass];
+					} else {
+						block->next = extra;
+						extra = block;
+					}
+				}
+			}
+			while (extra) {
+				PayloadBlock * next = extra->next;
+				free(extra);
+				extra = next;
+			}
+		}
+
+		std::mutex mutex[CLASS_COUNT]; ///< Protects the class with the same index
+		PayloadBlock * blocks[CLASS_COUNT]; ///< Free blocks linked by next
+		int counts[CLASS_COUNT]; ///< Number of blocks in @blocks
+	};
+
+	/// Get the index of the smallest class that fits @size bytes, -1 if none does
+	static int getClass(size_t size) {
+		int sizeClass = 0;
+		while (getClassBytes(sizeClass) < size) {
+			if (++sizeClass == CLASS_COUNT) {
+				return -1;
+			}
+		}
+		return sizeClass;
+	}
+
+	static size_t getClassBytes(int sizeClass) {
+		return static_cast<size_t>(MIN_BYTES) << sizeClass;
+	}
+
+	static int getCacheLimit(int sizeClass) {
+		const int limit = static_cast<int>(CACHE_BYTES / getClassBytes(sizeClass));
+		return limit < 2 ? 2 : limit;
+	}
+
+	static Cache & getCache() {
+		thread_local Cache cache;
+		return cache;
+	}
+
+	static Shared & getShared() {
+		// never destroyed, caches of threads ending after main return their blocks to it
+		static Shared * shared = new Shared;
+		return *shared;
+	}
+};
+
+#endif // _PAYLOAD_POOL_HPP_
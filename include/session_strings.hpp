@@ -0,0 +1,210 @@
+#ifndef _SESSION_STRINGS_HPP_
+#define _SESSION_STRINGS_HPP_
+
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "zmq_serializer.hpp"
+#include "zmq_deserializer.hpp"
+
+/// Plugin, type or property name of a message, resolved by SessionStringEncoder::intern before the message is built
+/// so measuring and writing the message give the same size
+struct InternedName {
+	/// Make a name sent as a plain string
+	explicit InternedName(const std::string & name)
+	    : name(&name)
+	    , kind(StringHeader::Plain)
+	    , id(0)
+	{}
+
+	InternedName(const std::string & name, StringHeader kind, WireSize id)
+	    : name(&name)
+	    , kind(kind)
+	    , id(id)
+	{}
+
+	const std::string * name; ///< The name, must be valid while the message is built
+	StringHeader kind; ///< How the name is written
+	WireSize id; ///< Id of the name unless it is plain
+};
+
+/// Write a name as a plain string, a reference, or a definition that is recorded in the stream
+inline SerializerStream & operator<<(SerializerStream & stream, const InternedName & value) {
+	if (value.kind == StringHeader::Reference) {
+		writeStringHeader(stream, StringHeader::Reference, value.id);
+		return stream;
+	}
+	if (value.kind == StringHeader::Definition) {
+		writeStringHeader(stream, StringHeader::Definition, value.id);
+		stream.define(value.id);
+	}
+	writeStringHeader(stream, StringHeader::Plain, value.name->size());
+	stream.write(value.name->data(), value.name->size());
+	return stream;
+}
+
+/// Sending side of the session string table, assigns ids to plugin, type and property names of ChangePlugin messages
+/// The msg* methods intern the names with the encoder in their MessageFormat (see ZmqClient::getMessageFormat) and
+/// send a StringHeader::Reference only for names committed by a message already queued for sending. Until then
+/// each message using a name defines it again with the same id, so a message that is never sent loses nothing
+/// Thread safe, messages can be built on any thread
+class SessionStringEncoder {
+public:
+	/// @maxStrings - names seen after this many are sent as plain strings
+	explicit SessionStringEncoder(size_t maxStrings = DEFAULT_MAX_STRINGS)
+	    : maxStrings(maxStrings)
+	{}
+
+	/// Get how to write @name in a message, assigns an id to it the first time
+	InternedName intern(const std::string & name) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iter = ids.find(name);
+		if (iter != ids.end()) {
+			const WireSize id = iter->second;
+			return InternedName(name, committed[static_cast<size_t>(id)] ? StringHeader::Reference : StringHeader::Definition, id);
+		}
+		if (ids.size() >= maxStrings) {
+			return InternedName(name);
+		}
+		const WireSize id = ids.size();
+		names.push_back(&ids.emplace(name, id).first->first);
+		committed.push_back(false);
+		return InternedName(name, StringHeader::Definition, id);
+	}
+
+	/// Let messages built after this reference the names defined by a message, call after it is queued
+	/// Messages are sent in queue order, so the definition reaches the receiver before any reference
+	void commit(const std::vector<WireSize> & definitions) {
+		if (definitions.empty()) {
+			return;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		for (WireSize id : definitions) {
+			if (id < committed.size()) {
+				committed[static_cast<size_t>(id)] = true;
+			}
+		}
+	}
+
+	/// Get the name with @id
+	/// @return - false if there is no such id
+	bool getName(WireSize id, std::string & name) const {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (id >= names.size()) {
+			return false;
+		}
+		name = *names[static_cast<size_t>(id)];
+		return true;
+	}
+
+	/// Forget all names, call when connecting to a new server
+	void clear() {
+		std::lock_guard<std::mutex> lock(mutex);
+		ids.clear();
+		names.clear();
+		committed.clear();
+	}
+
+	/// Get the number of names with ids
+	size_t getCount() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return ids.size();
+	}
+
+	static const size_t DEFAULT_MAX_STRINGS = 1 << 20;
+
+private:
+	mutable std::mutex mutex; ///< Protects all members below
+	std::unordered_map<std::string, WireSize> ids; ///< Id of each name
+	std::vector<const std::string *> names; ///< Keys of @ids by id
+	std::vector<char> committed; ///< Set for ids defined by a queued message
+	size_t maxStrings; ///< Max size of @ids
+};
+
+/// Receiving side of the session string table, resolves ids to strings shared by all messages using them
+/// Messages must be parsed in the order they were sent (VRayMessage::fromZmqMessage parses the header
+/// right away, so calling it on the receiving thread is enough). Not thread safe
+/// Ids may be defined out of order and more than once, messages built on different threads are queued in any order
+class SessionStringTable {
+public:
+	/// @maxStrings - ids of this value or more are rejected, must not be less than the one of the encoder
+	explicit SessionStringTable(size_t maxStrings = SessionStringEncoder::DEFAULT_MAX_STRINGS)
+	    : maxStrings(maxStrings)
+	{}
+
+	/// Read a name written by SessionStringEncoder or as a plain string
+	/// @plain - set to the name if it was sent as a plain string
+	/// @interned - set to the name if it was sent interned, else reset
+	/// @return - false if the data is malformed or references an unknown id
+	bool read(DeserializerStream & stream, std::string & plain, std::shared_ptr<const std::string> & interned) {
+		interned.reset();
+		StringHeader kind = StringHeader::Plain;
+		WireSize id = 0;
+		if (!readStringHeader(stream, kind, id)) {
+			return false;
+		}
+		if (kind == StringHeader::Plain) {
+			return readChars(stream, id, plain);
+		}
+		if (kind == StringHeader::Reference) {
+			// the encoder references only names defined by messages queued earlier, a miss means messages were lost
+			if (id >= strings.size() || !strings[static_cast<size_t>(id)]) {
+				return false;
+			}
+			interned = strings[static_cast<size_t>(id)];
+			return true;
+		}
+
+		WireSize size = 0;
+		if (id >= maxStrings || !readStringHeader(stream, kind, size) || kind != StringHeader::Plain || !readChars(stream, size, plain)) {
+			return false;
+		}
+		if (id >= strings.size()) {
+			strings.resize(static_cast<size_t>(id) + 1);
+		}
+		std::shared_ptr<const std::string> & slot = strings[static_cast<size_t>(id)];
+		if (!slot) {
+			slot = std::make_shared<const std::string>(std::move(plain));
+		}
+		plain.clear();
+		interned = slot;
+		return true;
+	}
+
+	/// Read a name that must not be interned, for parsing without a table
+	static bool readPlain(DeserializerStream & stream, std::string & plain) {
+		StringHeader kind = StringHeader::Plain;
+		WireSize size = 0;
+		return readStringHeader(stream, kind, size) && kind == StringHeader::Plain && readChars(stream, size, plain);
+	}
+
+	/// Forget all names, call when a new client connects
+	void clear() {
+		strings.clear();
+	}
+
+	/// Get one past the largest defined id
+	size_t getCount() const {
+		return strings.size();
+	}
+
+private:
+	static bool readChars(DeserializerStream & stream, WireSize size, std::string & value) {
+		if (size > stream.getRemaining()) {
+			value.clear();
+			return false;
+		}
+		value.assign(stream.getCurrent(), static_cast<size_t>(size));
+		stream.forward(static_cast<size_t>(size));
+		return true;
+	}
+
+	std::vector<std::shared_ptr<const std::string>> strings; ///< Names by id, null for ids not defined yet
+	size_t maxStrings; ///< Max size of @strings
+};
+
+#endif // _SESSION_STRINGS_HPP_
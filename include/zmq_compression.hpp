@@ -0,0 +1,247 @@
+#ifndef _ZMQ_COMPRESSION_HPP_
+#define _ZMQ_COMPRESSION_HPP_
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#ifdef VRAY_ZMQ_USE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef VRAY_ZMQ_USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "zmq_message.hpp"
+
+/// Codecs for compressed data messages, each value is a bit in the masks exchanged in the handshake
+/// Only the codecs enabled with VRAY_ZMQ_USE_LZ4 / VRAY_ZMQ_USE_ZSTD at build time are available
+enum class CompressionCodec : int {
+	None = 0,
+	LZ4 = 1,
+	Zstd = 2,
+};
+
+/// Header frame of ControlMessage::DATA_COMPRESSED_MSG - a data message with compressed frames
+/// Sent as [control][CompressionHeader][uint64_t raw size of each frame][payload][external frames]
+/// A frame with the same size as its raw size is stored as is, because compressing it did not help enough
+struct CompressionHeader {
+	CompressionCodec codec; ///< Codec of all compressed frames in the message
+	int frameCount; ///< 1 + number of external frames
+};
+
+/// Compression of data messages, used by ZmqClient and by servers talking to it
+class PayloadCompression {
+public:
+	/// Frames smaller than this are always stored
+	static const size_t MIN_FRAME_BYTES = 1024;
+
+	/// Get mask of the codecs compiled in
+	static int supportedCodecs() {
+		int mask = 0;
+#ifdef VRAY_ZMQ_USE_LZ4
+		mask |= static_cast<int>(CompressionCodec::LZ4);
+#endif
+#ifdef VRAY_ZMQ_USE_ZSTD
+		mask |= static_cast<int>(CompressionCodec::Zstd);
+#endif
+		return mask;
+	}
+
+	/// Pick the codec a server should answer with in the handshake
+	/// @offered - mask the client sent, zstd is preferred for its ratio since the links are bandwidth bound
+	/// @return - CompressionCodec::None if no offered codec is available here
+	static CompressionCodec choose(int offered) {
+		const int common = offered & supportedCodecs();
+		if (common & static_cast<int>(CompressionCodec::Zstd)) {
+			return CompressionCodec::Zstd;
+		}
+		if (common & static_cast<int>(CompressionCodec::LZ4)) {
+			return CompressionCodec::LZ4;
+		}
+		return CompressionCodec::None;
+	}
+
+	/// Compress all frames of a message, frames that do not shrink are stored as they are
+	/// @message - replaced with the compressed frames if the function returns true, else not changed
+	/// @header - filled with the header frame to send before the message
+	/// @level - zstd compression level, ignored by LZ4
+	/// @return - false if the codec is not available or no frame got smaller
+	static bool compress(CompressionCodec codec, int level, MessageParts & message, zmq::message_t & header) {
+		if (!(supportedCodecs() & static_cast<int>(codec))) {
+			return false;
+		}
+		const int frameCount = static_cast<int>(message.external.size()) + 1;
+		std::vector<zmq::message_t> frames(frameCount);
+		std::vector<uint64_t> rawSizes(frameCount);
+		bool shrunk = false;
+		for (int c = 0; c < frameCount; ++c) {
+			zmq::message_t & frame = c == 0 ? message.payload : message.external[c - 1];
+			rawSizes[c] = frame.size();
+			// small frames (usually the payload header before external lists) do not gain anything
+			if (frame.size() >= MIN_FRAME_BYTES && compressFrame(codec, level, frame, frames[c])) {
+				shrunk = true;
+			} else {
+				frames[c] = std::move(frame);
+			}
+		}
+		if (!shrunk) {
+			// all frames were moved, put them back
+			message.payload = std::move(frames[0]);
+			for (int c = 1; c < frameCount; ++c) {
+				message.external[c - 1] = std::move(frames[c]);
+			}
+			return false;
+		}
+
+		CompressionHeader info = {codec, frameCount};
+		header.rebuild(sizeof(info) + frameCount * sizeof(uint64_t));
+		memcpy(header.data(), &info, sizeof(info));
+		memcpy(static_cast<char *>(header.data()) + sizeof(info), rawSizes.data(), frameCount * sizeof(uint64_t));
+
+		message.payload = std::move(frames[0]);
+		message.external.clear();
+		for (int c = 1; c < frameCount; ++c) {
+			message.external.push_back(std::move(frames[c]));
+		}
+		return true;
+	}
+
+	/// Restore a message compressed with compress
+	/// @header - the header frame
+	/// @message - the compressed frames, replaced with the original frames on success
+	/// @return - false if the message is malformed or the codec is not available
+	static bool decompress(const zmq::message_t & header, MessageParts & message) {
+		CompressionHeader info;
+		if (header.size() < sizeof(info)) {
+			return false;
+		}
+		memcpy(&info, header.data(), sizeof(info));
+		if (info.frameCount != static_cast<int>(message.external.size()) + 1
+			|| header.size() != sizeof(info) + info.frameCount * sizeof(uint64_t)) {
+			return false;
+		}
+
+		std::vector<zmq::message_t> frames(info.frameCount);
+		const char * rawSizes = static_cast<const char *>(header.data()) + sizeof(info);
+		for (int c = 0; c < info.frameCount; ++c) {
+			uint64_t rawSize = 0;
+			memcpy(&rawSize, rawSizes + c * sizeof(rawSize), sizeof(rawSize));
+			zmq::message_t & frame = c == 0 ? message.payload : message.external[c - 1];
+			if (frame.size() == rawSize) {
+				frames[c] = std::move(frame);
+			} else if (rawSize > std::numeric_limits<size_t>::max() || !decompressFrame(info.codec, frame, static_cast<size_t>(rawSize), frames[c])) {
+				return false;
+			}
+		}
+
+		message.payload = std::move(frames[0]);
+		message.external.clear();
+		for (int c = 1; c < info.frameCount; ++c) {
+			message.external.push_back(std::move(frames[c]));
+		}
+		return true;
+	}
+
+private:
+	/// Compress one frame in @out, with a single allocation and no copy of the result
+	/// @return - false if the codec failed or the result is not at least 1/16 smaller than @frame
+	static bool compressFrame(CompressionCodec codec, int level, const zmq::message_t & frame, zmq::message_t & out) {
+		const char * data = static_cast<const char *>(frame.data());
+		const size_t size = frame.size();
+		size_t bound = 0;
+		switch (codec) {
+#ifdef VRAY_ZMQ_USE_LZ4
+		case CompressionCodec::LZ4:
+			bound = size && size <= LZ4_MAX_INPUT_SIZE ? LZ4_compressBound(static_cast<int>(size)) : 0;
+			break;
+#endif
+#ifdef VRAY_ZMQ_USE_ZSTD
+		case CompressionCodec::Zstd:
+			bound = size ? ZSTD_compressBound(size) : 0;
+			break;
+#endif
+		default:
+			break;
+		}
+		char * buffer = bound ? static_cast<char *>(malloc(bound)) : nullptr;
+		if (!buffer) {
+			return false;
+		}
+
+		size_t written = 0;
+		switch (codec) {
+#ifdef VRAY_ZMQ_USE_LZ4
+		case CompressionCodec::LZ4: {
+			const int result = LZ4_compress_default(data, buffer, static_cast<int>(size), static_cast<int>(bound));
+			written = result > 0 ? result : 0;
+			break;
+		}
+#endif
+#ifdef VRAY_ZMQ_USE_ZSTD
+		case CompressionCodec::Zstd: {
+			const size_t result = ZSTD_compress(buffer, bound, data, size, level);
+			written = ZSTD_isError(result) ? 0 : result;
+			break;
+		}
+#endif
+		default:
+			(void)data;
+			(void)level;
+			break;
+		}
+		// decompressing costs the receiver time too, so a frame must get noticeably smaller
+		if (!written || written > size - size / 16) {
+			free(buffer);
+			return false;
+		}
+		// the bound is much bigger than the result for compressible data, shrinking keeps the data in place
+		char * shrunk = static_cast<char *>(realloc(buffer, written));
+		buffer = shrunk ? shrunk : buffer;
+		out = zmq::message_t(buffer, written, &PayloadCompression::freeFrame, nullptr);
+		return true;
+	}
+
+	/// zmq free function for frames made by compressFrame
+	static void freeFrame(void * data, void *) {
+		free(data);
+	}
+
+	/// Decompress one frame in @out, which is allocated with @rawSize bytes
+	static bool decompressFrame(CompressionCodec codec, const zmq::message_t & frame, size_t rawSize, zmq::message_t & out) {
+		switch (codec) {
+#ifdef VRAY_ZMQ_USE_LZ4
+		case CompressionCodec::LZ4: {
+			// LZ4 can not expand data more than 255 times, so a bad header can not make us allocate much more
+			if (rawSize > LZ4_MAX_INPUT_SIZE || frame.size() > LZ4_MAX_INPUT_SIZE || rawSize > frame.size() * 255 + 16) {
+				return false;
+			}
+			out.rebuild(rawSize);
+			const int result = LZ4_decompress_safe(static_cast<const char *>(frame.data()), static_cast<char *>(out.data()),
+			                                       static_cast<int>(frame.size()), static_cast<int>(rawSize));
+			return result >= 0 && static_cast<size_t>(result) == rawSize;
+		}
+#endif
+#ifdef VRAY_ZMQ_USE_ZSTD
+		case CompressionCodec::Zstd: {
+			if (ZSTD_getFrameContentSize(frame.data(), frame.size()) != rawSize) {
+				return false;
+			}
+			out.rebuild(rawSize);
+			const size_t result = ZSTD_decompress(out.data(), rawSize, frame.data(), frame.size());
+			return !ZSTD_isError(result) && result == rawSize;
+		}
+#endif
+		default:
+			(void)frame;
+			(void)rawSize;
+			(void)out;
+			return false;
+		}
+	}
+};
+
+#endif // _ZMQ_COMPRESSION_HPP_
@@ -1,7 +1,11 @@
 #ifndef _DESERIALIZER_HPP_
 #define _DESERIALIZER_HPP_
 
+#include <cstdint>
+#include <limits>
+#include <algorithm>
 #include "base_types.h"
+#include "zmq_serializer.hpp"
 
 class DeserializerStream {
 public:
@@ -11,8 +15,47 @@ public:
 	    : first(data)
 	    , current(data)
 	    , last(data + size)
+	    , nextExternal(0)
+	    , wireFormat(WireFormat::V1)
 	{}
 
+	/// Enable view mode - POD lists and images will refer to the stream data instead of copying it
+	/// @owner - keeps the stream data and all external buffers alive
+	void setOwner(std::shared_ptr<const void> owner) {
+		this->owner = std::move(owner);
+	}
+
+	/// Get the owner of the data if in view mode, else nullptr
+	const std::shared_ptr<const void> & getOwner() const {
+		return owner;
+	}
+
+	/// Add a buffer that is referenced by ListStorage::External or Encoded, buffers are consumed in the order added
+	void addExternal(const char * data, size_t size) {
+		external.push_back(std::make_pair(data, size));
+	}
+
+	/// Get the next external buffer
+	/// @return - false if all external buffers are consumed
+	bool readExternal(const char *& data, size_t & size) {
+		if (nextExternal >= external.size()) {
+			return false;
+		}
+		data = external[nextExternal].first;
+		size = external[nextExternal].second;
+		++nextExternal;
+		return true;
+	}
+
+	/// Set the format of the values read after this call
+	void setWireFormat(WireFormat format) {
+		wireFormat = format;
+	}
+
+	WireFormat getWireFormat() const {
+		return wireFormat;
+	}
+
 	bool hasMore() const {
 		return current < last;
 	}
@@ -29,7 +72,7 @@ public:
 		return last - current;
 	}
 
-	bool read(char * where, int size) {
+	bool read(char * where, size_t size) {
 		if (!forward(size)) {
 			return false;
 		}
@@ -42,11 +85,10 @@ public:
 	}
 
 	bool forward(size_t size) {
-		const char * newPtr = current + size;
-		if (newPtr > last || newPtr < first) {
+		if (size > getRemaining()) {
 			return false;
 		}
-		current = newPtr;
+		current += size;
 		return true;
 	}
 
@@ -54,6 +96,11 @@ private:
 	const char *first;
 	const char *current;
 	const char *last;
+
+	std::vector<std::pair<const char *, size_t>> external; ///< Buffers for lists stored as ListStorage::External or Encoded
+	size_t nextExternal; ///< Index of the next unread buffer in @external
+	std::shared_ptr<const void> owner; ///< Set in view mode, keeps all data alive
+	WireFormat wireFormat; ///< Format of the read values
 };
 
 
@@ -64,12 +111,155 @@ DeserializerStream & operator>>(DeserializerStream & stream, T & value) {
 }
 
 
+/// Read unsigned LEB128 written by writeVarint
+/// @return - false if the data ends before the last byte or the value does not fit in 64 bits
+inline bool readVarint(DeserializerStream & stream, uint64_t & value) {
+	value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		uint8_t byte = 0;
+		if (!stream.read(reinterpret_cast<char *>(&byte), 1)) {
+			return false;
+		}
+		value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+inline DeserializerStream & operator>>(DeserializerStream & stream, WireSize & value) {
+	if (stream.getWireFormat() == WireFormat::V2) {
+		if (!readVarint(stream, value)) {
+			assert(!"Malformed varint");
+		}
+	} else {
+		int size = 0;
+		stream.read(reinterpret_cast<char *>(&size), sizeof(size));
+		if (size < 0) {
+			assert(!"Negative WireFormat::V1 length");
+			size = 0;
+		}
+		value = static_cast<WireSize>(size);
+	}
+	return stream;
+}
+
+inline DeserializerStream & operator>>(DeserializerStream & stream, int & value) {
+	if (stream.getWireFormat() == WireFormat::V2) {
+		uint64_t zigzag = 0;
+		if (!readVarint(stream, zigzag) || zigzag > 0xffffffffu) {
+			assert(!"Malformed varint");
+		}
+		const uint32_t bits = static_cast<uint32_t>(zigzag);
+		value = static_cast<int>((bits >> 1) ^ (0u - (bits & 1)));
+	} else {
+		stream.read(reinterpret_cast<char *>(&value), sizeof(value));
+	}
+	return stream;
+}
+
+inline DeserializerStream & operator>>(DeserializerStream & stream, VRayBaseTypes::ValueType & type) {
+	if (stream.getWireFormat() == WireFormat::V2) {
+		uint8_t tag = 0;
+		stream.read(reinterpret_cast<char *>(&tag), 1);
+		type = static_cast<VRayBaseTypes::ValueType>(tag);
+	} else {
+		stream.read(reinterpret_cast<char *>(&type), sizeof(type));
+	}
+	return stream;
+}
+
+/// Read an int sized enum written by writeEnum
+template <typename E>
+inline DeserializerStream & readEnum(DeserializerStream & stream, E & value) {
+	static_assert(sizeof(E) == sizeof(int), "Only int sized enums are written as ints");
+	if (stream.getWireFormat() == WireFormat::V2) {
+		int bits = 0;
+		stream >> bits;
+		value = static_cast<E>(bits);
+	} else {
+		stream.read(reinterpret_cast<char *>(&value), sizeof(value));
+	}
+	return stream;
+}
+
+inline DeserializerStream & operator>>(DeserializerStream & stream, VRayBaseTypes::RenderChannelType & type) {
+	return readEnum(stream, type);
+}
+
+inline DeserializerStream & operator>>(DeserializerStream & stream, VRayBaseTypes::AttrImage::ImageType & type) {
+	return readEnum(stream, type);
+}
+
+inline DeserializerStream & operator>>(DeserializerStream & stream, VRayBaseTypes::ImageSourceType & type) {
+	return readEnum(stream, type);
+}
+
+inline DeserializerStream & operator>>(DeserializerStream & stream, VRayBaseTypes::AttrSimpleType<int> & value) {
+	return stream >> value.value;
+}
+
+inline DeserializerStream & operator>>(DeserializerStream & stream, VRayBaseTypes::AttrSimpleType<bool> & value) {
+	return stream >> value.value;
+}
+
+/// Read the header of a string written by writeStringHeader
+/// @return - false if the data is malformed
+inline bool readStringHeader(DeserializerStream & stream, StringHeader & kind, WireSize & value) {
+	if (stream.getWireFormat() == WireFormat::V2) {
+		if (!readVarint(stream, value)) {
+			return false;
+		}
+		kind = !(value & 1) ? StringHeader::Plain : (value & 2) ? StringHeader::Definition : StringHeader::Reference;
+		value >>= kind == StringHeader::Plain ? 1 : 2;
+		return true;
+	}
+	uint32_t header = 0;
+	if (!stream.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+		return false;
+	}
+	kind = !(header & INTERNED_STRING_BIT) ? StringHeader::Plain : (header & INTERNED_DEFINE_BIT) ? StringHeader::Definition : StringHeader::Reference;
+	value = kind == StringHeader::Plain ? header : header & INTERNED_ID_MASK;
+	return true;
+}
+
+/// Read the storage and count of a POD list written by writeListHeader
+inline void readListHeader(DeserializerStream & stream, ListStorage & storage, WireSize & count) {
+	storage = ListStorage::Inline;
+	if (stream.getWireFormat() == WireFormat::V2) {
+		stream >> storage;
+	}
+	stream >> count;
+}
+
+/// Read the byte size of an image written by writeImageSize
+inline void readImageSize(DeserializerStream & stream, WireSize & size) {
+	if (stream.getWireFormat() == WireFormat::V2) {
+		stream >> size;
+	} else {
+		uint64_t bytes = 0;
+		stream.read(reinterpret_cast<char *>(&bytes), sizeof(bytes));
+		size = bytes;
+	}
+}
+
 inline DeserializerStream & operator>>(DeserializerStream & stream, std::string & value) {
-	int size = 0;
-	stream >> size;
+	StringHeader kind = StringHeader::Plain;
+	WireSize size = 0;
+	if (!readStringHeader(stream, kind, size) || kind != StringHeader::Plain) {
+		assert(!"Malformed string or interned name without SessionStringTable");
+		value.clear();
+		return stream;
+	}
+	if (size > stream.getRemaining()) {
+		assert(!"String data is past the end of the message");
+		value.clear();
+		return stream;
+	}
 
-	value.assign(stream.getCurrent(), size);
-	stream.forward(size);
+	value.assign(stream.getCurrent(), static_cast<size_t>(size));
+	stream.forward(static_cast<size_t>(size));
 
 	return stream;
 }
@@ -87,13 +277,50 @@ inline DeserializerStream & operator>> (DeserializerStream & stream, VRayBaseTyp
 
 template <typename Q>
 inline DeserializerStream & operator>>(DeserializerStream & stream, VRayBaseTypes::AttrList<Q> & list) {
-	list.init();
-	int size = 0;
-	stream >> size;
+	ListStorage storage = ListStorage::Inline;
+	WireSize wireSize = 0;
+	readListHeader(stream, storage, wireSize);
+	if (wireSize > std::numeric_limits<size_t>::max() / sizeof(Q)) {
+		assert(!"AttrList size does not fit in memory");
+		return stream;
+	}
+
+	const size_t size = static_cast<size_t>(wireSize);
+	const char * data = stream.getCurrent();
+	size_t bytes = size * sizeof(Q);
+	if (storage == ListStorage::Encoded) {
+		ListEncoding encoding = ListEncoding::None;
+		stream >> encoding;
+		list.clear();
+		// every encoding takes at least a byte per item, so a bad count can not make us allocate much
+		if (!stream.readExternal(data, bytes) || bytes < size) {
+			assert(!"Missing or wrong size external buffer for encoded AttrList");
+			return stream;
+		}
+		list.getData()->resize(size);
+		if (size && !GeometryCodec::decode(encoding, data, bytes, size, list.getData()->data())) {
+			assert(!"Malformed encoded AttrList");
+			list.init();
+		}
+		return stream;
+	} else if (storage == ListStorage::External) {
+		if (!stream.readExternal(data, bytes) || bytes != size * sizeof(Q)) {
+			assert(!"Missing or wrong size external buffer for AttrList");
+			return stream;
+		}
+	} else if (!stream.forward(bytes)) {
+		assert(!"AttrList data is past the end of the message");
+		return stream;
+	}
 
-	list.getData()->resize(size);
-	memcpy(list.getData()->data(), stream.getCurrent(), size * sizeof(Q));
-	stream.forward(size * sizeof(Q));
+	// views need aligned data, unaligned inline lists are still copied
+	if (stream.getOwner() && reinterpret_cast<uintptr_t>(data) % alignof(Q) == 0) {
+		list = VRayBaseTypes::AttrList<Q>::view(std::shared_ptr<const Q>(stream.getOwner(), reinterpret_cast<const Q *>(data)), size);
+	} else {
+		list.clear();
+		list.getData()->resize(size);
+		memcpy(list.getData()->data(), data, bytes);
+	}
 
 	return stream;
 }
@@ -101,14 +328,16 @@ inline DeserializerStream & operator>>(DeserializerStream & stream, VRayBaseType
 
 template <typename T>
 inline void readListNonPOD(DeserializerStream & stream, VRayBaseTypes::AttrList<T> & list) {
-	list.init();
-	int size = 0;
+	list.clear();
+	WireSize size = 0;
 	stream >> size;
-	list.getData()->reserve(size);
-	for (int c = 0; c < size; ++c) {
-		T item;
-		stream >> item;
-		list.append(std::move(item));
+	// each item takes at least a byte, do not trust the size for the reserve
+	auto & items = *list.getData();
+	items.reserve(static_cast<size_t>(std::min<WireSize>(size, stream.getRemaining())));
+	for (WireSize c = 0; c < size && stream.hasMore(); ++c) {
+		// read in place, items are not copied or moved
+		items.emplace_back();
+		stream >> items.back();
 	}
 }
 
@@ -132,11 +361,14 @@ inline DeserializerStream & operator>>(DeserializerStream & stream, VRayBaseType
 	map.data.clear();
 	int size = 0;
 	stream >> size;
+	if (size > 0) {
+		map.data.reserve(std::min<size_t>(size, stream.getRemaining()));
+	}
 	for (int c = 0; c < size; ++c) {
 		std::string key;
 		VRayBaseTypes::AttrMapChannels::AttrMapChannel channel;
 		stream >> key >> channel.vertices >> channel.faces >> channel.name;
-		map.data.emplace(key, channel);
+		map.data.emplace(std::move(key), std::move(channel));
 	}
 	return stream;
 }
@@ -148,23 +380,35 @@ inline DeserializerStream & operator>>(DeserializerStream & stream, VRayBaseType
 
 
 inline DeserializerStream & operator>>(DeserializerStream & stream, VRayBaseTypes::AttrInstancer & inst) {
-	int size = 0;
+	WireSize size = 0;
 	stream >> inst.frameNumber >> size;
-	inst.data.init();
-	inst.data.getData()->reserve(size);
-	for (int c = 0; c < size; ++c) {
-		VRayBaseTypes::AttrInstancer::Item item;
-		stream >> item;
-		inst.data.append(item);
+	inst.data.clear();
+	auto & items = *inst.data.getData();
+	items.reserve(static_cast<size_t>(std::min<WireSize>(size, stream.getRemaining())));
+	for (WireSize c = 0; c < size && stream.hasMore(); ++c) {
+		items.emplace_back();
+		stream >> items.back();
 	}
 	return stream;
 }
 
 
 inline DeserializerStream & operator>>(DeserializerStream & stream, VRayBaseTypes::AttrImage & image) {
-	stream >> image.imageType >> image.size >> image.width >> image.height >> image.x >> image.y;
-	image.set(stream.getCurrent(), image.size);
-	stream.forward(image.size);
+	WireSize size = 0;
+	stream >> image.imageType;
+	readImageSize(stream, size);
+	stream >> image.width >> image.height >> image.x >> image.y;
+	const char * data = stream.getCurrent();
+	image.size = static_cast<size_t>(size);
+	if (size > stream.getRemaining() || !stream.forward(image.size)) {
+		assert(!"AttrImage data is past the end of the message");
+		return stream;
+	}
+	if (stream.getOwner()) {
+		image.setView(std::shared_ptr<char>(stream.getOwner(), const_cast<char *>(data)), image.size);
+	} else {
+		image.set(data, image.size);
+	}
 	return stream;
 }
 
@@ -182,36 +426,42 @@ inline DeserializerStream & operator>>(DeserializerStream & stream, VRayBaseType
 }
 
 
+/// Reads the value of an AttrValue for each stored type, see VRayBaseTypes::AttrTypeTable
+template <typename T>
+struct AttrValueReader {
+	typedef void (*Read)(DeserializerStream & stream, VRayBaseTypes::AttrValue & value);
+
+	static constexpr Read make() {
+		return &read;
+	}
+
+	static void read(DeserializerStream & stream, VRayBaseTypes::AttrValue & value) {
+		stream >> value.as<T>();
+	}
+};
+
+template <>
+struct AttrValueReader<void> {
+	typedef void (*Read)(DeserializerStream & stream, VRayBaseTypes::AttrValue & value);
+
+	static constexpr Read make() {
+		return &read;
+	}
+
+	static void read(DeserializerStream &, VRayBaseTypes::AttrValue &) {
+		assert(!"Missing DeserializerStream::operator>> for some ValueType");
+	}
+};
+
 inline DeserializerStream & operator>>(DeserializerStream & stream, VRayBaseTypes::AttrValue & value) {
-	stream >> value.type;
-	value.defaultInitData();
 	using namespace VRayBaseTypes;
-	switch (value.type) {
-	case ValueTypeInt: stream >> value.as<AttrSimpleType<int>>(); break;
-	case ValueTypeFloat: stream >> value.as<AttrSimpleType<float>>(); break;
-	case ValueTypeString: stream >> value.as<AttrSimpleType<std::string>>(); break;
-	case ValueTypeColor: stream >> value.as<AttrColor>(); break;
-	case ValueTypeAColor: stream >> value.as<AttrAColor>(); break;
-	case ValueTypeVector: stream >> value.as<AttrVector>(); break;
-	case ValueTypeVector2: stream >> value.as<AttrVector2>(); break;
-	case ValueTypeMatrix: stream >> value.as<AttrMatrix>(); break;
-	case ValueTypeTransform: stream >> value.as<AttrTransform>(); break;
-	case ValueTypePlugin: stream >> value.as<AttrPlugin>(); break;
-	case ValueTypeImageSet: stream >> value.as<AttrImageSet>(); break;
-	case ValueTypeListInt: stream >> value.as<AttrListInt>(); break;
-	case ValueTypeListFloat: stream >> value.as<AttrListFloat>(); break;
-	case ValueTypeListColor: stream >> value.as<AttrListColor>(); break;
-	case ValueTypeListVector: stream >> value.as<AttrListVector>(); break;
-	case ValueTypeListVector2: stream >> value.as<AttrListVector2>(); break;
-	case ValueTypeListMatrix: stream >> value.as<AttrListMatrix>(); break;
-	case ValueTypeListTransform: stream >> value.as<AttrListTransform>(); break;
-	case ValueTypeListString: stream >> value.as<AttrListString>(); break;
-	case ValueTypeListPlugin: stream >> value.as<AttrListPlugin>(); break;
-	case ValueTypeListValue: stream >> value.as<AttrListValue>(); break;
-	case ValueTypeInstancer: stream >> value.as<AttrInstancer>(); break;
-	case ValueTypeMapChannels: stream >> value.as<AttrMapChannels>(); break;
-	default: assert(!"Missing DeserializerStream::operator>> for some ValueType"); break;
-	}
+	// free the old value first, types stored out of line would leak otherwise
+	ValueType type = ValueTypeUnknown;
+	stream >> type;
+	value.destroyData();
+	value.type = type;
+	value.defaultInitData();
+	AttrTypeTable<AttrValueReader>::get(value.type)(stream, value);
 	return stream;
 }
 
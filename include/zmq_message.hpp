@@ -5,6 +5,137 @@
 #include "base_types.h"
 #include "zmq_serializer.hpp"
 #include "zmq_deserializer.hpp"
+#include "session_strings.hpp"
+#include "payload_pool.hpp"
+
+#include <vector>
+#include <algorithm>
+
+/// Set in the first byte of a payload (its VRayMessage::Type) if the rest is in WireFormat::V2
+static const uint8_t TYPE_WIRE_FORMAT_V2 = 0x80;
+
+/// Serialized VRayMessage ready to be sent as multipart message
+/// The payload is sent first, followed by the external frames that it references (large list data)
+struct MessageParts {
+	MessageParts()
+	    : pooled(nullptr)
+	{}
+
+	explicit MessageParts(zmq::message_t && payload)
+	    : payload(std::move(payload))
+	    , pooled(nullptr)
+	{}
+
+	/// Make a payload of @size bytes over the data of @block, the block is returned to PayloadPool with the parts
+	MessageParts(PayloadBlock * block, size_t size)
+	    : payload(block->data(), size, nullptr, nullptr)
+	    , pooled(block)
+	{}
+
+	MessageParts(MessageParts && other)
+	    : payload(std::move(other.payload))
+	    , external(std::move(other.external))
+	    , definitions(std::move(other.definitions))
+	    , pooled(other.pooled)
+	{
+		other.pooled = nullptr;
+	}
+
+	MessageParts & operator=(MessageParts && other) {
+		payload = std::move(other.payload);
+		external = std::move(other.external);
+		definitions = std::move(other.definitions);
+		if (pooled) {
+			PayloadPool::release(pooled);
+		}
+		pooled = other.pooled;
+		other.pooled = nullptr;
+		return *this;
+	}
+
+	~MessageParts() {
+		if (pooled) {
+			// the payload is a zmq constant message over the block, closing it does not touch the data
+			PayloadPool::release(pooled);
+		}
+	}
+
+	/// Take the payload of a message without external frames, so code that keeps the result of the msg* methods
+	/// in a zmq::message_t still works. Messages made with the default MessageFormat never have external frames
+	operator zmq::message_t() && {
+		assert(external.empty() && "Converting MessageParts with external frames to a single frame");
+		ownPayload();
+		return std::move(payload);
+	}
+
+	/// Make a pooled payload a frame that owns its block, zmq returns it to PayloadPool when done with the frame
+	/// Needed before the payload is moved out or sent by zmq, copying it into a batch does not need it
+	/// Costs the one allocation of zmq's reference counted frames
+	void ownPayload() {
+		if (!pooled) {
+			return;
+		}
+		assert(payload.data() == pooled->data() && "Pooled payload was replaced");
+		zmq::message_t owned(payload.data(), payload.size(), &PayloadPool::releaseFrame, pooled);
+		pooled = nullptr;
+		payload.move(&owned);
+	}
+
+	/// Get the total number of bytes in all frames
+	size_t size() const {
+		size_t total = payload.size();
+		for (const auto & frame : external) {
+			total += frame.size();
+		}
+		return total;
+	}
+
+	zmq::message_t payload; ///< The serialized message
+	std::vector<zmq::message_t> external; ///< Frames referenced by ListStorage::External and Encoded lists, in order
+	std::vector<WireSize> definitions; ///< Ids of the interned names defined in the payload, see SessionStringEncoder::commit
+
+private:
+	MessageParts(const MessageParts &) = delete;
+	MessageParts & operator=(const MessageParts &) = delete;
+
+	PayloadBlock * pooled; ///< Block the payload points into if made with MessageFormat::pooledPayload, see ownPayload
+};
+
+/// Options of the VRayMessage::msg* methods, the default makes the same messages as protocol 1013
+struct MessageFormat {
+	MessageFormat()
+	    : wireFormat(WireFormat::V1)
+	    , referenceLists(false)
+	    , listPatches(false)
+	    , compressed(false)
+	    , pooledPayload(false)
+	{}
+
+	/// Layout of the message, only receivers that know it may get V2 messages, see ZmqClient::getMessageFormat
+	WireFormat wireFormat;
+	/// Send POD lists of at least EXTERNAL_LIST_MIN_BYTES as external frames referencing the list data instead
+	/// of copying it. The list (and any AttrList sharing its data) must not be changed until the message is sent
+	/// Used only for WireFormat::V2 messages, V1 lists are always copied
+	bool referenceLists;
+	/// The receiver applies PluginAction::Patch messages, ListDeltaEncoder sends full updates without it
+	bool listPatches;
+	/// The message may be compressed before it is sent, float lists are encoded with ListEncoding::BytePlanes
+	/// only then, it makes them smaller only for the compressor
+	bool compressed;
+	/// Make payloads in PayloadPool blocks, so making and sending a message in steady state does not allocate
+	/// The MessageParts must be sent by ZmqClient or given to MessageParts::ownPayload before any other use
+	/// of the payload frame, see ZmqClient::getMessageFormat
+	bool pooledPayload;
+	/// Names of plugin messages are sent as ids of this table if set, only receivers parsing with a
+	/// SessionStringTable may get such messages, see ZmqClient::setStringInterning
+	std::shared_ptr<SessionStringEncoder> strings;
+};
+
+/// Range of changed items in a PluginAction::Patch message
+struct ListRange {
+	WireSize offset; ///< Index of the first changed item
+	WireSize count; ///< Number of changed items
+};
 
 
 class VRayMessage {
@@ -22,7 +153,8 @@ public:
 		Create,
 		Remove,
 		Update,
-		Replace
+		Replace,
+		Patch, ///< Change some items of a list property, see msgPluginPatchProperty
 	};
 
 	enum class RendererAction : char {
@@ -86,6 +218,13 @@ public:
 		ProgressMessage,
 	};
 
+	/// Flags for fromZmqMessage
+	enum ParseFlags {
+		ParseDefault  = 0,
+		ParseViewData = 1 << 0, ///< POD lists and images refer to the received frames instead of copying them
+		ParseLazyValue = 1 << 1, ///< Only the header is parsed, the value is decoded on first access
+	};
+
 	VRayMessage()
 	    : type(Type::None)
 	    , rendererAction(RendererAction::None)
@@ -94,6 +233,10 @@ public:
 	    , rendererState(RendererState::None)
 	    , valueSetter(ValueSetter::None)
 	    , pluginAction(PluginAction::None)
+	    , patchCount(0)
+	    , valueOffset(0)
+	    , valuePending(false)
+	    , payloadFormat(WireFormat::V1)
 	{}
 
 	VRayMessage(VRayMessage && other)
@@ -108,16 +251,26 @@ public:
 	    , pluginName(std::move(other.pluginName))
 	    , pluginType(std::move(other.pluginType))
 	    , pluginProperty(std::move(other.pluginProperty))
+	    , internedName(std::move(other.internedName))
+	    , internedType(std::move(other.internedType))
+	    , internedProperty(std::move(other.internedProperty))
 	    , logLevel(other.logLevel)
 	    , rendererWidth(other.rendererWidth)
 	    , rendererHeight(other.rendererHeight)
 	    , value(std::move(other.value))
+	    , patchCount(other.patchCount)
+	    , patchRanges(std::move(other.patchRanges))
+	    , external(std::move(other.external))
+	    , shared(std::move(other.shared))
+	    , valueOffset(other.valueOffset)
+	    , valuePending(other.valuePending)
+	    , payloadFormat(other.payloadFormat)
 	{
 		this->message.move(&other.message);
 	}
 
 	/// Create message from data, usually to be sent
-	explicit VRayMessage(const char * data, int size)
+	explicit VRayMessage(const char * data, size_t size)
 	    : message(data, size)
 	    , rendererAction(RendererAction::None)
 	    , rendererType(RendererType::None)
@@ -125,26 +278,49 @@ public:
 	    , rendererState(RendererState::None)
 	    , valueSetter(ValueSetter::None)
 	    , pluginAction(PluginAction::None)
+	    , patchCount(0)
+	    , valueOffset(0)
+	    , valuePending(false)
+	    , payloadFormat(WireFormat::V1)
 	{}
 
 	/// Create VRayMessage from zmq::message_t parsing the data
-	static VRayMessage fromZmqMessage(zmq::message_t & message) {
+	/// @flags - combination of ParseFlags
+	/// @strings - table of the session if the sender interns names, see MessageFormat::strings
+	static VRayMessage fromZmqMessage(zmq::message_t & message, int flags = ParseDefault, SessionStringTable * strings = nullptr) {
+		MessageParts parts(std::move(message));
+		return fromZmqMessage(parts, flags, strings);
+	}
+
+	/// Create VRayMessage from received multipart message, parsing the data
+	/// @flags - combination of ParseFlags, with ParseViewData the frames are kept alive
+	///          as long as any value referring to them, with ParseLazyValue the value is decoded
+	///          by the first getValue/getAttrValue call, which may happen on any (single) thread
+	/// @strings - table of the session if the sender interns names, messages must be parsed in the order received
+	static VRayMessage fromZmqMessage(MessageParts & parts, int flags = ParseDefault, SessionStringTable * strings = nullptr) {
 		VRayMessage msg;
-		msg.message.move(&message);
-		msg.parse();
+		if (flags & ParseViewData) {
+			msg.shared = std::make_shared<MessageParts>(std::move(parts));
+		} else {
+			parts.ownPayload();
+			msg.message.move(&parts.payload);
+			msg.external = std::move(parts.external);
+		}
+		msg.parse(flags, strings);
 		return msg;
 	}
 
-	static zmq::message_t fromData(const char * data, int size) {
+	static zmq::message_t fromData(const char * data, size_t size) {
 		return zmq::message_t(data, size);
 	}
 
 	zmq::message_t & getInternalMessage() {
-		return this->message;
+		return shared ? shared->payload : this->message;
 	}
 
 	const std::string getPluginNew() const {
 		if (pluginAction == PluginAction::Replace && type == Type::ChangePlugin) {
+			decodeValue();
 			return value.as<VRayBaseTypes::AttrSimpleType<std::string>>();
 		} else {
 			assert((pluginAction == PluginAction::Replace && type == Type::ChangePlugin) && "Getting plugin new");
@@ -154,17 +330,17 @@ public:
 
 	/// Get plugin property
 	const std::string & getProperty() const {
-		return pluginProperty;
+		return internedProperty ? *internedProperty : pluginProperty;
 	}
 
 	/// Get the plugin instance id
 	const std::string & getPlugin() const {
-		return pluginName;
+		return internedName ? *internedName : pluginName;
 	}
 
 	/// Get the plugin type name
 	const std::string & getPluginType() const {
-		return pluginType;
+		return internedType ? *internedType : pluginType;
 	}
 
 	/// Get the message type
@@ -216,164 +392,503 @@ public:
 	/// If message is update plugin param, get pointer to the internal param value
 	template <typename T>
 	const T * getValue() const {
+		decodeValue();
 		return value.asPtr<T>();
 	}
 
 	/// If message is update plugin param get the attr value object that stores the param value
 	const VRayBaseTypes::AttrValue & getAttrValue() const {
+		decodeValue();
 		return value;
 	}
 
+	/// Move the param value out of the message, which is left with ValueTypeUnknown
+	/// Use instead of copying getAttrValue when keeping the value, big lists and strings are not copied
+	VRayBaseTypes::AttrValue takeAttrValue() {
+		decodeValue();
+		return std::move(value);
+	}
+
+	/// If message is a list patch, get the size of the whole list after the patch
+	size_t getPatchCount() const {
+		return patchCount;
+	}
+
+	/// If message is a list patch, get the changed ranges, their items are the value of the message in order
+	const std::vector<ListRange> & getPatchRanges() const {
+		return patchRanges;
+	}
+
+	/// If message is a list patch, apply it on the previous version of the list
+	/// @list - the list as it was before the patch, resized to getPatchCount() and updated with the changed items
+	/// @return - false if the message is not a patch for this list type or its ranges do not match its items
+	template <typename T>
+	bool applyPatch(VRayBaseTypes::AttrList<T> & list) const {
+		if (pluginAction != PluginAction::Patch || getValueType() != VRayBaseTypes::AttrList<T>().getType()) {
+			return false;
+		}
+		const VRayBaseTypes::AttrList<T> & items = *getValue<VRayBaseTypes::AttrList<T>>();
+		WireSize end = 0, total = 0;
+		for (const auto & range : patchRanges) {
+			if (range.offset < end || range.count > patchCount || range.offset > patchCount - range.count) {
+				return false;
+			}
+			end = range.offset + range.count;
+			total += range.count;
+		}
+		if (total != items.getCount()) {
+			return false;
+		}
+
+		list.resize(patchCount);
+		if (!total) {
+			return true;
+		}
+		T * target = *list;
+		const T * source = items.getItems();
+		for (const auto & range : patchRanges) {
+			memcpy(target + range.offset, source, static_cast<size_t>(range.count) * sizeof(T));
+			source += range.count;
+		}
+		return true;
+	}
+
 	/// If message is update plugin param, get the value type
+	/// Does not decode a lazy value, so it is cheap to check before getValue
 	VRayBaseTypes::ValueType getValueType() const {
+		if (valuePending) {
+			VRayBaseTypes::ValueType type = VRayBaseTypes::ValueTypeUnknown;
+			DeserializerStream stream = valueStream();
+			stream >> type;
+			return type;
+		}
 		return value.type;
 	}
 
+	/// Get plugin and property of a serialized plugin property update without parsing the message
+	/// @payload - payload made by msgPluginSetProperty and similar
+	/// @strings - the encoder the message was made with, if it has interned names
+	/// @return - false if @payload is not a PluginAction::Update message
+	static bool peekPluginUpdate(const zmq::message_t & payload, std::string & plugin, std::string & property,
+	                             const SessionStringEncoder * strings = nullptr) {
+		PluginAction action = PluginAction::None;
+		return peekPluginProperty(payload, plugin, property, action, strings) && action == PluginAction::Update;
+	}
+
+	/// Get plugin and property of a serialized plugin property update or patch without parsing the message
+	/// Interned names are resolved, so the result is the same whether the names are interned or not
+	/// @strings - the encoder the message was made with, if it has interned names
+	/// @return - false if @payload is not a PluginAction::Update or PluginAction::Patch message
+	static bool peekPluginProperty(const zmq::message_t & payload, std::string & plugin, std::string & property, PluginAction & action,
+	                               const SessionStringEncoder * strings = nullptr) {
+		DeserializerStream stream(static_cast<const char *>(payload.data()), payload.size());
+		Type type = Type::None;
+		action = PluginAction::None;
+		readType(stream, type);
+		if (type != Type::ChangePlugin || !peekName(stream, strings, plugin)) {
+			return false;
+		}
+		stream >> action;
+		if (action != PluginAction::Update && action != PluginAction::Patch) {
+			return false;
+		}
+		return peekName(stream, strings, property);
+	}
+
+	/// Get the renderer action of a serialized renderer message without parsing the message
+	/// @return - false if @payload is not a Type::ChangeRenderer message
+	static bool peekRendererAction(const zmq::message_t & payload, RendererAction & action) {
+		DeserializerStream stream(static_cast<const char *>(payload.data()), payload.size());
+		Type type = Type::None;
+		readType(stream, type);
+		if (type != Type::ChangeRenderer) {
+			return false;
+		}
+		action = RendererAction::None;
+		stream >> action;
+		return true;
+	}
+
+	/// If message value is an image set, get its source and channels without decoding the images
+	/// @return - false if the value is not an image set
+	bool getImageSetInfo(VRayBaseTypes::ImageSourceType & source, std::vector<VRayBaseTypes::RenderChannelType> & channels) const {
+		using namespace VRayBaseTypes;
+		channels.clear();
+		if (!valuePending) {
+			if (value.type != ValueTypeImageSet) {
+				return false;
+			}
+			const AttrImageSet * set = value.asPtr<AttrImageSet>();
+			source = set->sourceType;
+			for (const auto & img : set->images) {
+				channels.push_back(img.first);
+			}
+			return true;
+		}
+
+		DeserializerStream stream = valueStream();
+		ValueType type = ValueTypeUnknown;
+		int count = 0;
+		stream >> type;
+		if (type != ValueTypeImageSet) {
+			return false;
+		}
+		stream >> source >> count;
+		for (int c = 0; c < count && stream.hasMore(); ++c) {
+			RenderChannelType channel;
+			AttrImage header;
+			WireSize size = 0;
+			// same fields as operator>>(AttrImage), but the pixels are skipped
+			stream >> channel >> header.imageType;
+			readImageSize(stream, size);
+			stream >> header.width >> header.height >> header.x >> header.y;
+			if (size > stream.getRemaining()) {
+				return false;
+			}
+			stream.forward(static_cast<size_t>(size));
+			channels.push_back(channel);
+		}
+		return true;
+	}
+
 	/// Static methods for creating messages
-	///
-	static zmq::message_t msgPluginCreate(const std::string & pluginName, const std::string & pluginType) {
-		SerializerStream strm;
-		strm << VRayMessage::Type::ChangePlugin << pluginName << PluginAction::Create << pluginType;
-		return fromStream(strm);
+	/// @format - how to make the message, the default makes plain messages any server reads
+	static MessageParts msgPluginCreate(const std::string & pluginName, const std::string & pluginType, const MessageFormat & format = MessageFormat()) {
+		const InternedName plugin = internName(format, pluginName), type = internName(format, pluginType);
+		return build(format, [&] (SerializerStream & strm) {
+			strm << VRayMessage::Type::ChangePlugin << plugin << PluginAction::Create << type;
+		});
 	}
 
-	static zmq::message_t msgPluginReplace(const std::string & pluginOld, const std::string & pluginNew) {
+	static MessageParts msgPluginReplace(const std::string & pluginOld, const std::string & pluginNew, const MessageFormat & format = MessageFormat()) {
 		VRayBaseTypes::AttrSimpleType<std::string> valWrapper(pluginNew);
-		SerializerStream strm;
-		strm << VRayMessage::Type::ChangePlugin << pluginOld << PluginAction::Replace << valWrapper.getType() << valWrapper;
-		return fromStream(strm);
+		const InternedName plugin = internName(format, pluginOld);
+		return build(format, [&] (SerializerStream & strm) {
+			strm << VRayMessage::Type::ChangePlugin << plugin << PluginAction::Replace << valWrapper.getType() << valWrapper;
+		});
 	}
 
-	static zmq::message_t msgPluginAction(const std::string & plugin, PluginAction action) {
+	static MessageParts msgPluginAction(const std::string & plugin, PluginAction action, const MessageFormat & format = MessageFormat()) {
 		assert((action == PluginAction::Create || action == PluginAction::Remove) && "Wrong PluginAction");
-		SerializerStream strm;
-		strm << VRayMessage::Type::ChangePlugin << plugin << action;
-		return fromStream(strm);
+		const InternedName name = internName(format, plugin);
+		return build(format, [&] (SerializerStream & strm) {
+			strm << VRayMessage::Type::ChangePlugin << name << action;
+		});
 	}
 
 	/// Creates message to control a plugin property
+	/// @encoding - GeometryEncoding::Mesh packs int, float, vector, vector2 and color lists (also the ones
+	///             in map channels) for vertex, face, normal and UV properties, the receiver decodes them
+	/// @format - with MessageFormat::referenceLists large lists in @value are referenced without copying
+	///           and must not be modified until the message is sent
 	template <typename T>
-	static zmq::message_t msgPluginSetProperty(const std::string & plugin, const std::string & property, const T & value) {
-		using namespace std;
-		SerializerStream strm;
-		strm << VRayMessage::Type::ChangePlugin << plugin << PluginAction::Update << property << ValueSetter::Default << value.getType() << value;
-		return fromStream(strm);
-	}
-
-	static zmq::message_t msgPluginSetProperty(const std::string & plugin, const std::string & property, const VRayBaseTypes::AttrValue & value) {
-		using namespace std;
-		SerializerStream strm;
-		strm << VRayMessage::Type::ChangePlugin << plugin << PluginAction::Update << property << ValueSetter::Default << value;
-		return fromStream(strm);
+	static MessageParts msgPluginSetProperty(const std::string & plugin, const std::string & property, const T & value,
+	                                         GeometryEncoding encoding = GeometryEncoding::None, const MessageFormat & format = MessageFormat()) {
+		const InternedName pluginName = internName(format, plugin), propertyName = internName(format, property);
+		return build(format, [&] (SerializerStream & strm) {
+			strm.setGeometryEncoding(encoding);
+			strm << VRayMessage::Type::ChangePlugin << pluginName << PluginAction::Update << propertyName << ValueSetter::Default << value.getType() << value;
+		});
+	}
+
+	static MessageParts msgPluginSetProperty(const std::string & plugin, const std::string & property, const VRayBaseTypes::AttrValue & value,
+	                                         GeometryEncoding encoding = GeometryEncoding::None, const MessageFormat & format = MessageFormat()) {
+		const InternedName pluginName = internName(format, plugin), propertyName = internName(format, property);
+		return build(format, [&] (SerializerStream & strm) {
+			strm.setGeometryEncoding(encoding);
+			strm << VRayMessage::Type::ChangePlugin << pluginName << PluginAction::Update << propertyName << ValueSetter::Default << value;
+		});
+	}
+
+	/// Creates message that changes some items of a POD list property, made by ListDeltaEncoder
+	/// Send it only to receivers accepting it, see MessageFormat::listPatches
+	/// The receiver applies it with applyPatch on the list it got with the previous update of the property
+	/// @count - size of the whole list after the patch, items past the previous size must be in @ranges
+	/// @ranges - changed ranges, sorted and not overlapping
+	/// @items - the items of all ranges in order
+	template <typename T>
+	static MessageParts msgPluginPatchProperty(const std::string & plugin, const std::string & property, size_t count,
+	                                           const std::vector<ListRange> & ranges, const VRayBaseTypes::AttrList<T> & items,
+	                                           GeometryEncoding encoding = GeometryEncoding::None, const MessageFormat & format = MessageFormat()) {
+		const InternedName pluginName = internName(format, plugin), propertyName = internName(format, property);
+		return build(format, [&] (SerializerStream & strm) {
+			strm.setGeometryEncoding(encoding);
+			strm << VRayMessage::Type::ChangePlugin << pluginName << PluginAction::Patch << propertyName
+			     << static_cast<WireSize>(count) << static_cast<WireSize>(ranges.size());
+			strm.write(reinterpret_cast<const char *>(ranges.data()), ranges.size() * sizeof(ListRange));
+			strm << items.getType() << items;
+		});
+	}
+
+	/// Make the start of the payload of a POD list property update, the items must follow it in the same frame
+	/// Used to send lists in pieces as they are produced, see ZmqClient::streamProperty
+	/// @count - number of items that will follow
+	template <typename T>
+	static MessageParts msgPluginSetPropertyStreamed(const std::string & plugin, const std::string & property, size_t count,
+	                                                 const MessageFormat & format = MessageFormat()) {
+		const VRayBaseTypes::ValueType type = VRayBaseTypes::AttrList<T>().getType();
+		const InternedName pluginName = internName(format, plugin), propertyName = internName(format, property);
+		return build(format, [&] (SerializerStream & strm) {
+			strm << VRayMessage::Type::ChangePlugin << pluginName << PluginAction::Update << propertyName << ValueSetter::Default << type;
+			writeListHeader(strm, ListStorage::Inline, count);
+		});
 	}
 
-	static zmq::message_t msgPluginSetPropertyString(const std::string & plugin, const std::string & property, const std::string & value) {
-		using namespace std;
-		SerializerStream strm;
-		strm << VRayMessage::Type::ChangePlugin << plugin << PluginAction::Update << property
-		     << ValueSetter::AsString << VRayBaseTypes::ValueType::ValueTypeString << value;
-		return fromStream(strm);
+	static MessageParts msgPluginSetPropertyString(const std::string & plugin, const std::string & property, const std::string & value,
+	                                               const MessageFormat & format = MessageFormat()) {
+		const InternedName pluginName = internName(format, plugin), propertyName = internName(format, property);
+		return build(format, [&] (SerializerStream & strm) {
+			strm << VRayMessage::Type::ChangePlugin << pluginName << PluginAction::Update << propertyName
+			     << ValueSetter::AsString << VRayBaseTypes::ValueType::ValueTypeString << value;
+		});
 	}
 
-	static zmq::message_t msgImageSet(const VRayBaseTypes::AttrImageSet & value) {
-		SerializerStream strm;
-		strm << VRayMessage::Type::Image << value.getType() << value;
-		return fromStream(strm);
+	static MessageParts msgImageSet(const VRayBaseTypes::AttrImageSet & value, const MessageFormat & format = MessageFormat()) {
+		return build(format, [&] (SerializerStream & strm) {
+			strm << VRayMessage::Type::Image << value.getType() << value;
+		});
 	}
 
-	static zmq::message_t msgVRayLog(int level, const std::string & log) {
-		SerializerStream strm;
+	static MessageParts msgVRayLog(int level, const std::string & log, const MessageFormat & format = MessageFormat()) {
 		VRayBaseTypes::AttrSimpleType<std::string> val(log);
-		strm << VRayMessage::Type::VRayLog << level << val.getType() << log;
-		return fromStream(strm);
+		return build(format, [&] (SerializerStream & strm) {
+			strm << VRayMessage::Type::VRayLog << level << val.getType() << val;
+		});
 	}
 
 	/// Create message to control renderer
-	static zmq::message_t msgRendererAction(RendererAction action) {
+	static MessageParts msgRendererAction(RendererAction action, const MessageFormat & format = MessageFormat()) {
 		assert(action < RendererAction::_ArgumentRenderAction && "Renderer action provided requires argument!");
-		SerializerStream strm;
-		strm << Type::ChangeRenderer << action;
-		return fromStream(strm);
+		return build(format, [&] (SerializerStream & strm) {
+			strm << Type::ChangeRenderer << action;
+		});
 	}
 
 	template <typename T>
-	static zmq::message_t msgRendererAction(RendererAction action, const T & value) {
+	static MessageParts msgRendererAction(RendererAction action, const T & value, const MessageFormat & format = MessageFormat()) {
 		assert(action > RendererAction::_ArgumentRenderAction && "Renderer action provided requires NO argument!");
-		SerializerStream strm;
 		VRayBaseTypes::AttrSimpleType<T> valWrapper(value);
-		strm << Type::ChangeRenderer << action << valWrapper.getType() << valWrapper;
-		return fromStream(strm);
+		return build(format, [&] (SerializerStream & strm) {
+			strm << Type::ChangeRenderer << action << valWrapper.getType() << valWrapper;
+		});
 	}
 
-	static zmq::message_t msgRendererActionInit(RendererType type, DRFlags drFlags) {
-		SerializerStream strm;
+	static MessageParts msgRendererActionInit(RendererType type, DRFlags drFlags, const MessageFormat & format = MessageFormat()) {
+		if (format.wireFormat == WireFormat::V2) {
+			// the two bytes as they are, instead of packed in an int value
+			return build(format, [&] (SerializerStream & strm) {
+				strm << Type::ChangeRenderer << RendererAction::Init << type << drFlags;
+			});
+		}
 		const int value = static_cast<int>(drFlags) << static_cast<int>(DRFlags::_SerializationShift)
 		                | static_cast<int>(type) << static_cast<int>(RendererType::_SerializationShift);
-		return msgRendererAction(RendererAction::Init, value);
+		return msgRendererAction(RendererAction::Init, value, format);
 	}
 
-	static zmq::message_t msgRendererAction(RendererAction action, const VRayBaseTypes::AttrListInt & value) {
+	static MessageParts msgRendererAction(RendererAction action, const VRayBaseTypes::AttrListInt & value, const MessageFormat & format = MessageFormat()) {
 		assert(action > RendererAction::_ArgumentRenderAction && "Renderer action provided requires NO argument!");
-		SerializerStream strm;
-		strm << Type::ChangeRenderer << action << value.getType() << value;
-		return fromStream(strm);
+		return build(format, [&] (SerializerStream & strm) {
+			strm << Type::ChangeRenderer << action << value.getType() << value;
+		});
 	}
 
 	template <typename T>
-	static zmq::message_t msgRendererState(RendererState state, const T & val) {
+	static MessageParts msgRendererState(RendererState state, const T & val, const MessageFormat & format = MessageFormat()) {
 		VRayBaseTypes::AttrSimpleType<T> valWrapper(val);
-		SerializerStream strm;
-		strm << Type::ChangeRenderer << RendererAction::SetRendererState << state << valWrapper.getType() << valWrapper;
-		return fromStream(strm);
+		return build(format, [&] (SerializerStream & strm) {
+			strm << Type::ChangeRenderer << RendererAction::SetRendererState << state << valWrapper.getType() << valWrapper;
+		});
 	}
 
-	static zmq::message_t msgRendererResize(int width, int height) {
-		SerializerStream strm;
-		strm << Type::ChangeRenderer << RendererAction::Resize << width << height;
-		return fromStream(strm);
+	static MessageParts msgRendererResize(int width, int height, const MessageFormat & format = MessageFormat()) {
+		return build(format, [&] (SerializerStream & strm) {
+			strm << Type::ChangeRenderer << RendererAction::Resize << width << height;
+		});
 	}
 
 private:
-	static zmq::message_t fromStream(SerializerStream & strm) {
-		return fromData(strm.getData(), strm.getSize());
+	/// Read the type of a payload and set the WireFormat of @stream for the rest of it
+	static void readType(DeserializerStream & stream, Type & type) {
+		uint8_t tag = 0;
+		stream.read(reinterpret_cast<char *>(&tag), 1);
+		stream.setWireFormat(tag & TYPE_WIRE_FORMAT_V2 ? WireFormat::V2 : WireFormat::V1);
+		type = static_cast<Type>(tag & ~TYPE_WIRE_FORMAT_V2);
+	}
+
+	/// Serialize a message straight into a zmq::message_t of the exact size
+	/// zmq keeps payloads up to ZMQ_INLINE_BYTES inline, bigger ones are made in a PayloadPool block with
+	/// MessageFormat::pooledPayload, else malloced - the one allocation per message
+	/// @format - layout of the message, lists are referenced as external frames only with referenceLists in WireFormat::V2
+	/// @write - callable(SerializerStream &) writing the message, called twice: to measure and to write
+	template <typename F>
+	static MessageParts build(const MessageFormat & format, F write) {
+		const WireFormat wireFormat = format.wireFormat;
+		const size_t externalThreshold = format.referenceLists && wireFormat == WireFormat::V2 ? EXTERNAL_LIST_MIN_BYTES : 0;
+		SerializerStream counter(SerializerStream::MeasureOnly(), externalThreshold);
+		counter.setWireFormat(wireFormat);
+		counter.setCompressed(format.compressed);
+		write(counter);
+
+		const size_t size = counter.getSize();
+		PayloadBlock * block = format.pooledPayload && size > ZMQ_INLINE_BYTES ? PayloadPool::acquire(size) : nullptr;
+		MessageParts parts = block ? MessageParts(block, size) : MessageParts(zmq::message_t(size));
+		SerializerStream strm(static_cast<char *>(parts.payload.data()), parts.payload.size(), externalThreshold);
+		strm.setWireFormat(wireFormat);
+		strm.setCompressed(format.compressed);
+		write(strm);
+		assert(strm.getSize() == counter.getSize() && "Message size changed between measure and write");
+		if (wireFormat == WireFormat::V2 && parts.payload.size()) {
+			*static_cast<uint8_t *>(parts.payload.data()) |= TYPE_WIRE_FORMAT_V2;
+		}
+		parts.definitions = std::move(strm.getDefinitions());
+
+		auto & external = strm.getExternal();
+		parts.external.reserve(external.size());
+		for (auto & ext : external) {
+			// zmq calls releaseExternal when done with the frame, possibly from its IO thread
+			auto owner = new std::shared_ptr<const void>(std::move(ext.owner));
+			parts.external.emplace_back(const_cast<char *>(ext.data), ext.size, &VRayMessage::releaseExternal, owner);
+		}
+		return parts;
+	}
+
+	/// Get how a name is written in a message made with @format
+	static InternedName internName(const MessageFormat & format, const std::string & name) {
+		return format.strings ? format.strings->intern(name) : InternedName(name);
+	}
+
+	/// Read a name for peekPluginProperty, resolving interned ones with @strings
+	static bool peekName(DeserializerStream & stream, const SessionStringEncoder * strings, std::string & name) {
+		StringHeader kind = StringHeader::Plain;
+		WireSize value = 0;
+		if (!readStringHeader(stream, kind, value)) {
+			return false;
+		}
+		if (kind == StringHeader::Reference) {
+			return strings && strings->getName(value, name);
+		}
+		if (kind == StringHeader::Definition && !readStringHeader(stream, kind, value)) {
+			return false;
+		}
+		if (kind != StringHeader::Plain || value > stream.getRemaining()) {
+			return false;
+		}
+		name.assign(stream.getCurrent(), static_cast<size_t>(value));
+		stream.forward(static_cast<size_t>(value));
+		return true;
+	}
+
+	/// Read a name that may be interned
+	static void readName(DeserializerStream & stream, SessionStringTable * strings, std::string & plain, std::shared_ptr<const std::string> & interned) {
+		const bool valid = strings ? strings->read(stream, plain, interned) : SessionStringTable::readPlain(stream, plain);
+		if (!valid) {
+			assert(!"Malformed or unknown interned name");
+		}
+	}
+
+	static void releaseExternal(void *, void * hint) {
+		delete static_cast<std::shared_ptr<const void> *>(hint);
 	}
 
-	void parse() {
+	/// Get stream over the received frames, positioned at @offset in the payload
+	DeserializerStream makeStream(size_t offset) const {
+		const zmq::message_t & payload = shared ? shared->payload : this->message;
+		const size_t size = payload.size();
+		DeserializerStream stream(reinterpret_cast<const char *>(payload.data()) + std::min(offset, size), size - std::min(offset, size));
+		stream.setWireFormat(payloadFormat);
+		for (auto & frame : (shared ? shared->external : external)) {
+			stream.addExternal(reinterpret_cast<const char *>(frame.data()), frame.size());
+		}
+		if (shared) {
+			stream.setOwner(shared);
+		}
+		return stream;
+	}
+
+	/// Get stream positioned at the start of a value skipped by ParseLazyValue
+	DeserializerStream valueStream() const {
+		return makeStream(valueOffset);
+	}
+
+	/// Decode the value skipped by ParseLazyValue, no-op if already decoded
+	void decodeValue() const {
+		if (valuePending) {
+			valuePending = false;
+			DeserializerStream stream = valueStream();
+			stream >> value;
+		}
+	}
+
+	/// Decode the value now or remember where it starts for decodeValue
+	void parseValue(DeserializerStream & stream, int flags) {
+		if (flags & ParseLazyValue) {
+			valueOffset = stream.getSize() - stream.getRemaining();
+			valuePending = true;
+		} else {
+			stream >> value;
+		}
+	}
+
+	void parse(int flags, SessionStringTable * strings) {
 		using namespace VRayBaseTypes;
 
-		DeserializerStream stream(reinterpret_cast<char*>(message.data()), message.size());
-		stream >> type;
+		DeserializerStream stream = makeStream(0);
+		readType(stream, type);
+		payloadFormat = stream.getWireFormat();
 
 		if (type == Type::ChangePlugin) {
-			stream >> pluginName >> pluginAction;
+			readName(stream, strings, pluginName, internedName);
+			stream >> pluginAction;
 			if (pluginAction == PluginAction::Update) {
-				stream >> pluginProperty >> valueSetter >> value;
+				readName(stream, strings, pluginProperty, internedProperty);
+				stream >> valueSetter;
+				parseValue(stream, flags);
 			} else if (pluginAction == PluginAction::Create) {
 				if (stream.hasMore()) {
-					stream >> pluginType;
+					readName(stream, strings, pluginType, internedType);
 				}
 			} else if (pluginAction == PluginAction::Replace) {
 				assert(stream.hasMore() && "Missing new plugin for replace plugin");
-				stream >> value;
+				parseValue(stream, flags);
+			} else if (pluginAction == PluginAction::Patch) {
+				WireSize count = 0, rangeCount = 0;
+				readName(stream, strings, pluginProperty, internedProperty);
+				stream >> count >> rangeCount;
+				if (rangeCount > stream.getRemaining() / sizeof(ListRange) || count > std::numeric_limits<size_t>::max()) {
+					assert(!"Malformed list patch");
+					return;
+				}
+				patchCount = static_cast<size_t>(count);
+				patchRanges.resize(static_cast<size_t>(rangeCount));
+				stream.read(reinterpret_cast<char *>(patchRanges.data()), patchRanges.size() * sizeof(ListRange));
+				parseValue(stream, flags);
 			}
 		} else if (type == Type::Image) {
-			stream >> value;
+			parseValue(stream, flags);
 		} else if (type == Type::VRayLog) {
-			stream >> logLevel >> value;
-			assert(value.type == VRayBaseTypes::ValueTypeString && "Type::VRayLog must be a string value");
+			stream >> logLevel;
+			parseValue(stream, flags);
+			assert(getValueType() == VRayBaseTypes::ValueTypeString && "Type::VRayLog must be a string value");
 		} else if (type == Type::ChangeRenderer) {
 			stream >> rendererAction;
 			if (rendererAction == RendererAction::Resize) {
 				stream >> rendererWidth >> rendererHeight;
+			} else if (rendererAction == RendererAction::Init && payloadFormat == WireFormat::V2) {
+				stream >> rendererType >> drFlags;
+				// same value as V1 messages have, for code reading it
+				value = VRayBaseTypes::AttrSimpleType<int>(static_cast<int>(drFlags) << static_cast<int>(DRFlags::_SerializationShift)
+				                                         | static_cast<int>(rendererType) << static_cast<int>(RendererType::_SerializationShift));
 			} else if (rendererAction == RendererAction::Init) {
+				// the flags are in the value, so it is always decoded
 				stream >> value;
 				const int val = value.as<AttrSimpleType<int>>().value;
 				drFlags = static_cast<DRFlags>((val >> static_cast<int>(DRFlags::_SerializationShift)) & 0xff);
 				rendererType = static_cast<RendererType>((val >> static_cast<int>(RendererType::_SerializationShift)) & 0xff);
 			} else if (rendererAction == RendererAction::SetRendererState) {
-				stream >> rendererState >> value;
+				stream >> rendererState;
+				parseValue(stream, flags);
 			} else if (rendererAction > RendererAction::_ArgumentRenderAction) {
-				stream >> value;
+				parseValue(stream, flags);
 			}
 		}
 	}
@@ -393,12 +908,23 @@ private:
 	std::string               pluginName;
 	std::string               pluginType;
 	std::string               pluginProperty;
+	std::shared_ptr<const std::string> internedName; ///< Set instead of @pluginName if the name was interned
+	std::shared_ptr<const std::string> internedType; ///< Set instead of @pluginType if the name was interned
+	std::shared_ptr<const std::string> internedProperty; ///< Set instead of @pluginProperty if the name was interned
 
 	int                       logLevel;
 	int                       rendererWidth;
 	int                       rendererHeight;
 
-	VRayBaseTypes::AttrValue  value;
+	mutable VRayBaseTypes::AttrValue value; ///< Decoded lazily by const getters if @valuePending
+	size_t                    patchCount; ///< Size of the patched list for PluginAction::Patch
+	std::vector<ListRange>    patchRanges; ///< Changed ranges for PluginAction::Patch
+
+	std::vector<zmq::message_t> external; ///< Received frames referenced by ListStorage::External and Encoded lists
+	std::shared_ptr<MessageParts> shared; ///< All received frames when parsed with ParseViewData, shared with the values
+	size_t valueOffset; ///< Offset of the value in the payload, valid if @valuePending
+	mutable bool valuePending; ///< True if the value was skipped by ParseLazyValue and is not decoded yet
+	WireFormat payloadFormat; ///< Format of the received payload, found by parse
 private:
 	VRayMessage(const VRayMessage&) = delete;
 	VRayMessage& operator=(const VRayMessage&) = delete;
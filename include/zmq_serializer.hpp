@@ -3,33 +3,216 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <cstdint>
+#include <limits>
 #include "base_types.h"
+#include "geometry_encoding.hpp"
 
+/// Length prefix of strings and lists on the wire, LEB128 in WireFormat::V2 so single values can be over 2GB
+typedef uint64_t WireSize;
+
+/// Encoding of the values in a message payload, the receiver finds it in the first byte, see VRayMessage::build
+enum class WireFormat : char {
+	V1 = 1, ///< The layout of protocol 1013 - 4 byte lengths, counts, ints and type tags, lists always inline
+	V2 = 2, ///< Compact - LEB128 lengths, zigzag LEB128 ints, 1 byte type tags; floats and list data stay fixed width,
+	        ///< POD lists may be external frames or encoded, see ListStorage
+};
+
+/// Newest WireFormat this side can read and write
+static const WireFormat WIRE_FORMAT_LATEST = WireFormat::V2;
+
+/// Kind of a string header, names of plugin messages can be interned, see SessionStringEncoder
+enum class StringHeader : char {
+	Plain, ///< Header value is the length, the chars follow
+	Reference, ///< Header value is the id of an interned name
+	Definition, ///< Header value is the id of a new interned name, a Plain header and the chars follow
+};
+
+/// WireFormat::V1 string header bits, the header takes the place of the int length of a plain string:
+///   reference:  [INTERNED_STRING_BIT | id]
+///   definition: [INTERNED_STRING_BIT | INTERNED_DEFINE_BIT | id][int length][chars]
+/// WireFormat::V2 string headers are a single LEB128 of (length << 1), (id << 2 | 1) or (id << 2 | 3)
+static const uint32_t INTERNED_STRING_BIT = 1u << 31;
+static const uint32_t INTERNED_DEFINE_BIT = 1u << 30;
+static const uint32_t INTERNED_ID_MASK = INTERNED_DEFINE_BIT - 1;
+
+/// POD lists with at least this many bytes can be sent as separate frames without copying them, see MessageFormat
+/// Smaller lists are always inline, so their messages can be batched
+static const int EXTERNAL_LIST_MIN_BYTES = 64 * 1024;
+
+/// How the data of a POD AttrList is stored in a WireFormat::V2 message, V1 lists are always inline without a tag
+enum class ListStorage : char {
+	Inline, ///< Data follows the count in the same buffer
+	External, ///< Data is in the next external buffer of the message
+	Encoded, ///< ListEncoding follows the count, the encoded data is in the next external buffer of the message
+};
+
+/// Writes values in a byte buffer, the buffer is either:
+/// - a growing std::vector owned by the stream (default)
+/// - a fixed size buffer owned by someone else, that must fit all the data
+/// - none - only the number of bytes written is counted, used to find the size for the fixed buffer
 class SerializerStream {
 public:
+	/// Buffer referenced by the stream instead of copied in it
+	struct ExternalData {
+		std::shared_ptr<const void> owner; ///< Keeps @data alive
+		const char * data;
+		size_t size;
+	};
+
+	/// Tag for the constructor of stream that only counts bytes
+	struct MeasureOnly {};
+
+	/// Create stream writing in a growing buffer
+	/// @externalThreshold - POD lists with this many bytes or more are referenced instead of copied (WireFormat::V2 only), 0 to copy all
+	explicit SerializerStream(size_t externalThreshold = 0)
+	    : fixed(nullptr)
+	    , capacity(0)
+	    , written(0)
+	    , measure(false)
+	    , externalThreshold(externalThreshold)
+	    , geometryEncoding(GeometryEncoding::None)
+	    , compressed(false)
+	    , wireFormat(WireFormat::V1)
+	{}
+
+	/// Create stream that only counts the written bytes, referenced buffers are not recorded
+	/// @externalThreshold - must be the same as the one for the stream that will write the data
+	SerializerStream(MeasureOnly, size_t externalThreshold = 0)
+	    : fixed(nullptr)
+	    , capacity(0)
+	    , written(0)
+	    , measure(true)
+	    , externalThreshold(externalThreshold)
+	    , geometryEncoding(GeometryEncoding::None)
+	    , compressed(false)
+	    , wireFormat(WireFormat::V1)
+	{}
+
+	/// Create stream writing in a fixed size buffer
+	/// @buffer - where to write, must be valid while the stream is used
+	/// @capacity - size of @buffer, writing more is an error and the excess is dropped
+	SerializerStream(char * buffer, size_t capacity, size_t externalThreshold = 0)
+	    : fixed(buffer)
+	    , capacity(capacity)
+	    , written(0)
+	    , measure(false)
+	    , externalThreshold(externalThreshold)
+	    , geometryEncoding(GeometryEncoding::None)
+	    , compressed(false)
+	    , wireFormat(WireFormat::V1)
+	{}
+
+	/// Check if a buffer with @size bytes should be referenced instead of written
+	bool shouldReference(size_t size) const {
+		return externalThreshold && size >= externalThreshold;
+	}
+
+	/// Reference a buffer instead of copying it, it must not change until the message is sent
+	/// @owner - keeps data alive as long as the stream or the messages made from it need it
+	void reference(std::shared_ptr<const void> owner, const char * data, size_t size) {
+		if (measure) {
+			return;
+		}
+		ExternalData ext = {std::move(owner), data, size};
+		external.push_back(std::move(ext));
+	}
+
+	/// Record that the message defines the interned name @id, see SessionStringEncoder::commit
+	void define(WireSize id) {
+		if (!measure) {
+			definitions.push_back(id);
+		}
+	}
+
+	/// Get the ids of all interned names defined in the written data
+	std::vector<WireSize> & getDefinitions() {
+		return definitions;
+	}
+
+	/// Set encoding of the POD lists written after this call, encoded lists are always referenced buffers
+	void setGeometryEncoding(GeometryEncoding encoding) {
+		geometryEncoding = encoding;
+	}
+
+	GeometryEncoding getGeometryEncoding() const {
+		return geometryEncoding;
+	}
+
+	/// Set if the written data is compressed before it is sent, see MessageFormat::compressed
+	void setCompressed(bool flag) {
+		compressed = flag;
+	}
 
-	SerializerStream() {
+	bool isCompressed() const {
+		return compressed;
 	}
 
-	void write(const char * data, int size) {
+	/// Set the format of the values written after this call
+	void setWireFormat(WireFormat format) {
+		wireFormat = format;
+	}
+
+	WireFormat getWireFormat() const {
+		return wireFormat;
+	}
+
+	/// Check if the stream only counts bytes, so nothing has to be prepared for it
+	bool isMeasuring() const {
+		return measure;
+	}
+
+	/// Get all referenced buffers in the order they were added
+	std::vector<ExternalData> & getExternal() {
+		return external;
+	}
+
+	void write(const char * data, size_t size) {
 		if (size == 0) {
 			return;
 		}
-		const int prevSize = stream.size();
-		stream.resize(size + stream.size());
-		memcpy(&stream[prevSize], data, size);
+		if (fixed) {
+			if (written + size > capacity) {
+				assert(!"SerializerStream fixed buffer overflow");
+				size = capacity - written;
+			}
+			memcpy(fixed + written, data, size);
+		} else if (!measure) {
+			stream.resize(written + size);
+			memcpy(&stream[written], data, size);
+		}
+		written += size;
 	}
 
-	int getSize() const {
-		return stream.size();
+	size_t getSize() const {
+		return written;
+	}
+
+	/// Drop all written data and references, keeps the allocated memory for reuse
+	void clear() {
+		stream.clear();
+		external.clear();
+		definitions.clear();
+		written = 0;
 	}
 
 	char * getData() {
-		return stream.data();
+		return fixed ? fixed : stream.data();
 	}
 
 private:
-	std::vector<char> stream;
+	std::vector<char> stream; ///< The growing buffer, unused for fixed and measure streams
+	char * fixed; ///< The fixed buffer if any
+	size_t capacity; ///< Size of @fixed
+	size_t written; ///< Number of bytes written so far
+	bool measure; ///< True if the stream only counts bytes
+	std::vector<ExternalData> external; ///< Buffers sent after the stream data without copying
+	std::vector<WireSize> definitions; ///< Interned names defined in the stream data
+	size_t externalThreshold; ///< Min size of referenced buffers, 0 to disable
+	GeometryEncoding geometryEncoding; ///< Encoding of POD lists
+	bool compressed; ///< Set if the data is compressed after writing
+	WireFormat wireFormat; ///< Format of the written values
 };
 
 
@@ -40,10 +223,126 @@ inline SerializerStream & operator<<(SerializerStream & stream, const T & value)
 }
 
 
+/// Write @value as unsigned LEB128 - 7 bits per byte, low bits first, high bit set on all bytes but the last
+inline void writeVarint(SerializerStream & stream, uint64_t value) {
+	char bytes[10];
+	int count = 0;
+	while (value >= 0x80) {
+		bytes[count++] = static_cast<char>(value | 0x80);
+		value >>= 7;
+	}
+	bytes[count++] = static_cast<char>(value);
+	stream.write(bytes, count);
+}
+
+/// Lengths and counts, an int in WireFormat::V1 and LEB128 in V2
+inline SerializerStream & operator<<(SerializerStream & stream, WireSize value) {
+	if (stream.getWireFormat() == WireFormat::V2) {
+		writeVarint(stream, value);
+	} else {
+		assert(value <= static_cast<WireSize>(std::numeric_limits<int>::max()) && "WireFormat::V1 lengths must fit in an int");
+		const int size = static_cast<int>(value);
+		stream.write(reinterpret_cast<const char *>(&size), sizeof(size));
+	}
+	return stream;
+}
+
+/// Ints outside of lists, zigzag LEB128 in WireFormat::V2 so small negative values are short too
+inline SerializerStream & operator<<(SerializerStream & stream, int value) {
+	if (stream.getWireFormat() == WireFormat::V2) {
+		const uint32_t bits = static_cast<uint32_t>(value);
+		writeVarint(stream, (bits << 1) ^ (0u - (bits >> 31)));
+	} else {
+		stream.write(reinterpret_cast<const char *>(&value), sizeof(value));
+	}
+	return stream;
+}
+
+/// Value type tags, a single byte in WireFormat::V2
+inline SerializerStream & operator<<(SerializerStream & stream, VRayBaseTypes::ValueType type) {
+	if (stream.getWireFormat() == WireFormat::V2) {
+		const uint8_t tag = static_cast<uint8_t>(type);
+		stream.write(reinterpret_cast<const char *>(&tag), 1);
+	} else {
+		stream.write(reinterpret_cast<const char *>(&type), sizeof(type));
+	}
+	return stream;
+}
+
+/// Write an int sized enum, as an int in WireFormat::V2
+template <typename E>
+inline SerializerStream & writeEnum(SerializerStream & stream, E value) {
+	static_assert(sizeof(E) == sizeof(int), "Only int sized enums are written as ints");
+	if (stream.getWireFormat() == WireFormat::V2) {
+		return stream << static_cast<int>(value);
+	}
+	stream.write(reinterpret_cast<const char *>(&value), sizeof(value));
+	return stream;
+}
+
+inline SerializerStream & operator<<(SerializerStream & stream, VRayBaseTypes::RenderChannelType type) {
+	return writeEnum(stream, type);
+}
+
+inline SerializerStream & operator<<(SerializerStream & stream, VRayBaseTypes::AttrImage::ImageType type) {
+	return writeEnum(stream, type);
+}
+
+inline SerializerStream & operator<<(SerializerStream & stream, VRayBaseTypes::ImageSourceType type) {
+	return writeEnum(stream, type);
+}
+
+inline SerializerStream & operator<<(SerializerStream & stream, const VRayBaseTypes::AttrSimpleType<int> & value) {
+	return stream << value.value;
+}
+
+inline SerializerStream & operator<<(SerializerStream & stream, const VRayBaseTypes::AttrSimpleType<bool> & value) {
+	return stream << value.value;
+}
+
+/// Write the header of a string, see StringHeader
+inline void writeStringHeader(SerializerStream & stream, StringHeader kind, WireSize value) {
+	if (stream.getWireFormat() == WireFormat::V2) {
+		switch (kind) {
+		case StringHeader::Plain: writeVarint(stream, value << 1); break;
+		case StringHeader::Reference: writeVarint(stream, value << 2 | 1); break;
+		case StringHeader::Definition: writeVarint(stream, value << 2 | 3); break;
+		}
+	} else if (kind == StringHeader::Plain) {
+		stream << value;
+	} else {
+		assert(value <= INTERNED_ID_MASK && "Interned name id does not fit in a WireFormat::V1 header");
+		uint32_t header = INTERNED_STRING_BIT | static_cast<uint32_t>(value);
+		if (kind == StringHeader::Definition) {
+			header |= INTERNED_DEFINE_BIT;
+		}
+		stream.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	}
+}
+
+/// Write the storage and count of a POD list, WireFormat::V1 has only the count and the data is always inline
+inline void writeListHeader(SerializerStream & stream, ListStorage storage, size_t count) {
+	if (stream.getWireFormat() == WireFormat::V2) {
+		stream << storage;
+	} else {
+		assert(storage == ListStorage::Inline && "WireFormat::V1 lists are always inline");
+	}
+	stream << static_cast<WireSize>(count);
+}
+
+/// Write the byte size of an image, 8 bytes in WireFormat::V1 (a size_t in protocol 1013)
+inline void writeImageSize(SerializerStream & stream, size_t size) {
+	if (stream.getWireFormat() == WireFormat::V2) {
+		stream << static_cast<WireSize>(size);
+	} else {
+		const uint64_t bytes = size;
+		stream.write(reinterpret_cast<const char *>(&bytes), sizeof(bytes));
+	}
+}
+
 inline SerializerStream & operator<<(SerializerStream & stream, const std::string & value) {
-	const int size = value.size();
-	stream << size;
-	stream.write(value.c_str(), size);
+	writeStringHeader(stream, StringHeader::Plain, value.size());
+	stream.write(value.c_str(), value.size());
 	return stream;
 }
 
@@ -60,14 +359,39 @@ inline SerializerStream & operator<<(SerializerStream & stream, const VRayBaseTy
 
 template <typename Q>
 inline SerializerStream & operator<<(SerializerStream & stream, const VRayBaseTypes::AttrList<Q> & list) {
-	stream << list.getCount();
-	stream.write(reinterpret_cast<const char *>(list.getData()->data()), list.getCount() * sizeof(Q));
+	const size_t bytes = list.getCount() * sizeof(Q);
+	const char * data = reinterpret_cast<const char *>(list.getItems());
+	ListEncoding encoding = GeometryListTraits<Q>::encoding;
+	if (encoding == ListEncoding::BytePlanes && !stream.isCompressed()) {
+		// the planes are as big as the list, they only help a compressor
+		encoding = ListEncoding::None;
+	}
+	if (stream.getWireFormat() == WireFormat::V1) {
+		writeListHeader(stream, ListStorage::Inline, list.getCount());
+		stream.write(data, bytes);
+	} else if (encoding != ListEncoding::None && stream.getGeometryEncoding() == GeometryEncoding::Mesh
+		&& bytes >= static_cast<size_t>(EXTERNAL_LIST_MIN_BYTES)) {
+		writeListHeader(stream, ListStorage::Encoded, list.getCount());
+		stream << encoding;
+		// the measuring pass of VRayMessage::build does not need the data, so lists are encoded only once
+		if (!stream.isMeasuring()) {
+			std::shared_ptr<std::vector<char>> encoded(new std::vector<char>);
+			GeometryCodec::encode(encoding, list.getItems(), list.getCount(), *encoded);
+			stream.reference(encoded, encoded->data(), encoded->size());
+		}
+	} else if (stream.shouldReference(bytes)) {
+		writeListHeader(stream, ListStorage::External, list.getCount());
+		stream.reference(list.getItemsOwner(), data, bytes);
+	} else {
+		writeListHeader(stream, ListStorage::Inline, list.getCount());
+		stream.write(data, bytes);
+	}
 	return stream;
 }
 
 template <typename T>
 inline void writeListNonPOD(SerializerStream & stream, const VRayBaseTypes::AttrList<T> & list) {
-	stream << list.getCount();
+	stream << static_cast<WireSize>(list.getCount());
 	if (!list.empty()) {
 		for (auto & item : *(list.getData())) {
 			stream << item;
@@ -111,7 +435,7 @@ inline SerializerStream & operator<<(SerializerStream & stream, const VRayBaseTy
 
 
 inline SerializerStream & operator<<(SerializerStream & stream, const VRayBaseTypes::AttrInstancer & inst) {
-	stream << inst.frameNumber << inst.data.getCount();
+	stream << inst.frameNumber << static_cast<WireSize>(inst.data.getCount());
 	if (!inst.data.empty()) {
 		for (auto & item : *(inst.data.getData())) {
 			stream << item;
@@ -122,7 +446,9 @@ inline SerializerStream & operator<<(SerializerStream & stream, const VRayBaseTy
 
 
 inline SerializerStream & operator<<(SerializerStream & stream, const VRayBaseTypes::AttrImage & image) {
-	stream << image.imageType << image.size << image.width << image.height << image.x << image.y;
+	stream << image.imageType;
+	writeImageSize(stream, image.size);
+	stream << image.width << image.height << image.x << image.y;
 	stream.write(image.data.get(), image.size);
 	return stream;
 }
@@ -137,36 +463,46 @@ inline SerializerStream & operator<<(SerializerStream & stream, const VRayBaseTy
 }
 
 
+/// Writes the value of an AttrValue for each stored type, see VRayBaseTypes::AttrTypeTable
+template <typename T>
+struct AttrValueWriter {
+	typedef void (*Write)(SerializerStream & stream, const VRayBaseTypes::AttrValue & value);
+
+	static constexpr Write make() {
+		return &write;
+	}
+
+	static void write(SerializerStream & stream, const VRayBaseTypes::AttrValue & value) {
+		stream << value.as<T>();
+	}
+};
+
+template <>
+struct AttrValueWriter<void> {
+	typedef void (*Write)(SerializerStream & stream, const VRayBaseTypes::AttrValue & value);
+
+	static constexpr Write make() {
+		return &write;
+	}
+
+	static void write(SerializerStream &, const VRayBaseTypes::AttrValue &) {
+		assert(!"Missing SerializerStream::operator<< for some ValueType");
+	}
+};
+
 inline SerializerStream & operator<<(SerializerStream & stream, const VRayBaseTypes::AttrValue & value) {
 	stream << value.type;
-	using namespace VRayBaseTypes;
-	switch(value.type) {
-	case ValueTypeInt: stream << value.as<AttrSimpleType<int>>(); break;
-	case ValueTypeFloat: stream << value.as<AttrSimpleType<float>>(); break;
-	case ValueTypeString: stream << value.as<AttrSimpleType<std::string>>(); break;
-	case ValueTypeColor: stream << value.as<AttrColor>(); break;
-	case ValueTypeAColor: stream << value.as<AttrAColor>(); break;
-	case ValueTypeVector: stream << value.as<AttrVector>(); break;
-	case ValueTypeVector2: stream << value.as<AttrVector2>(); break;
-	case ValueTypeMatrix: stream << value.as<AttrMatrix>(); break;
-	case ValueTypeTransform: stream << value.as<AttrTransform>(); break;
-	case ValueTypePlugin: stream << value.as<AttrPlugin>(); break;
-	case ValueTypeImageSet: stream << value.as<AttrImageSet>(); break;
-	case ValueTypeListInt: stream << value.as<AttrListInt>(); break;
-	case ValueTypeListFloat: stream << value.as<AttrListFloat>(); break;
-	case ValueTypeListColor: stream << value.as<AttrListColor>(); break;
-	case ValueTypeListVector: stream << value.as<AttrListVector>(); break;
-	case ValueTypeListVector2: stream << value.as<AttrListVector2>(); break;
-	case ValueTypeListMatrix: stream << value.as<AttrListMatrix>(); break;
-	case ValueTypeListTransform: stream << value.as<AttrListTransform>(); break;
-	case ValueTypeListString: stream << value.as<AttrListString>(); break;
-	case ValueTypeListPlugin: stream << value.as<AttrListPlugin>(); break;
-	case ValueTypeListValue: stream << value.as<AttrListValue>(); break;
-	case ValueTypeInstancer: stream << value.as<AttrInstancer>(); break;
-	case ValueTypeMapChannels: stream << value.as<AttrMapChannels>(); break;
-	default: assert(!"Missing SerializerStream::operator<< for some ValueType");
-	}
+	VRayBaseTypes::AttrTypeTable<AttrValueWriter>::get(value.type)(stream, value);
 	return stream;
 }
 
+/// Get the number of bytes @value takes when serialized, without writing anything
+/// @externalThreshold - lists referenced as external buffers count only their header
+template <typename T>
+inline size_t serializedSize(const T & value, size_t externalThreshold = 0) {
+	SerializerStream counter(SerializerStream::MeasureOnly(), externalThreshold);
+	counter << value;
+	return counter.getSize();
+}
+
 #endif // _SERIALIZER_HPP_
@@ -5,11 +5,11 @@
 #include <zmq.hpp>
 
 #include <string>
+#include <unordered_map>
 #include <functional>
 #include <thread>
 #include <atomic>
 #include <memory>
-#include <deque>
 #include <mutex>
 #include <cstdio>
 
@@ -20,6 +20,10 @@
 
 #include "base_types.h"
 #include "zmq_message.hpp"
+#include "zmq_compression.hpp"
+#include "frame_dedup.hpp"
+#include "mpsc_queue.hpp"
+#include "message_dispatcher.hpp"
 
 static const int ZMQ_PROTOCOL_VERSION = 1013;
 
@@ -36,6 +40,17 @@ static const int HEARBEAT_TIMEOUT = CLIENT_PING_INTERVAL * 2;
 
 static const int MAX_CONSEQ_MESSAGES = 10;
 
+static const int DEFAULT_BATCH_MAX_BYTES = 64 * 1024;
+static const int DEFAULT_BATCH_MAX_DELAY = 1;
+
+static const int DEFAULT_CHUNK_SIZE = 1024 * 1024;
+static const int MAX_CONTROL_BURST = 8;
+
+static const int DEFAULT_COMPRESSION_MIN_BYTES = 64 * 1024;
+
+static const size_t DEFAULT_DEDUP_MIN_BYTES = 64 * 1024;
+static const size_t DEFAULT_DEDUP_STORE_BYTES = 256 * 1024 * 1024;
+
 enum class ClientType: int {
 	None,
 	Exporter,
@@ -44,6 +59,12 @@ enum class ClientType: int {
 
 enum class ControlMessage: int {
 	DATA_MSG = 0,
+	DATA_BATCH_MSG = 1,
+	DATA_CHUNK_MSG = 2,
+	DATA_COMPRESSED_MSG = 3,
+	DATA_HASHED_MSG = 4,
+	FRAME_REQUEST_MSG = 5,
+	FRAME_BODY_MSG = 6,
 
 	EXPORTER_CONNECT_MSG = 1000,
 	HEARTBEAT_CONNECT_MSG = 1001,
@@ -57,6 +78,13 @@ enum class ControlMessage: int {
 	STOP_MSG = 4000,
 };
 
+/// Optional parts of the protocol, the client offers a mask of them in the handshake and the server
+/// answers with the ones it accepts
+enum class ProtocolFeature: int {
+	StringInterning = 1 << 0, ///< Names of plugin messages are sent as ids of a SessionStringTable
+	ListPatches = 1 << 1, ///< PluginAction::Patch messages can be sent, see ListDeltaEncoder
+};
+
 
 struct ControlFrame {
 	int version;
@@ -89,6 +117,51 @@ struct ControlFrame {
 };
 
 
+/// Helpers for the payload of ControlMessage::DATA_BATCH_MSG - many data payloads packed in one frame
+/// The layout is a sequence of [int size][size bytes of VRayMessage payload]
+struct MessageBatch {
+	/// Append a data payload to the batch
+	static void append(SerializerStream & batch, const zmq::message_t & payload) {
+		const int size = static_cast<int>(payload.size());
+		batch << size;
+		batch.write(static_cast<const char *>(payload.data()), size);
+	}
+
+	/// Call @fn(const char * data, int size) for each payload in the batch, in the order they were appended
+	/// @return - false if the batch is malformed, payloads before the error are still visited
+	template <typename F>
+	static bool forEach(const zmq::message_t & batch, F fn) {
+		DeserializerStream stream(static_cast<const char *>(batch.data()), batch.size());
+		while (stream.hasMore()) {
+			int size = 0;
+			if (!stream.read(reinterpret_cast<char *>(&size), sizeof(size)) || size < 0 || static_cast<size_t>(size) > stream.getRemaining()) {
+				return false;
+			}
+			fn(stream.getCurrent(), size);
+			stream.forward(size);
+		}
+		return true;
+	}
+};
+
+
+/// Header frame of ControlMessage::DATA_CHUNK_MSG - a piece of a data message too big to send at once
+/// Sent as [control][ChunkHeader][piece], pieces of a message go in order frame by frame and offset by offset,
+/// pieces of different messages can be interleaved
+struct ChunkHeader {
+	uint32_t messageId; ///< Same for all pieces of one message
+	int frameIndex; ///< 0 for the payload, 1 + index for the external frames
+	int frameCount; ///< 1 + number of external frames
+	ControlMessage control; ///< How to handle the assembled message - DATA_MSG or DATA_COMPRESSED_MSG
+	uint64_t frameSize; ///< Size of the whole frame the piece belongs to
+	uint64_t offset; ///< Offset of the piece in its frame
+};
+
+
+template <typename T>
+class PropertyStream;
+
+
 /// Async wrapper for zmq::socket_t with callback on data received.
 /// Supports heartbeat mode which will create heartbeat connection with the server that will not be auto-terminated when
 /// there is no communication on it from the server side. Used to keep the server alive all the time
@@ -96,6 +169,7 @@ struct ControlFrame {
 class ZmqClient {
 public:
 	typedef std::function<void(const VRayMessage &, ZmqClient *)> ZmqOnMessageCallback;
+	typedef std::function<void(ZmqClient *)> ZmqOnLowWaterCallback;
 
 	/// Create a new client - in unconnected state, call ::connect to initiate connection
 	/// @param isHeartbeat create the client in heartbeat mode
@@ -108,23 +182,158 @@ public:
 	/// Send data with size, the data will be copied inside and can be safely freed after the function returns
 	/// @data - pointer to bytes
 	/// @size - number of bytes in data
-	void send(const void *data, int size);
+	void send(const void *data, size_t size);
 
 	/// Send message while also stealing it's content
+	/// This ignores the high water mark, so it never blocks or fails
 	/// @message - the message to send, after the function returns, callee's message is empty
 	void send(zmq::message_t && message);
 
+	/// Send multipart message (payload and external frames) while also stealing it's content
+	/// This ignores the high water mark, so it never blocks or fails
+	/// @message - the message to send, after the function returns, callee's message is empty
+	void send(MessageParts && message);
+
+	/// Send message only if the queue is under the high water mark
+	/// @message - the message to send, it is stolen only if the function returns true
+	/// @return - false if the message was not queued because the queue is full, the low water callback follows
+	bool trySend(MessageParts && message);
+
+	/// Send message, blocking until the queue is under the high water mark
+	/// Must not be called from the callbacks since they run on the thread that drains the queue
+	/// @message - the message to send, it is stolen only if the function returns true
+	/// @timeout - max time to wait in milliseconds, negative to wait until the client stops
+	/// @return - false if the message was not queued because of timeout or the client stopped
+	bool sendBlocking(MessageParts && message, int timeout = -1);
+
+	/// Start sending a POD list property (int, float, color, vector, matrix, transform lists) in pieces as the
+	/// items are produced, for lists too big to be built in memory at once. Pieces wait for queue space like
+	/// sendBlocking, so with queue limits set only about @pieceSize bytes per stream are in memory here.
+	/// The receiver assembles the list and handles it as a normal property update, server must understand chunks
+	/// Updates and patches of the same property sent while the stream is not finished are held back and queued
+	/// after its last piece, so the server never overwrites them with the older streamed value
+	/// @count - exact number of items that will be written in the stream, lists of 2GB or more need WireFormat::V2
+	/// @pieceSize - max size of one piece in bytes
+	template <typename T>
+	PropertyStream<T> streamProperty(const std::string & plugin, const std::string & property, size_t count, int pieceSize = DEFAULT_CHUNK_SIZE);
+
+	/// Set byte limits for the outgoing queue, used by trySend and sendBlocking
+	/// @highWaterMark - trySend and sendBlocking queue messages until the queued bytes reach this, 0 for no limit;
+	///                 the message reaching it is still accepted, so the queue can go over by one message
+	/// @lowWaterMark - blocked senders resume and the low water callback is called when queue drops to this size
+	void setQueueLimits(size_t highWaterMark, size_t lowWaterMark);
+
+	/// Set a callback called once the queue drains to the low water mark after it had reached the high water mark
+	/// The callback is called from the worker thread and must not block on sending
+	void setLowWaterCallback(ZmqOnLowWaterCallback cb);
+
 	/// Set a callback to be called on message received (messages discarded if not set)
 	void setCallback(ZmqOnMessageCallback cb);
 
+	/// Call the callback on @count dispatcher threads instead of the worker thread, so a slow callback
+	/// does not delay pings and sends. Messages for the same plugin are still handled in the order received,
+	/// messages without plugin (images, logs, renderer changes) are handled in order on a single thread
+	/// Must be called before connect, the callback must be safe to call concurrently for different plugins
+	/// Combine with VRayMessage::ParseLazyValue to also move value decoding to the dispatcher threads
+	/// @count - number of dispatcher threads, 0 calls the callback on the worker thread (default)
+	void setDispatchThreads(int count);
+
+	/// Deliver only the newest RT image when the callback falls behind, older queued RtImageUpdate messages
+	/// with the same channels are dropped before their images are decoded (if ParseLazyValue is set)
+	/// Bucket and final images are always delivered. Works on the dispatch queue, so needs setDispatchThreads,
+	/// with the callback on the worker thread no messages are queued in the client
+	void setImageConflation(bool flag);
+
+	/// Get the dispatch queue depth and callback latency counters, all zero if there are no dispatcher threads
+	DispatchStats getDispatchStats() const;
+
+	/// Set how received messages are parsed before passed to the callback
+	/// @flags - combination of VRayMessage::ParseFlags, ParseViewData avoids copying big lists and images,
+	///          ParseLazyValue leaves the value decoding to whoever calls getValue on the message
+	void setParseFlags(int flags);
+
+	/// Enable packing of small messages in one DATA_BATCH_MSG frame, server must understand batches
+	/// A batch is sent when it reaches @maxBytes or when its oldest message waited @maxDelay
+	/// @maxBytes - byte threshold, messages this size or bigger are sent alone, 0 disables batching
+	/// @maxDelay - time threshold in milliseconds, 0 sends the batch as soon as the queue is drained
+	void setBatching(int maxBytes = DEFAULT_BATCH_MAX_BYTES, int maxDelay = DEFAULT_BATCH_MAX_DELAY);
+
+	/// Enable replacing of still queued property updates with newer values for the same plugin and property
+	/// The newer value takes the place of the queued one, any other message (create, remove, renderer actions)
+	/// is a barrier - updates queued before it are never replaced by updates sent after it
+	void setConflation(bool flag);
+
+	/// Send interactive renderer messages (stop, pause, resume, resize, renderer state, camera, quality, regions, vfb)
+	/// on a control lane ahead of queued plugin data, and split data messages bigger than @chunkSize in
+	/// DATA_CHUNK_MSG pieces so control messages can go between them. Server must understand chunks
+	/// Each lane keeps its order, other renderer actions (init, start, frame changes, export) stay in the data lane
+	/// After MAX_CONTROL_BURST control messages one data message or piece is sent if any is waiting
+	/// @enable - true to use two lanes, false for a single FIFO
+	/// @chunkSize - max piece size in bytes, 0 to never split
+	void setPriorityLanes(bool enable, int chunkSize = DEFAULT_CHUNK_SIZE);
+
+	/// Offer compression of big data messages to the server, it picks one of the codecs in the handshake
+	/// Messages are compressed by the thread sending them before they are queued, so the worker never holds
+	/// pings and control messages back behind a big compression. Each one that is at least @minBytes and gets
+	/// smaller is sent as DATA_COMPRESSED_MSG, all others as usual. Queued messages count with their sent size
+	/// Must be called before connect, server must understand it
+	/// @codecs - mask of CompressionCodec values, only the ones in PayloadCompression::supportedCodecs are offered
+	/// @minBytes - messages smaller than this are never compressed
+	/// @level - zstd compression level, ignored by LZ4
+	void setCompression(int codecs, int minBytes = DEFAULT_COMPRESSION_MIN_BYTES, int level = 1);
+
+	/// Get the codec picked by the server, CompressionCodec::None before the handshake or if none was picked
+	CompressionCodec getCompression() const;
+
+	/// Offer a newer WireFormat to the server, it answers with the newest one it reads up to @format
+	/// Messages are in it only if made with getMessageFormat after the handshake, V1 messages are always valid
+	/// Must be called before connect
+	void setWireFormat(WireFormat format);
+
+	/// Get the WireFormat picked by the server, WireFormat::V1 before the handshake or if none was offered
+	WireFormat getWireFormat() const;
+
+	/// Get the format to pass to the VRayMessage::msg* methods for messages sent with this client
+	/// Each client has its own, so clients connected to different servers can be used together
+	/// Messages made with it must be sent only with this client, their payloads are in PayloadPool blocks
+	MessageFormat getMessageFormat() const;
+
+	/// Get the mask of ProtocolFeature accepted by the server, 0 before the handshake
+	int getFeatures() const;
+
+	/// Send the external frames (big lists) of data messages by content hash, so a value already sent in this
+	/// session (a shared mesh, a repeated texture buffer) is sent as a 40 byte FrameRef instead of its data
+	/// Messages are sent as DATA_HASHED_MSG, the server keeps received frames in a FrameStore and asks for
+	/// missing ones with FRAME_REQUEST_MSG, see FrameDedup. Messages are hashed by the thread sending them, which
+	/// also copies each frame not in the store yet, so the store can keep it after the lists it came from change
+	/// The worker decides which frames are referenced when it sends the message. Hashed messages are not compressed
+	/// Must be called before connect, server must understand it
+	/// @minBytes - messages are hashed only if all their external frames are at least this big, 0 to disable
+	/// @storeBytes - memory for remembering sent frames, should be at least as big as the cache of the server,
+	///               else frames it requests may already be dropped here and have to be sent again in full
+	void setDeduplication(size_t minBytes = DEFAULT_DEDUP_MIN_BYTES, size_t storeBytes = DEFAULT_DEDUP_STORE_BYTES);
+
+	/// Offer ProtocolFeature::StringInterning to the server, if it accepts getMessageFormat makes messages with
+	/// plugin, type and property names sent as ids of a per session table, each name is sent in full only until
+	/// a message defining it is queued. A message defining names is never conflated, so no definition is lost
+	/// The server parses with a SessionStringTable. Must be called before connect
+	void setStringInterning(bool enable);
+
+	/// Offer ProtocolFeature::ListPatches to the server, if it accepts getMessageFormat allows ListDeltaEncoder
+	/// to send changed list items as PluginAction::Patch messages. Must be called before connect
+	void setListPatches(bool enable);
+
 	/// Set or clear flag to flush outstanding messages on stop/exit
 	void setFlushOnExit(bool flag);
 	/// Check the flush on exit flag
 	bool getFlushOnexit() const;
 
-	/// Get number of messages that are yet to be sent to server
+	/// Get number of messages that are yet to be sent to server, safe to call from any thread
 	int getOutstandingMessages() const;
 
+	/// Get number of payload bytes that are yet to be sent to server, safe to call from any thread
+	size_t getOutstandingBytes() const;
+
 	/// Check if the worker is serving
 	bool good() const;
 
@@ -150,20 +359,195 @@ private:
 
 	typedef std::chrono::high_resolution_clock::time_point time_point;
 
+	/// Queued property update that newer updates for the same key replace until the worker takes it
+	struct ConflationSlot {
+		MessageParts message; ///< The newest value
+		ControlMessage control; ///< DATA_MSG, or DATA_COMPRESSED_MSG if @message is compressed
+		std::string key; ///< Key in @conflationIndex
+	};
+
+	/// Item of @messageQue - either a message or a conflation slot
+	struct QueueItem {
+		QueueItem(): control(ControlMessage::DATA_MSG) {}
+		explicit QueueItem(MessageParts && message, ControlMessage control = ControlMessage::DATA_MSG)
+		    : message(std::move(message))
+		    , control(control)
+		{}
+		explicit QueueItem(std::shared_ptr<ConflationSlot> slot)
+		    : slot(std::move(slot))
+		    , control(ControlMessage::DATA_MSG)
+		{}
+
+		MessageParts message; ///< The message, empty until resolved by workerFront if @slot is set
+		std::shared_ptr<ConflationSlot> slot; ///< The slot if the message is a conflated update
+		ControlMessage control; ///< DATA_MSG, DATA_COMPRESSED_MSG, DATA_HASHED_MSG, FRAME_BODY_MSG, or DATA_CHUNK_MSG for pieces of streamed messages
+	};
+
+	/// Property that is being streamed, see streamProperty
+	struct StreamedProperty {
+		StreamedProperty(): streams(0) {}
+
+		int streams; ///< Number of unfinished streams of the property
+		std::vector<std::pair<std::string, QueueItem>> held; ///< Updates sent while streaming with their conflation keys
+	};
+
+	template <typename T>
+	friend class PropertyStream;
+
 	/// Start function for the worker thread (sends and receives messages)
 	void workerThread(volatile bool & socketInit, std::mutex & mtx, std::condition_variable & workerReady);
 	/// Send any outstanding messages
 	bool workerSendoutMessages(time_point & lastHBSend);
+	/// Send the payload and external frames of a message, the control frame must be already sent
+	/// @return - false if any of the frames could not be sent
+	bool workerSendParts(MessageParts & message);
+	/// Send a whole message with its control frame and release its bytes
+	/// @return - false if the message could not be sent and is still pending, or if the client failed
+	bool workerSendMessage(MessageParts & message, ControlMessage control, time_point & lastHBSend);
+	/// Send the next piece of @chunkMessage, resets it after the last piece
+	/// @return - false if the piece could not be sent and is still pending, or if the client failed
+	bool workerSendChunk(time_point & lastHBSend);
+	/// Stop the client after a frame following an already sent control frame could not be sent
+	/// The server would take the next message for the missing frames, so nothing more is sent on the socket
+	/// The message stays in the queue and its bytes are not released
+	void workerSendFailed(const char * what);
+	/// zmq free function for sent pieces, @hint is heap allocated std::shared_ptr<MessageParts>
+	static void releaseChunk(void * data, void * hint);
+	/// Received message being assembled from DATA_CHUNK_MSG pieces
+	struct ChunkAssembly {
+		ChunkAssembly(): frameCount(0), nextFrame(0), nextOffset(0) {}
+
+		MessageParts message; ///< Frames received so far, the last one may be partial
+		int frameCount; ///< ChunkHeader::frameCount of the first piece
+		int nextFrame; ///< Frame the next piece must belong to
+		uint64_t nextOffset; ///< Offset the next piece must start at
+	};
+
+	/// Add received DATA_CHUNK_MSG piece to @chunkRecv and dispatch the message when complete
+	void workerReceiveChunk(const zmq::message_t & header, zmq::message_t & piece);
+	/// Dispatch a received DATA_MSG, or DATA_COMPRESSED_MSG after restoring it
+	void workerReceiveData(ControlMessage control, MessageParts & message);
+	/// Send the current batch if there is one
+	/// @return - false if the batch could not be sent and is still pending
+	bool workerFlushBatch(time_point & lastHBSend);
+	/// Check if the current batch reached any of the thresholds
+	bool workerBatchDue(const time_point & now) const;
+	/// Get the front item of the queue, takes the message out of its conflation slot if any
+	/// @return - nullptr if the queue is empty, pointer is valid until the item is popped
+	QueueItem * workerFront();
+	/// Call the callback for a received data message
+	void workerDispatch(MessageParts & message);
+	/// Account for @size bytes leaving the queue, wakes blocked senders when low water mark is reached
+	void workerReleaseBytes(size_t size);
+	/// Check if the queued bytes are under the high water mark
+	bool underHighWater() const;
+	/// Check if message goes in the control lane when priority lanes are enabled
+	static bool isControlMessage(const MessageParts & message);
+	/// Block until the queued bytes are under the high water mark
+	/// @timeout - max time to wait in milliseconds, negative to wait until the client stops
+	/// @return - false on timeout or if the client stopped
+	bool waitForQueueSpace(int timeout);
+	/// Queue a piece of a streamed message, blocks until it fits in the queue
+	/// @return - false if the client stopped
+	bool sendChunk(const ChunkHeader & header, zmq::message_t && piece);
+	/// Add message to the queue and wake up the worker, hashes or compresses data messages
+	/// @control - DATA_MSG for normal messages, DATA_CHUNK_MSG for pieces made by sendChunk
+	void enqueue(MessageParts && message, ControlMessage control = ControlMessage::DATA_MSG);
+	/// Add data message with counted bytes to @messageQue, through the conflation index if @conflate
+	/// @key - key made by getConflationKey, empty if the message is a conflation barrier
+	void pushData(QueueItem && item, bool conflate, std::string && key);
+	/// Keep @item in @streamedProperties if the property with @key is being streamed
+	/// @return - true if @item was taken
+	bool holdForStream(const std::string & key, std::string & conflationKey, QueueItem & item);
+	/// Start holding back updates of the property with @key, called before the first piece of a stream is queued
+	void beginStream(const std::string & key);
+	/// Queue the updates held back while the property with @key was streamed, called after the last piece
+	void endStream(const std::string & key);
+	/// Add message to the queue or replace a queued update with the same plugin and property
+	/// @key - key made by getConflationKey, empty if the message is a conflation barrier
+	void enqueueConflated(MessageParts && message, ControlMessage control, std::string && key);
+	/// Get the key in @conflationIndex of a property update
+	/// @return - false if the message is not a property update
+	bool getConflationKey(const MessageParts & message, std::string & key) const;
+	/// Get the key of the property changed by a property update or patch, same as getConflationKey makes
+	/// @return - false if the message is not a property update or patch
+	bool getPropertyKey(const MessageParts & message, std::string & key, VRayMessage::PluginAction & action) const;
+	/// Make the key of @property of @plugin
+	static std::string makePropertyKey(const std::string & plugin, const std::string & property);
+	/// Compress message in place if it is big enough and compression was negotiated
+	/// @return - the control for the message - DATA_COMPRESSED_MSG if compressed, else DATA_MSG
+	ControlMessage compressMessage(MessageParts & message);
+	/// Reference the frames of a hashed message that the server already has, accounting for its new size
+	/// Done in the order messages are sent, so a frame is inlined by the first message sent with it, not the
+	/// first one queued
+	void workerFinishHashed(QueueItem & item);
+	/// Queue FRAME_BODY_MSG for each hash in a received FRAME_REQUEST_MSG
+	void workerAnswerFrameRequest(const zmq::message_t & request);
+	/// Close the wakeup sockets, after this wakeupWorker is a no-op
+	void closeWakeupSockets();
+	/// Signal the worker that there is new work, only the first call until the worker drains the signal sends anything
+	void wakeupWorker();
 
 	const ClientType clientType; ///< The type of this client (heartbeat or exporter)
 	ZmqOnMessageCallback callback; ///< Callback to be called on received message
-	std::mutex callbackMutex; ///< Mutex protecting @callback
+	ZmqOnLowWaterCallback lowWaterCallback; ///< Callback to be called when queue drains to @lowWaterMark
+	std::mutex callbackMutex; ///< Mutex protecting @callback and @lowWaterCallback
+	std::unique_ptr<MessageDispatcher> dispatcher; ///< Calls @callback off the worker thread if set
+	bool conflateImages; ///< Passed to @dispatcher when created
 
 	std::thread worker; ///< Thread serving messages and calling the callback
 
 	zmq::context_t context; ///< The zmq context
-	std::deque<zmq::message_t> messageQue; ///< Queue with outstanding messages
-	std::mutex messageMutex; ///< Mutex protecting @messageQue
+	MPSCQueue<QueueItem> messageQue; ///< Queue with outstanding messages, any thread pushes, worker pops
+	MPSCQueue<QueueItem> controlQue; ///< Control lane, sent before @messageQue if @priorityLanes
+
+	std::atomic<bool> priorityLanes; ///< If true control messages go in @controlQue
+	std::atomic<int> chunkSize; ///< Max size of sent pieces if @priorityLanes, 0 to never split
+	int controlBurst; ///< Control messages sent in a row while data is waiting, used only by the worker
+	std::shared_ptr<MessageParts> chunkMessage; ///< Message being sent in pieces, shared with the pieces, used only by the worker
+	std::atomic<int> chunkMessages; ///< 1 while @chunkMessage is being sent, for getOutstandingMessages
+	size_t chunkBytes; ///< Size of @chunkMessage, released after the last piece
+	uint32_t chunkId; ///< ChunkHeader::messageId of @chunkMessage
+	ControlMessage chunkControl; ///< ChunkHeader::control of @chunkMessage
+	std::atomic<uint32_t> nextChunkId; ///< Id for the next chunked message or stream
+	int chunkFrame; ///< Frame of the next piece, 0 for payload
+	size_t chunkOffset; ///< Offset of the next piece in its frame
+	std::unordered_map<uint32_t, ChunkAssembly> chunkRecv; ///< Received messages being assembled by id, used only by the worker
+
+	std::mutex streamMutex; ///< Protects @streamedProperties
+	std::unordered_map<std::string, StreamedProperty> streamedProperties; ///< Properties being streamed by property key
+	std::atomic<int> activeStreams; ///< Number of unfinished streams, other updates are checked only if not 0
+
+	int offeredCodecs; ///< Mask of CompressionCodec sent in the handshake
+	std::atomic<CompressionCodec> compressionCodec; ///< Codec picked by the server
+	std::atomic<int> compressionMinBytes; ///< Smallest message size to compress
+	std::atomic<int> compressionLevel; ///< Level passed to the codec
+	WireFormat offeredWireFormat; ///< Newest WireFormat sent in the handshake
+	std::atomic<WireFormat> wireFormat; ///< WireFormat picked by the server
+
+	size_t dedupMinBytes; ///< Smallest external frame size to hash, 0 if deduplication is disabled
+	std::unique_ptr<FrameStore> dedupStore; ///< Frames sent so far, used by enqueue and the worker
+	int offeredFeatures; ///< Mask of ProtocolFeature sent in the handshake
+	std::atomic<int> features; ///< Mask of ProtocolFeature accepted by the server
+	std::shared_ptr<SessionStringEncoder> stringEncoder; ///< Names of the session if StringInterning is offered
+
+	std::atomic<bool> conflation; ///< If true property updates are conflated
+	std::mutex conflationMutex; ///< Protects @conflationIndex and the content of the slots in it
+	std::unordered_map<std::string, std::shared_ptr<ConflationSlot>> conflationIndex; ///< Queued slots by plugin and property
+
+	std::atomic<int> batchMaxBytes; ///< Size threshold for batching, 0 if batching is disabled
+	std::atomic<int> batchMaxDelay; ///< Time threshold in milliseconds for batching
+	std::atomic<int> batchMessages; ///< Number of messages popped from @messageQue in the current batch
+	SerializerStream batchStream; ///< The current batch, used only by the worker
+	size_t batchPayloadBytes; ///< Sum of the payload sizes in @batchStream, used only by the worker
+	time_point batchBegin; ///< Time the first message was added to @batchStream
+
+	std::atomic<size_t> queuedBytes; ///< Bytes in @messageQue and the current batch
+	std::atomic<size_t> highWaterMark; ///< Max value for @queuedBytes allowed by trySend and sendBlocking, 0 for no limit
+	std::atomic<size_t> lowWaterMark; ///< Value of @queuedBytes at which blocked senders are woken
+	std::atomic<bool> highWaterReached; ///< Set when the queued bytes reach the high water mark, cleared at the low
+	std::mutex queueSpaceMutex; ///< Mutex for @queueSpaceCond
+	std::condition_variable queueSpaceCond; ///< Signaled when the queue drains to the low water mark or worker stops
 
 	std::condition_variable startServingCond; ///< Cond var to signal the worker thread to start serving
 	std::mutex startServingMutex; ///< Mutex protecting @startServing flag
@@ -171,23 +555,63 @@ private:
 
 	std::atomic<bool> startServing; ///< Used to signal worker, the socket is connected and serving can start
 	std::atomic<bool> isWorking; ///< Flag set to true if the thread is serving requests
+	bool sendFailed; ///< Set by workerSendFailed, the socket is in the middle of a message, used only by the worker
 	std::atomic<bool> errorConnect; ///< Flag set to true if we could not connect
 	std::atomic<bool> flushOnExit; ///< If true when worker is stopping for any reason, outstanding messages will be sent
 	std::atomic<bool> serverStop; ///< If true will stop transmitting messages and send 'stop' command to server
+	std::atomic<int> parseFlags; ///< VRayMessage::ParseFlags used for received messages
 
 	std::unique_ptr<zmq::socket_t> frontend; ///< The zmq socket
+
+	std::unique_ptr<zmq::socket_t> wakeupRecv; ///< Inproc socket polled by the worker together with @frontend
+	std::unique_ptr<zmq::socket_t> wakeupSend; ///< Inproc socket used by other threads to wake the worker
+	std::mutex wakeupMutex; ///< Mutex protecting @wakeupSend, taken only when a signal is actually sent
+	std::atomic<bool> wakeupPending; ///< True if a signal was sent and the worker did not drain it yet
 };
 
 
 inline ZmqClient::ZmqClient(bool isHeartbeat)
     : clientType(isHeartbeat ? ClientType::Heartbeat : ClientType::Exporter)
+    , conflateImages(false)
     , context(1)
+    , priorityLanes(false)
+    , chunkSize(0)
+    , controlBurst(0)
+    , chunkMessages(0)
+    , chunkBytes(0)
+    , chunkId(0)
+    , chunkControl(ControlMessage::DATA_MSG)
+    , nextChunkId(0)
+    , chunkFrame(0)
+    , chunkOffset(0)
+    , activeStreams(0)
+    , offeredCodecs(0)
+    , compressionCodec(CompressionCodec::None)
+    , compressionMinBytes(DEFAULT_COMPRESSION_MIN_BYTES)
+    , compressionLevel(1)
+    , offeredWireFormat(WireFormat::V1)
+    , wireFormat(WireFormat::V1)
+    , dedupMinBytes(0)
+    , offeredFeatures(0)
+    , features(0)
+    , conflation(false)
+    , batchMaxBytes(0)
+    , batchMaxDelay(DEFAULT_BATCH_MAX_DELAY)
+    , batchMessages(0)
+    , batchPayloadBytes(0)
+    , queuedBytes(0)
+    , highWaterMark(0)
+    , lowWaterMark(0)
+    , highWaterReached(false)
     , startServing(false)
     , isWorking(true)
+    , sendFailed(false)
     , errorConnect(false)
     , flushOnExit(false)
     , serverStop(false)
+    , parseFlags(VRayMessage::ParseDefault)
     , frontend(nullptr)
+    , wakeupPending(false)
 {
 
 	bool socketInit = false;
@@ -213,10 +637,27 @@ inline void ZmqClient::workerThread(volatile bool & socketInit, std::mutex & mtx
 		int wait = HEARBEAT_TIMEOUT;
 		this->frontend->setsockopt(ZMQ_SNDTIMEO, &wait, sizeof(wait));
 
+		char wakeupAddr[64];
+		snprintf(wakeupAddr, sizeof(wakeupAddr), "inproc://zmq-client-wakeup-%p", static_cast<void*>(this));
+		// inproc requires bind before connect
+		this->wakeupRecv = std::unique_ptr<zmq::socket_t>(new zmq::socket_t(context, ZMQ_PAIR));
+		this->wakeupRecv->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+		this->wakeupRecv->bind(wakeupAddr);
+		{
+			std::lock_guard<std::mutex> wakeupLock(wakeupMutex);
+			this->wakeupSend = std::unique_ptr<zmq::socket_t>(new zmq::socket_t(context, ZMQ_PAIR));
+			this->wakeupSend->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+			this->wakeupSend->connect(wakeupAddr);
+		}
+
 		std::lock_guard<std::mutex> lock(mtx);
 		socketInit = true;
 	} catch (zmq::error_t & e) {
 		printf("ZMQ exception while worker initialization: %s\n", e.what());
+		if (this->frontend) {
+			this->frontend->close();
+		}
+		closeWakeupSockets();
 		this->isWorking = false;
 		workerReady.notify_all();
 		return;
@@ -232,7 +673,12 @@ inline void ZmqClient::workerThread(volatile bool & socketInit, std::mutex & mtx
 
 	std::shared_ptr<void> atScopeExit(nullptr, [this] (void *) {
 		this->frontend->close();
+		closeWakeupSockets();
 		this->isWorking = false;
+		{
+			std::lock_guard<std::mutex> lock(queueSpaceMutex);
+		}
+		queueSpaceCond.notify_all();
 	});
 
 	if (this->errorConnect) {
@@ -248,7 +694,20 @@ inline void ZmqClient::workerThread(volatile bool & socketInit, std::mutex & mtx
 		} else {
 			frontend->send(ControlFrame::make(clientType, ControlMessage::HEARTBEAT_CONNECT_MSG), ZMQ_SNDMORE);
 		}
-		this->frontend->send(emptyFrame);
+		if (clientType == ClientType::Exporter && this->offeredFeatures) {
+			// [codecs][wire format][features]
+			const int offer[3] = {this->offeredCodecs, static_cast<int>(this->offeredWireFormat), this->offeredFeatures};
+			this->frontend->send(zmq::message_t(offer, sizeof(offer)));
+		} else if (clientType == ClientType::Exporter && this->offeredWireFormat != WireFormat::V1) {
+			// [codecs][wire format], servers that know neither ignore the offer and answer with empty frame
+			const int offer[2] = {this->offeredCodecs, static_cast<int>(this->offeredWireFormat)};
+			this->frontend->send(zmq::message_t(offer, sizeof(offer)));
+		} else if (clientType == ClientType::Exporter && this->offeredCodecs) {
+			// servers that do not compress ignore the offer and answer with empty frame
+			this->frontend->send(zmq::message_t(&this->offeredCodecs, sizeof(this->offeredCodecs)));
+		} else {
+			this->frontend->send(emptyFrame);
+		}
 	} catch (zmq::error_t & ex) {
 		printf("ZMQ failed to send handshake [%s]\n", ex.what());
 		return;
@@ -285,6 +744,26 @@ inline void ZmqClient::workerThread(volatile bool & socketInit, std::mutex & mtx
 				puts("ZMQ server responded with different than renderer created!");
 				return;
 			}
+			// [codec], [codec][wire format] or [codec][wire format][features]
+			int answer[3] = {0, static_cast<int>(WireFormat::V1), 0};
+			if (emptyMsg.size() == sizeof(answer[0]) || emptyMsg.size() == 2 * sizeof(answer[0]) || emptyMsg.size() == sizeof(answer)) {
+				memcpy(answer, emptyMsg.data(), emptyMsg.size());
+			}
+			const int codec = answer[0];
+			if (codec & (codec - 1) || (codec & ~this->offeredCodecs)) {
+				printf("ZMQ server picked compression codec [%d] that was not offered, not compressing.\n", codec);
+			} else {
+				this->compressionCodec = static_cast<CompressionCodec>(codec);
+			}
+			if (answer[1] < static_cast<int>(WireFormat::V1) || answer[1] > static_cast<int>(this->offeredWireFormat)) {
+				printf("ZMQ server picked wire format [%d] that was not offered, using V1.\n", answer[1]);
+			} else {
+				this->wireFormat = static_cast<WireFormat>(answer[1]);
+			}
+			if (answer[2] & ~this->offeredFeatures) {
+				printf("ZMQ server accepted protocol features [%d] that were not offered, ignoring them.\n", answer[2] & ~this->offeredFeatures);
+			}
+			this->features = answer[2] & this->offeredFeatures;
 		} else {
 			if (frame.control != ControlMessage::HEARTBEAT_CREATE_MSG) {
 				puts("ZMQ server responded with different than heartbeat created!");
@@ -302,27 +781,77 @@ inline void ZmqClient::workerThread(volatile bool & socketInit, std::mutex & mtx
 	// ensure we send one HB immediately
 	auto lastHBSend = lastHBRecv - std::chrono::milliseconds(HEARBEAT_TIMEOUT * 2);
 
-	zmq::pollitem_t pollContext = {*this->frontend, 0, ZMQ_POLLIN | ZMQ_POLLOUT, 0};
+	zmq::pollitem_t pollItems[2] = {
+		{*this->frontend, 0, ZMQ_POLLIN, 0},
+		{*this->wakeupRecv, 0, ZMQ_POLLIN, 0},
+	};
 
 	while (isWorking) {
-		bool didWork = false;
-		auto now = std::chrono::high_resolution_clock::now();
+		using namespace std::chrono;
+		auto now = high_resolution_clock::now();
+
+		// block until there is something to receive, something to send or the ping/heartbeat timers expire
+		const long sinceHBSend = static_cast<long>(duration_cast<milliseconds>(now - lastHBSend).count());
+		const bool pingDue = sinceHBSend > CLIENT_PING_INTERVAL;
+		long timeout = pingDue ? CLIENT_PING_INTERVAL : CLIENT_PING_INTERVAL - sinceHBSend + 1;
+		if (clientType == ClientType::Heartbeat) {
+			const long sinceHBRecv = static_cast<long>(duration_cast<milliseconds>(now - lastHBRecv).count());
+			timeout = std::min(timeout, std::max(0L, HEARBEAT_TIMEOUT - sinceHBRecv + 1));
+		}
+
+		bool wantSend = pingDue || !messageQue.empty() || !controlQue.empty() || chunkMessages;
+		if (batchMessages) {
+			const long batchAge = static_cast<long>(duration_cast<milliseconds>(now - batchBegin).count());
+			wantSend = wantSend || workerBatchDue(now);
+			timeout = std::min(timeout, std::max(0L, batchMaxDelay - batchAge));
+		}
+
+		pollItems[0].events = ZMQ_POLLIN | (wantSend ? ZMQ_POLLOUT : 0);
+		pollItems[0].revents = pollItems[1].revents = 0;
 
 		try {
-			zmq::poll(&pollContext, 1, 10);
+			zmq::poll(pollItems, 2, timeout);
 		} catch (zmq::error_t & ex) {
-			printf("ZMQ failed [%s] zmq::poll - stopping client.\n", ex.what());
+			// context closed by syncStop while we were waiting - not an error
+			if (ex.num() != ETERM || isWorking) {
+				printf("ZMQ failed [%s] zmq::poll - stopping client.\n", ex.what());
+			}
 			return;
 		}
 
-		if (pollContext.revents & ZMQ_POLLIN) {
-			didWork = true;
+		if (pollItems[1].revents & ZMQ_POLLIN) {
+			try {
+				zmq::message_t signal;
+				while (wakeupRecv->recv(&signal, ZMQ_DONTWAIT)) {}
+			} catch (zmq::error_t & ex) {
+				printf("ZMQ failed [%s] reading wakeup signal - stopping client.\n", ex.what());
+				return;
+			}
+			// clear after draining, so any send() from now on will signal again
+			// acq_rel pairs with the exchange in wakeupWorker and makes the pushed messages visible here
+			wakeupPending.exchange(false, std::memory_order_acq_rel);
+		}
 
+		if (pollItems[0].revents & ZMQ_POLLIN) {
 			for (int c = 0; c < MAX_CONSEQ_MESSAGES && isWorking; ++c) {
-				zmq::message_t controlMsg, payloadMsg;
+				zmq::message_t controlMsg;
+				MessageParts dataMsg;
+				zmq::message_t & payloadMsg = dataMsg.payload;
 				try {
-					this->frontend->recv(&controlMsg);
+					if (!this->frontend->recv(&controlMsg, ZMQ_DONTWAIT)) {
+						break;
+					}
 					this->frontend->recv(&payloadMsg);
+
+					// external frames of the data message, if any
+					int more = 0;
+					size_t moreSize = sizeof(more);
+					this->frontend->getsockopt(ZMQ_RCVMORE, &more, &moreSize);
+					while (more) {
+						dataMsg.external.emplace_back();
+						this->frontend->recv(&dataMsg.external.back());
+						this->frontend->getsockopt(ZMQ_RCVMORE, &more, &moreSize);
+					}
 				} catch (zmq::error_t & ex) {
 					printf("ZMQ failed [%s] zmq::socket_t::recv - stopping client.\n", ex.what());
 					return;
@@ -340,12 +869,27 @@ inline void ZmqClient::workerThread(volatile bool & socketInit, std::mutex & mtx
 					continue;
 				}
 
-				lastHBRecv = std::chrono::high_resolution_clock::now();
+				lastHBRecv = high_resolution_clock::now();
 
 				if (frame.control == ControlMessage::DATA_MSG) {
-					std::lock_guard<std::mutex> cbLock(callbackMutex);
-					if (this->callback) {
-						this->callback(VRayMessage::fromZmqMessage(payloadMsg), this);
+					workerDispatch(dataMsg);
+				} else if (frame.control == ControlMessage::DATA_COMPRESSED_MSG) {
+					workerReceiveData(frame.control, dataMsg);
+				} else if (frame.control == ControlMessage::FRAME_REQUEST_MSG) {
+					workerAnswerFrameRequest(payloadMsg);
+				} else if (frame.control == ControlMessage::DATA_CHUNK_MSG) {
+					if (dataMsg.external.size() != 1) {
+						puts("ZMQ received chunk without data, dropping it.");
+					} else {
+						workerReceiveChunk(payloadMsg, dataMsg.external[0]);
+					}
+				} else if (frame.control == ControlMessage::DATA_BATCH_MSG) {
+					const bool valid = MessageBatch::forEach(payloadMsg, [this] (const char * data, int size) {
+						MessageParts part(zmq::message_t(data, size));
+						workerDispatch(part);
+					});
+					if (!valid) {
+						puts("ZMQ received malformed batch, dropping the rest of it.");
 					}
 				} else if (frame.control == ControlMessage::PING_MSG) {
 					if (payloadMsg.size() != 0) {
@@ -356,34 +900,23 @@ inline void ZmqClient::workerThread(volatile bool & socketInit, std::mutex & mtx
 						puts("ZMQ missing empty frame after pong");
 					}
 				}
-
-				int more = 0;
-				size_t more_size = sizeof (more);
-				try {
-					frontend->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-				} catch (zmq::error_t & ex) {
-					printf("ZMQ failed [%s] zmq::socket_t::getsockopt.\n", ex.what());
-				}
-				if (!more) {
-					break;
-				}
 			}
 		}
 
-		if (pollContext.revents & ZMQ_POLLOUT) {
+		if (pollItems[0].revents & ZMQ_POLLOUT) {
 			try {
-				now = std::chrono::high_resolution_clock::now();
+				now = high_resolution_clock::now();
 				// we havent sent messages in a while - ping server
-				if (std::chrono::duration_cast<std::chrono::milliseconds>(now - lastHBSend).count() > CLIENT_PING_INTERVAL) {
-					bool sent = frontend->send(ControlFrame::make(clientType, ControlMessage::PING_MSG), ZMQ_SNDMORE);
-					if (sent) {
-						sent = frontend->send(emptyFrame);
+				if (duration_cast<milliseconds>(now - lastHBSend).count() > CLIENT_PING_INTERVAL) {
+					if (frontend->send(ControlFrame::make(clientType, ControlMessage::PING_MSG), ZMQ_SNDMORE)) {
+						if (!frontend->send(emptyFrame)) {
+							workerSendFailed("ping");
+							return;
+						}
 						lastHBSend = now;
-						didWork = true;
 					}
 				}
 
-				didWork = didWork || !messageQue.empty();
 				workerSendoutMessages(lastHBSend);
 			} catch (zmq::error_t & ex) {
 				printf("ZMQ failed [%s] zmq::socket_t::send - stopping client.\n", ex.what());
@@ -391,17 +924,16 @@ inline void ZmqClient::workerThread(volatile bool & socketInit, std::mutex & mtx
 			}
 		}
 
-		if (clientType == ClientType::Heartbeat && std::chrono::duration_cast<std::chrono::milliseconds>(now - lastHBRecv).count() > HEARBEAT_TIMEOUT) {
+		now = high_resolution_clock::now();
+		if (clientType == ClientType::Heartbeat && duration_cast<milliseconds>(now - lastHBRecv).count() > HEARBEAT_TIMEOUT) {
 			puts("ZMQ server unresponsive, stopping client");
 			return;
 		}
-
-		if (!didWork && isWorking) {
-			std::this_thread::sleep_for(std::chrono::milliseconds(1));
-		}
 	}
 
-	if (serverStop) {
+	if (sendFailed) {
+		// the socket is in the middle of a message, anything sent now would be read as part of it
+	} else if (serverStop) {
 		try {
 			int wait = 200;
 			frontend->setsockopt(ZMQ_SNDTIMEO, &wait, sizeof(wait));
@@ -415,15 +947,23 @@ inline void ZmqClient::workerThread(volatile bool & socketInit, std::mutex & mtx
 		try {
 			int wait = 200;
 			this->frontend->setsockopt(ZMQ_SNDTIMEO, &wait, sizeof(wait));
-			std::lock_guard<std::mutex> lock(this->messageMutex);
 
-			for (int c = 0; c < this->messageQue.size(); ++c) {
-				auto & msg = this->messageQue[c];
-				bool sent = frontend->send(ControlFrame::make(), ZMQ_SNDMORE);
-				sent = sent && this->frontend->send(msg);
-				if (!sent) {
+			if (!workerFlushBatch(lastHBSend)) {
+				puts("ZMQ failed to flush pending batch on exit.");
+			}
+			// the pieces of a started message must go out before anything else
+			while (this->chunkMessages && workerSendChunk(lastHBSend)) {}
+			while (QueueItem * item = this->controlQue.front()) {
+				if (!workerSendMessage(item->message, item->control, lastHBSend)) {
+					break;
+				}
+				this->controlQue.pop();
+			}
+			while (QueueItem * item = workerFront()) {
+				if (!workerSendMessage(item->message, item->control, lastHBSend)) {
 					break;
 				}
+				this->messageQue.pop();
 			}
 
 			this->frontend->close();
@@ -435,33 +975,367 @@ inline void ZmqClient::workerThread(volatile bool & socketInit, std::mutex & mtx
 
 inline bool ZmqClient::workerSendoutMessages(time_point & lastHBSend) {
 	bool didWork = false;
-	for (int c = 0; c < MAX_CONSEQ_MESSAGES && !this->messageQue.empty() && isWorking; ++c) {
-		didWork = true;
-		std::lock_guard<std::mutex> lock(this->messageMutex);
-		auto & msg = this->messageQue.front();
-
-		bool sent = frontend->send(ControlFrame::make(ClientType::Exporter, ControlMessage::DATA_MSG), ZMQ_SNDMORE);
-		if (sent) {
-			sent = frontend->send(msg);
-			// update hb send since we sent a message
-			lastHBSend = std::chrono::high_resolution_clock::now();
-			this->messageQue.pop_front();
-
-			int more = 0;
-			size_t more_size = sizeof (more);
-			frontend->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-			if (!more) {
+	const int batchBytes = this->batchMaxBytes;
+	for (int c = 0; c < MAX_CONSEQ_MESSAGES && isWorking; ) {
+		// control lane first, unless it had its share while data is waiting
+		QueueItem * control = this->controlQue.front();
+		const bool dataWaiting = this->chunkMessage || !this->messageQue.empty();
+		if (control && (!dataWaiting || this->controlBurst < MAX_CONTROL_BURST)) {
+			didWork = true;
+			++c;
+			if (!workerSendMessage(control->message, control->control, lastHBSend)) {
 				break;
 			}
-		} else {
+			this->controlQue.pop();
+			++this->controlBurst;
+			continue;
+		}
+		this->controlBurst = 0;
+
+		if (this->chunkMessage) {
+			didWork = true;
+			++c;
+			if (!workerSendChunk(lastHBSend)) {
+				break;
+			}
+			continue;
+		}
+
+		QueueItem * item = workerFront();
+		if (!item) {
+			break;
+		}
+		MessageParts * msg = &item->message;
+		const bool isData = item->control == ControlMessage::DATA_MSG;
+		const bool canSplit = isData || item->control == ControlMessage::DATA_COMPRESSED_MSG || item->control == ControlMessage::DATA_HASHED_MSG;
+		didWork = true;
+
+		// messages with external frames are big, they are never batched
+		if (isData && msg->external.empty() && msg->payload.size() < static_cast<size_t>(batchBytes)) {
+			if (this->batchStream.getSize() >= static_cast<size_t>(batchBytes)) {
+				++c;
+				if (!workerFlushBatch(lastHBSend)) {
+					break;
+				}
+			}
+			if (!this->batchMessages) {
+				this->batchBegin = std::chrono::high_resolution_clock::now();
+			}
+			MessageBatch::append(this->batchStream, msg->payload);
+			this->batchPayloadBytes += msg->payload.size();
+			// increment before pop so getOutstandingMessages never misses this message
+			++this->batchMessages;
+			this->messageQue.pop();
+			continue;
+		}
+
+		++c;
+		// everything already batched must go out before this message
+		if (!workerFlushBatch(lastHBSend)) {
 			break;
 		}
+		if (item->control == ControlMessage::DATA_HASHED_MSG) {
+			workerFinishHashed(*item);
+		}
 
+		const int pieceSize = this->priorityLanes ? this->chunkSize.load() : 0;
+		if (canSplit && pieceSize > 0 && msg->size() > static_cast<size_t>(pieceSize)) {
+			// sent piece by piece from the next iterations, so control messages can go in between
+			this->chunkBytes = msg->size();
+			this->chunkMessage = std::make_shared<MessageParts>(std::move(*msg));
+			this->chunkId = this->nextChunkId++;
+			this->chunkControl = item->control;
+			this->chunkFrame = 0;
+			this->chunkOffset = 0;
+			// increment before pop so getOutstandingMessages never misses this message
+			++this->chunkMessages;
+			this->messageQue.pop();
+			continue;
+		}
+
+		if (!workerSendMessage(*msg, item->control, lastHBSend)) {
+			break;
+		}
+		this->messageQue.pop();
+	}
+
+	if (this->batchMessages && workerBatchDue(std::chrono::high_resolution_clock::now())) {
+		didWork = true;
+		workerFlushBatch(lastHBSend);
 	}
 
 	return didWork;
 }
 
+inline bool ZmqClient::workerSendMessage(MessageParts & message, ControlMessage control, time_point & lastHBSend) {
+	// zmq::socket_t::send empties the message
+	const size_t msgSize = message.size();
+	if (!frontend->send(ControlFrame::make(ClientType::Exporter, control), ZMQ_SNDMORE)) {
+		return false;
+	}
+	if (!workerSendParts(message)) {
+		workerSendFailed("message");
+		return false;
+	}
+	// update hb send since we sent a message
+	lastHBSend = std::chrono::high_resolution_clock::now();
+	workerReleaseBytes(msgSize);
+	return true;
+}
+
+inline bool ZmqClient::workerSendChunk(time_point & lastHBSend) {
+	MessageParts & message = *this->chunkMessage;
+	zmq::message_t & frame = this->chunkFrame == 0 ? message.payload : message.external[this->chunkFrame - 1];
+	const size_t frameSize = frame.size();
+	const size_t pieceSize = std::min(frameSize - this->chunkOffset, static_cast<size_t>(std::max(this->chunkSize.load(), 1)));
+
+	ChunkHeader header;
+	header.messageId = this->chunkId;
+	header.frameIndex = this->chunkFrame;
+	header.frameCount = static_cast<int>(message.external.size()) + 1;
+	header.control = this->chunkControl;
+	header.frameSize = frameSize;
+	header.offset = this->chunkOffset;
+
+	if (!frontend->send(ControlFrame::make(ClientType::Exporter, ControlMessage::DATA_CHUNK_MSG), ZMQ_SNDMORE)) {
+		return false;
+	}
+	bool sent = frontend->send(zmq::message_t(&header, sizeof(header)), ZMQ_SNDMORE);
+	if (sent && pieceSize) {
+		// the piece references the frame, the message is kept alive by the hint until zmq is done with it
+		char * pieceData = static_cast<char *>(frame.data()) + this->chunkOffset;
+		sent = frontend->send(zmq::message_t(pieceData, pieceSize, &ZmqClient::releaseChunk, new std::shared_ptr<MessageParts>(this->chunkMessage)));
+	} else if (sent) {
+		sent = frontend->send(zmq::message_t(0));
+	}
+	if (!sent) {
+		workerSendFailed("chunk");
+		return false;
+	}
+	lastHBSend = std::chrono::high_resolution_clock::now();
+
+	this->chunkOffset += pieceSize;
+	if (this->chunkOffset >= frameSize) {
+		this->chunkOffset = 0;
+		++this->chunkFrame;
+	}
+	if (this->chunkFrame == header.frameCount) {
+		this->chunkMessage.reset();
+		this->chunkMessages = 0;
+		workerReleaseBytes(this->chunkBytes);
+	}
+	return true;
+}
+
+inline void ZmqClient::releaseChunk(void *, void * hint) {
+	delete static_cast<std::shared_ptr<MessageParts> *>(hint);
+}
+
+inline void ZmqClient::workerReceiveChunk(const zmq::message_t & headerMsg, zmq::message_t & piece) {
+	ChunkHeader header;
+	if (headerMsg.size() != sizeof(header)) {
+		puts("ZMQ received chunk with invalid header, dropping it.");
+		return;
+	}
+	memcpy(&header, headerMsg.data(), sizeof(header));
+
+	if (header.frameIndex == 0 && header.offset == 0) {
+		ChunkAssembly & started = this->chunkRecv[header.messageId];
+		if (started.frameCount) {
+			puts("ZMQ received new chunked message with the id of an incomplete one, dropping the previous.");
+			started = ChunkAssembly();
+		}
+		started.frameCount = header.frameCount;
+	}
+
+	auto iter = this->chunkRecv.find(header.messageId);
+	if (iter == this->chunkRecv.end()) {
+		puts("ZMQ received chunk of unknown message, dropping it.");
+		return;
+	}
+	ChunkAssembly & assembly = iter->second;
+	// pieces of a message are sent in order, anything else means some were lost
+	if (header.frameCount < 1 || header.frameCount != assembly.frameCount
+		|| header.frameIndex != assembly.nextFrame || header.offset != assembly.nextOffset) {
+		puts("ZMQ received chunk out of order, dropping its message.");
+		this->chunkRecv.erase(iter);
+		return;
+	}
+	MessageParts & message = assembly.message;
+
+	if (header.offset == 0) {
+		// the previous frames are complete, so this one goes right after them
+		if (header.frameIndex == 0) {
+			message.payload.rebuild(static_cast<size_t>(header.frameSize));
+		} else {
+			message.external.emplace_back(static_cast<size_t>(header.frameSize));
+		}
+	}
+	zmq::message_t & frame = header.frameIndex == 0 ? message.payload : message.external.back();
+	if (frame.size() != header.frameSize || piece.size() > frame.size() - header.offset) {
+		puts("ZMQ received chunk not matching its message, dropping the message.");
+		this->chunkRecv.erase(iter);
+		return;
+	}
+	// copied straight to its place, so only the assembled message and one piece are in memory
+	memcpy(static_cast<char *>(frame.data()) + header.offset, piece.data(), piece.size());
+
+	assembly.nextOffset += piece.size();
+	if (assembly.nextOffset == header.frameSize) {
+		assembly.nextOffset = 0;
+		++assembly.nextFrame;
+	}
+	if (assembly.nextFrame == assembly.frameCount) {
+		MessageParts complete(std::move(message));
+		this->chunkRecv.erase(iter);
+		workerReceiveData(header.control, complete);
+	}
+}
+
+inline void ZmqClient::workerReceiveData(ControlMessage control, MessageParts & message) {
+	if (control == ControlMessage::DATA_MSG) {
+		workerDispatch(message);
+	} else if (control == ControlMessage::DATA_COMPRESSED_MSG) {
+		// received as [header][frames]
+		if (message.external.empty()) {
+			puts("ZMQ received compressed message without data, dropping it.");
+			return;
+		}
+		MessageParts frames(std::move(message.external[0]));
+		for (size_t c = 1; c < message.external.size(); ++c) {
+			frames.external.push_back(std::move(message.external[c]));
+		}
+		if (!PayloadCompression::decompress(message.payload, frames)) {
+			puts("ZMQ failed to decompress message, dropping it.");
+			return;
+		}
+		workerDispatch(frames);
+	} else {
+		printf("ZMQ received data with unknown control [%d], dropping it.\n", static_cast<int>(control));
+	}
+}
+
+inline bool ZmqClient::workerSendParts(MessageParts & message) {
+	message.ownPayload();
+	const size_t count = message.external.size();
+	bool sent = frontend->send(message.payload, count ? ZMQ_SNDMORE : 0);
+	for (size_t c = 0; c < count && sent; ++c) {
+		sent = frontend->send(message.external[c], c + 1 < count ? ZMQ_SNDMORE : 0);
+	}
+	return sent;
+}
+
+inline void ZmqClient::workerSendFailed(const char * what) {
+	printf("ZMQ failed to send %s after its control frame - stopping client.\n", what);
+	this->sendFailed = true;
+	this->isWorking = false;
+}
+
+inline bool ZmqClient::workerBatchDue(const time_point & now) const {
+	if (this->batchStream.getSize() >= static_cast<size_t>(this->batchMaxBytes.load())) {
+		return true;
+	}
+	// wait for more messages only while the queue is empty, as long as the time threshold allows
+	const auto batchAge = std::chrono::duration_cast<std::chrono::milliseconds>(now - this->batchBegin).count();
+	return this->messageQue.empty() && batchAge >= this->batchMaxDelay;
+}
+
+inline bool ZmqClient::workerFlushBatch(time_point & lastHBSend) {
+	if (!this->batchMessages) {
+		return true;
+	}
+
+	if (!frontend->send(ControlFrame::make(ClientType::Exporter, ControlMessage::DATA_BATCH_MSG), ZMQ_SNDMORE)) {
+		return false;
+	}
+	if (!frontend->send(zmq::message_t(this->batchStream.getData(), this->batchStream.getSize()))) {
+		workerSendFailed("batch");
+		return false;
+	}
+	lastHBSend = std::chrono::high_resolution_clock::now();
+
+	this->batchStream.clear();
+	this->batchMessages = 0;
+	workerReleaseBytes(this->batchPayloadBytes);
+	this->batchPayloadBytes = 0;
+	return true;
+}
+
+inline void ZmqClient::workerReleaseBytes(size_t size) {
+	const size_t remaining = queuedBytes.fetch_sub(size) - size;
+	if (remaining > lowWaterMark || !highWaterReached.exchange(false)) {
+		return;
+	}
+
+	{
+		// taking the mutex ensures a sender that just checked the limit is already waiting
+		std::lock_guard<std::mutex> lock(queueSpaceMutex);
+	}
+	queueSpaceCond.notify_all();
+
+	std::lock_guard<std::mutex> cbLock(callbackMutex);
+	if (this->lowWaterCallback) {
+		this->lowWaterCallback(this);
+	}
+}
+
+inline ZmqClient::QueueItem * ZmqClient::workerFront() {
+	QueueItem * item = this->messageQue.front();
+	if (!item) {
+		return nullptr;
+	}
+	if (item->slot) {
+		std::lock_guard<std::mutex> lock(conflationMutex);
+		auto iter = this->conflationIndex.find(item->slot->key);
+		if (iter != this->conflationIndex.end() && iter->second == item->slot) {
+			this->conflationIndex.erase(iter);
+		}
+		item->message = std::move(item->slot->message);
+		item->control = item->slot->control;
+		item->slot.reset();
+	}
+	return item;
+}
+
+inline void ZmqClient::workerDispatch(MessageParts & message) {
+	if (this->dispatcher) {
+		this->dispatcher->push(VRayMessage::fromZmqMessage(message, this->parseFlags));
+		return;
+	}
+	std::lock_guard<std::mutex> cbLock(callbackMutex);
+	if (this->callback) {
+		this->callback(VRayMessage::fromZmqMessage(message, this->parseFlags), this);
+	}
+}
+
+inline void ZmqClient::closeWakeupSockets() {
+	if (this->wakeupRecv) {
+		this->wakeupRecv->close();
+	}
+	std::lock_guard<std::mutex> lock(wakeupMutex);
+	if (this->wakeupSend) {
+		this->wakeupSend->close();
+		this->wakeupSend.reset();
+	}
+}
+
+inline void ZmqClient::wakeupWorker() {
+	// acq_rel so the worker's clearing exchange makes our previous pushes visible to it
+	if (wakeupPending.exchange(true, std::memory_order_acq_rel)) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(wakeupMutex);
+	if (!this->wakeupSend) {
+		return;
+	}
+	try {
+		zmq::message_t signal(0);
+		this->wakeupSend->send(signal, ZMQ_DONTWAIT);
+	} catch (zmq::error_t & ex) {
+		printf("ZMQ failed [%s] to wake up worker.\n", ex.what());
+	}
+}
+
 inline void ZmqClient::connect(const char * addr) {
 	std::random_device device;
 	std::mt19937_64 generator(device());
@@ -484,7 +1358,13 @@ inline void ZmqClient::connect(const char * addr) {
 }
 
 inline int ZmqClient::getOutstandingMessages() const {
-	return this->messageQue.size();
+	// queues first - the worker counts a message as batched or chunked before popping it
+	const int queued = this->controlQue.size() + this->messageQue.size();
+	return queued + this->chunkMessages + this->batchMessages;
+}
+
+inline size_t ZmqClient::getOutstandingBytes() const {
+	return this->queuedBytes;
 }
 
 inline bool ZmqClient::connected() const {
@@ -498,29 +1378,27 @@ inline bool ZmqClient::good() const {
 inline void ZmqClient::stopServer() {
 	serverStop = true;
 	isWorking = false;
+	wakeupWorker();
 }
 
 inline bool ZmqClient::waitForMessages(int timeout) {
 	timeout = std::min(timeout, 10000);
 	using namespace std::chrono;
-	{
-		std::lock_guard<std::mutex> lock(this->messageMutex);
-		if (this->messageQue.empty()) {
-			return true;
-		}
+	if (getOutstandingMessages() == 0) {
+		return true;
 	}
 
 	const auto waitBegin = high_resolution_clock::now();
 
 	while (isWorking) {
-		std::lock_guard<std::mutex> lock(this->messageMutex);
-		if (this->messageQue.empty()) {
+		if (getOutstandingMessages() == 0) {
 			return true;
 		}
 		const auto timePassed = duration_cast<milliseconds>(high_resolution_clock::now() - waitBegin).count();
 		if (timePassed >= timeout) {
 			return false;
 		}
+		std::this_thread::yield();
 	}
 
 	return false;
@@ -545,12 +1423,17 @@ inline void ZmqClient::syncStop() {
 		startServing = true;
 		startServingCond.notify_all();
 	}
+	wakeupWorker();
 
 	context.close();
 	if (worker.joinable()) {
 		worker.join();
 	}
 	worker = std::thread();
+
+	if (this->dispatcher) {
+		this->dispatcher->stop();
+	}
 }
 
 inline ZmqClient::~ZmqClient() {
@@ -565,22 +1448,574 @@ inline bool ZmqClient::getFlushOnexit() const {
 	return flushOnExit;
 }
 
+inline void ZmqClient::setBatching(int maxBytes, int maxDelay) {
+	batchMaxBytes = std::max(maxBytes, 0);
+	batchMaxDelay = std::max(maxDelay, 0);
+	wakeupWorker();
+}
+
 inline void ZmqClient::setCallback(ZmqOnMessageCallback cb) {
 	std::lock_guard<std::mutex> cbLock(callbackMutex);
 	this->callback = cb;
 }
 
+inline void ZmqClient::setDispatchThreads(int count) {
+	assert(!this->startServing && "ZmqClient::setDispatchThreads must be called before connect");
+	if (this->startServing) {
+		return;
+	}
+	if (count <= 0) {
+		this->dispatcher.reset();
+		return;
+	}
+	this->dispatcher.reset(new MessageDispatcher(count, [this] (const VRayMessage & message) {
+		ZmqOnMessageCallback cb;
+		{
+			// copy so dispatcher threads do not serialize on the mutex
+			std::lock_guard<std::mutex> cbLock(callbackMutex);
+			cb = this->callback;
+		}
+		if (cb) {
+			cb(message, this);
+		}
+	}));
+	this->dispatcher->setConflateImages(this->conflateImages);
+}
+
+inline void ZmqClient::setImageConflation(bool flag) {
+	this->conflateImages = flag;
+	if (this->dispatcher) {
+		this->dispatcher->setConflateImages(flag);
+	}
+}
+
+inline DispatchStats ZmqClient::getDispatchStats() const {
+	return this->dispatcher ? this->dispatcher->getStats() : DispatchStats();
+}
+
+inline void ZmqClient::setPriorityLanes(bool enable, int chunkSize) {
+	this->chunkSize = std::max(chunkSize, 0);
+	this->priorityLanes = enable;
+	wakeupWorker();
+}
+
+inline void ZmqClient::setCompression(int codecs, int minBytes, int level) {
+	assert(!this->startServing && "ZmqClient::setCompression must be called before connect");
+	if (this->startServing) {
+		return;
+	}
+	this->offeredCodecs = codecs & PayloadCompression::supportedCodecs();
+	if (this->offeredCodecs != codecs) {
+		puts("ZMQ some of the requested compression codecs are not built in, not offering them.");
+	}
+	this->compressionMinBytes = std::max(minBytes, 0);
+	this->compressionLevel = level;
+}
+
+inline CompressionCodec ZmqClient::getCompression() const {
+	return this->compressionCodec;
+}
+
+inline void ZmqClient::setWireFormat(WireFormat format) {
+	assert(!this->startServing && "ZmqClient::setWireFormat must be called before connect");
+	if (this->startServing) {
+		return;
+	}
+	this->offeredWireFormat = std::min(format, WIRE_FORMAT_LATEST);
+}
+
+inline WireFormat ZmqClient::getWireFormat() const {
+	return this->wireFormat;
+}
+
+inline MessageFormat ZmqClient::getMessageFormat() const {
+	MessageFormat format;
+	format.wireFormat = this->wireFormat;
+	if (this->features & static_cast<int>(ProtocolFeature::StringInterning)) {
+		format.strings = this->stringEncoder;
+	}
+	format.listPatches = (this->features & static_cast<int>(ProtocolFeature::ListPatches)) != 0;
+	format.compressed = this->compressionCodec != CompressionCodec::None;
+	format.pooledPayload = true;
+	return format;
+}
+
+inline int ZmqClient::getFeatures() const {
+	return this->features;
+}
+
+inline void ZmqClient::setDeduplication(size_t minBytes, size_t storeBytes) {
+	assert(!this->startServing && "ZmqClient::setDeduplication must be called before connect");
+	if (this->startServing) {
+		return;
+	}
+	this->dedupMinBytes = storeBytes ? minBytes : 0;
+	if (this->dedupMinBytes) {
+		this->dedupStore.reset(new FrameStore(storeBytes));
+	} else {
+		this->dedupStore.reset();
+	}
+}
+
+inline void ZmqClient::setStringInterning(bool enable) {
+	assert(!this->startServing && "ZmqClient::setStringInterning must be called before connect");
+	if (this->startServing) {
+		return;
+	}
+	const int feature = static_cast<int>(ProtocolFeature::StringInterning);
+	this->offeredFeatures = enable ? this->offeredFeatures | feature : this->offeredFeatures & ~feature;
+	this->stringEncoder.reset(enable ? new SessionStringEncoder() : nullptr);
+}
+
+inline void ZmqClient::setListPatches(bool enable) {
+	assert(!this->startServing && "ZmqClient::setListPatches must be called before connect");
+	if (this->startServing) {
+		return;
+	}
+	const int feature = static_cast<int>(ProtocolFeature::ListPatches);
+	this->offeredFeatures = enable ? this->offeredFeatures | feature : this->offeredFeatures & ~feature;
+}
+
+inline void ZmqClient::setConflation(bool flag) {
+	std::lock_guard<std::mutex> lock(conflationMutex);
+	this->conflation = flag;
+	this->conflationIndex.clear();
+}
+
+inline void ZmqClient::setParseFlags(int flags) {
+	parseFlags = flags;
+}
+
+inline void ZmqClient::setQueueLimits(size_t highWaterMark, size_t lowWaterMark) {
+	this->lowWaterMark = std::min(lowWaterMark, highWaterMark);
+	this->highWaterMark = highWaterMark;
+	if (highWaterMark && queuedBytes >= highWaterMark) {
+		// the new limit is already reached, so the low water callback follows
+		this->highWaterReached = true;
+	}
+	// wake anyone blocked on the old limit
+	{
+		std::lock_guard<std::mutex> lock(queueSpaceMutex);
+	}
+	queueSpaceCond.notify_all();
+}
+
+inline void ZmqClient::setLowWaterCallback(ZmqOnLowWaterCallback cb) {
+	std::lock_guard<std::mutex> cbLock(callbackMutex);
+	this->lowWaterCallback = cb;
+}
+
+inline bool ZmqClient::underHighWater() const {
+	const size_t limit = this->highWaterMark;
+	return !limit || this->queuedBytes < limit;
+}
+
+inline bool ZmqClient::isControlMessage(const MessageParts & message) {
+	VRayMessage::RendererAction action;
+	if (!VRayMessage::peekRendererAction(message.payload, action)) {
+		return false;
+	}
+	switch (action) {
+	case VRayMessage::RendererAction::Stop:
+	case VRayMessage::RendererAction::Pause:
+	case VRayMessage::RendererAction::Resume:
+	case VRayMessage::RendererAction::Resize:
+	case VRayMessage::RendererAction::SetRendererState:
+	case VRayMessage::RendererAction::SetQuality:
+	case VRayMessage::RendererAction::SetCurrentCamera:
+	case VRayMessage::RendererAction::SetVfbShow:
+	case VRayMessage::RendererAction::SetViewportImageFormat:
+	case VRayMessage::RendererAction::SetRenderRegion:
+	case VRayMessage::RendererAction::SetCropRegion:
+		return true;
+	default:
+		return false;
+	}
+}
+
+inline void ZmqClient::enqueue(MessageParts && message, ControlMessage control) {
+	// lane and keys are decided on the plain payload, before it is hashed or compressed
+	const bool isData = control == ControlMessage::DATA_MSG;
+	const bool controlLane = isData && this->priorityLanes && isControlMessage(message);
+	const bool conflate = !controlLane && this->conflation;
+	std::string key, propertyKey;
+	if (isData && !controlLane && (conflate || this->activeStreams)) {
+		VRayMessage::PluginAction action = VRayMessage::PluginAction::None;
+		if (getPropertyKey(message, propertyKey, action) && action == VRayMessage::PluginAction::Update) {
+			key = propertyKey;
+		}
+	}
+	// on the sending thread, so the worker only does IO and pings are never late behind a big message
+	if (isData && !controlLane) {
+		if (this->dedupStore && FrameDedup::prepareHashed(*this->dedupStore, this->dedupMinBytes, message)) {
+			// hashed frames are mostly references, they are never compressed
+			control = ControlMessage::DATA_HASHED_MSG;
+		} else {
+			control = compressMessage(message);
+		}
+	}
+	const size_t size = message.size();
+	const size_t limit = this->highWaterMark;
+	// count bytes before push so the worker never releases more than was added
+	const size_t queued = queuedBytes.fetch_add(size) + size;
+	if (limit && queued >= limit) {
+		highWaterReached = true;
+	}
+	QueueItem item(std::move(message), control);
+	if (controlLane) {
+		this->controlQue.push(std::move(item));
+	} else if (propertyKey.empty() || !this->activeStreams || !holdForStream(propertyKey, key, item)) {
+		pushData(std::move(item), conflate, std::move(key));
+	}
+	wakeupWorker();
+}
+
+inline void ZmqClient::pushData(QueueItem && item, bool conflate, std::string && key) {
+	// taken before the push, the worker may send and free the message right after it
+	std::vector<WireSize> definitions;
+	definitions.swap(item.message.definitions);
+	if (conflate) {
+		if (!definitions.empty()) {
+			// a barrier - later messages referencing the names must not replace updates queued before it,
+			// and it is never replaced itself
+			key.clear();
+		}
+		enqueueConflated(std::move(item.message), item.control, std::move(key));
+	} else {
+		this->messageQue.push(std::move(item));
+	}
+	// messages made from now on reference the names, they are queued after this one
+	if (this->stringEncoder) {
+		this->stringEncoder->commit(definitions);
+	}
+}
+
+inline bool ZmqClient::holdForStream(const std::string & key, std::string & conflationKey, QueueItem & item) {
+	std::lock_guard<std::mutex> lock(streamMutex);
+	auto iter = this->streamedProperties.find(key);
+	if (iter == this->streamedProperties.end()) {
+		return false;
+	}
+	iter->second.held.emplace_back(std::move(conflationKey), std::move(item));
+	return true;
+}
+
+inline void ZmqClient::beginStream(const std::string & key) {
+	std::lock_guard<std::mutex> lock(streamMutex);
+	++this->streamedProperties[key].streams;
+	++this->activeStreams;
+}
+
+inline void ZmqClient::endStream(const std::string & key) {
+	{
+		// held updates are queued under the lock, so an update sent after the stream can not go before them
+		std::lock_guard<std::mutex> lock(streamMutex);
+		auto iter = this->streamedProperties.find(key);
+		if (iter == this->streamedProperties.end()) {
+			return;
+		}
+		--this->activeStreams;
+		if (--iter->second.streams) {
+			return;
+		}
+		for (auto & held : iter->second.held) {
+			pushData(std::move(held.second), this->conflation, std::move(held.first));
+		}
+		this->streamedProperties.erase(iter);
+	}
+	wakeupWorker();
+}
+
+inline bool ZmqClient::getConflationKey(const MessageParts & message, std::string & key) const {
+	VRayMessage::PluginAction action = VRayMessage::PluginAction::None;
+	if (!getPropertyKey(message, key, action) || action != VRayMessage::PluginAction::Update) {
+		key.clear();
+		return false;
+	}
+	return true;
+}
+
+inline bool ZmqClient::getPropertyKey(const MessageParts & message, std::string & key, VRayMessage::PluginAction & action) const {
+	std::string plugin, property;
+	if (!VRayMessage::peekPluginProperty(message.payload, plugin, property, action, this->stringEncoder.get())) {
+		key.clear();
+		return false;
+	}
+	key = makePropertyKey(plugin, property);
+	return true;
+}
+
+inline std::string ZmqClient::makePropertyKey(const std::string & plugin, const std::string & property) {
+	std::string key;
+	key.reserve(plugin.size() + 1 + property.size());
+	key += plugin;
+	key.push_back('\0');
+	key += property;
+	return key;
+}
+
+inline void ZmqClient::enqueueConflated(MessageParts && message, ControlMessage control, std::string && key) {
+	// push under the lock so slots in the index are always in the queue
+	std::lock_guard<std::mutex> lock(conflationMutex);
+	if (key.empty()) {
+		// updates queued before this message must not be replaced by ones sent after it
+		this->conflationIndex.clear();
+		this->messageQue.push(QueueItem(std::move(message), control));
+		return;
+	}
+
+	auto iter = this->conflationIndex.find(key);
+	if (iter != this->conflationIndex.end()) {
+		MessageParts & queued = iter->second->message;
+		// new size is already counted by enqueue
+		queuedBytes -= queued.size();
+		queued = std::move(message);
+		iter->second->control = control;
+		return;
+	}
+
+	std::shared_ptr<ConflationSlot> slot(new ConflationSlot);
+	slot->message = std::move(message);
+	slot->control = control;
+	slot->key = key;
+	this->conflationIndex.emplace(std::move(key), slot);
+	this->messageQue.push(QueueItem(std::move(slot)));
+}
+
+inline ControlMessage ZmqClient::compressMessage(MessageParts & message) {
+	const CompressionCodec codec = this->compressionCodec;
+	if (codec == CompressionCodec::None || message.size() < static_cast<size_t>(this->compressionMinBytes.load())) {
+		return ControlMessage::DATA_MSG;
+	}
+	// the payload ends up in the frames of the compressed message
+	message.ownPayload();
+	zmq::message_t header;
+	if (!PayloadCompression::compress(codec, this->compressionLevel, message, header)) {
+		return ControlMessage::DATA_MSG;
+	}
+	// sent as [header][frames], workerSendParts sends it as it is
+	MessageParts wire(std::move(header));
+	wire.definitions = std::move(message.definitions);
+	wire.external.reserve(message.external.size() + 1);
+	wire.external.push_back(std::move(message.payload));
+	for (auto & frame : message.external) {
+		wire.external.push_back(std::move(frame));
+	}
+	message = std::move(wire);
+	return ControlMessage::DATA_COMPRESSED_MSG;
+}
+
+inline void ZmqClient::workerFinishHashed(QueueItem & item) {
+	const size_t before = item.message.size();
+	FrameDedup::finishHashed(*this->dedupStore, item.message);
+	const size_t after = item.message.size();
+	if (after < before) {
+		workerReleaseBytes(before - after);
+	}
+}
+
+inline void ZmqClient::workerAnswerFrameRequest(const zmq::message_t & request) {
+	if (!this->dedupStore || request.size() % sizeof(ContentHash)) {
+		puts("ZMQ received unexpected frame request, dropping it.");
+		return;
+	}
+	const size_t count = request.size() / sizeof(ContentHash);
+	for (size_t c = 0; c < count; ++c) {
+		ContentHash hash;
+		memcpy(&hash, static_cast<const char *>(request.data()) + c * sizeof(hash), sizeof(hash));
+		// answered in the control lane, the server holds back the messages waiting for these frames
+		MessageParts body = FrameDedup::makeBody(*this->dedupStore, hash);
+		queuedBytes += body.size();
+		this->controlQue.push(QueueItem(std::move(body), ControlMessage::FRAME_BODY_MSG));
+	}
+}
+
+inline bool ZmqClient::trySend(MessageParts && message) {
+	// the enqueue that reached the limit set highWaterReached, so the low water callback follows this
+	if (!underHighWater()) {
+		return false;
+	}
+	enqueue(std::move(message));
+	return true;
+}
+
+inline bool ZmqClient::waitForQueueSpace(int timeout) {
+	using namespace std::chrono;
+	const auto waitEnd = high_resolution_clock::now() + milliseconds(std::max(timeout, 0));
+
+	// the queue is over the limit only after an enqueue set highWaterReached, so the worker notifies when it
+	// drains to the low water mark, it takes the mutex before notifying so the check below can not miss it
+	std::unique_lock<std::mutex> lock(queueSpaceMutex);
+	while (!underHighWater()) {
+		if (!isWorking) {
+			return false;
+		}
+		if (timeout < 0) {
+			queueSpaceCond.wait(lock);
+		} else if (queueSpaceCond.wait_until(lock, waitEnd) == std::cv_status::timeout && !underHighWater()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+inline bool ZmqClient::sendBlocking(MessageParts && message, int timeout) {
+	if (!waitForQueueSpace(timeout)) {
+		return false;
+	}
+	enqueue(std::move(message));
+	return true;
+}
+
+inline bool ZmqClient::sendChunk(const ChunkHeader & header, zmq::message_t && piece) {
+	MessageParts parts(zmq::message_t(&header, sizeof(header)));
+	parts.external.push_back(std::move(piece));
+	if (!waitForQueueSpace(-1)) {
+		return false;
+	}
+	enqueue(std::move(parts), ControlMessage::DATA_CHUNK_MSG);
+	return true;
+}
+
 inline void ZmqClient::send(zmq::message_t && message) {
-	std::lock_guard<std::mutex> lock(this->messageMutex);
-	this->messageQue.push_back(std::move(message));
+	enqueue(MessageParts(std::move(message)));
 }
 
-inline void ZmqClient::send(const void * data, int size) {
-	zmq::message_t msg(data, size);
+inline void ZmqClient::send(MessageParts && message) {
+	enqueue(std::move(message));
+}
 
-	std::lock_guard<std::mutex> lock(this->messageMutex);
-	this->messageQue.push_back(std::move(msg));
+inline void ZmqClient::send(const void * data, size_t size) {
+	enqueue(MessageParts(zmq::message_t(data, size)));
 }
 
 
+
+/// Sends one POD list property in pieces as its items are written, made by ZmqClient::streamProperty
+/// Exactly the announced number of items must be written, missing items are sent as zeros by finish
+/// Must be used from one thread and must not outlive its client
+template <typename T>
+class PropertyStream {
+public:
+	PropertyStream(PropertyStream && other)
+	    : client(other.client)
+	    , key(std::move(other.key))
+	    , header(other.header)
+	    , piece(std::move(other.piece))
+	    , pieceSize(other.pieceSize)
+	    , pieceFill(other.pieceFill)
+	    , headerBytes(other.headerBytes)
+	    , listBytes(other.listBytes)
+	    , written(other.written)
+	    , finished(other.finished)
+	    , failed(other.failed)
+	{
+		other.finished = true;
+	}
+
+	~PropertyStream() {
+		finish();
+	}
+
+	/// Append items to the list, every full piece is queued right away
+	/// @return - false if the client stopped, the rest of the stream is discarded
+	bool write(const T * items, size_t count) {
+		const char * data = reinterpret_cast<const char *>(items);
+		size_t bytes = count * sizeof(T);
+		if (written + bytes > listBytes) {
+			assert(!"PropertyStream::write past the announced count");
+			bytes = static_cast<size_t>(listBytes - written);
+		}
+		while (bytes && !failed) {
+			if (!pieceFill && !piece.size()) {
+				piece.rebuild(std::min(pieceSize, static_cast<size_t>(listBytes - written)));
+			}
+			const size_t copy = std::min(bytes, piece.size() - pieceFill);
+			memcpy(static_cast<char *>(piece.data()) + pieceFill, data, copy);
+			pieceFill += copy;
+			written += copy;
+			data += copy;
+			bytes -= copy;
+			if (pieceFill == piece.size()) {
+				flushPiece();
+			}
+		}
+		return !failed;
+	}
+
+	/// Send the rest of the list, called by the destructor if not called before
+	/// @return - false if the client stopped before the whole list was queued
+	bool finish() {
+		if (finished) {
+			return !failed;
+		}
+		if (written < listBytes) {
+			puts("ZMQ PropertyStream finished before all items were written, sending zeros for the rest.");
+			const char zeros[4096] = {0};
+			while (written < listBytes && !failed) {
+				write(reinterpret_cast<const T *>(zeros), std::max<size_t>(1, std::min<size_t>(sizeof(zeros) / sizeof(T), static_cast<size_t>((listBytes - written) / sizeof(T)))));
+			}
+		}
+		finished = true;
+		client.endStream(key);
+		return !failed;
+	}
+
+private:
+	friend class ZmqClient;
+
+	/// @payload - start of the payload made by msgPluginSetPropertyStreamed, the items follow it in the same frame
+	PropertyStream(ZmqClient & client, std::string && key, uint32_t messageId, MessageParts && payload, size_t count, int pieceSize)
+	    : client(client)
+	    , key(std::move(key))
+	    , piece(0)
+	    , pieceSize(std::max(static_cast<size_t>(std::max(pieceSize, 1)), sizeof(T)))
+	    , pieceFill(0)
+	    , headerBytes(payload.payload.size())
+	    , listBytes(count * sizeof(T))
+	    , written(0)
+	    , finished(false)
+	    , failed(false)
+	{
+		header.messageId = messageId;
+		header.frameIndex = 0;
+		header.frameCount = 1;
+		header.control = ControlMessage::DATA_MSG;
+		header.frameSize = headerBytes + listBytes;
+		header.offset = 0;
+		client.beginStream(this->key);
+		payload.ownPayload();
+		failed = !client.sendChunk(header, std::move(payload.payload));
+	}
+
+	PropertyStream(const PropertyStream &) = delete;
+	PropertyStream & operator=(const PropertyStream &) = delete;
+
+	/// Queue the current piece
+	void flushPiece() {
+		header.offset = headerBytes + written - pieceFill;
+		failed = failed || !client.sendChunk(header, std::move(piece));
+		piece.rebuild(0);
+		pieceFill = 0;
+	}
+
+	ZmqClient & client; ///< Client queueing the pieces
+	std::string key; ///< Property key of the streamed property, its other updates are held back until finish
+	ChunkHeader header; ///< Header for the next piece of the payload
+	zmq::message_t piece; ///< Piece being filled
+	size_t pieceSize; ///< Max bytes in a piece
+	size_t pieceFill; ///< Bytes written in @piece
+	uint64_t headerBytes; ///< Size of the payload before the items, sent as the first piece
+	uint64_t listBytes; ///< Size of all items
+	uint64_t written; ///< Bytes of items written so far
+	bool finished; ///< Set by finish()
+	bool failed; ///< Set if the client stopped
+};
+
+template <typename T>
+inline PropertyStream<T> ZmqClient::streamProperty(const std::string & plugin, const std::string & property, size_t count, int pieceSize) {
+	return PropertyStream<T>(*this, makePropertyKey(plugin, property), this->nextChunkId++,
+	                         VRayMessage::msgPluginSetPropertyStreamed<T>(plugin, property, count, getMessageFormat()), count, pieceSize);
+}
+
 #endif // _ZMQ_WRAPPER_H_